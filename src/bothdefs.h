@@ -253,6 +253,7 @@ char	*va (const char *format, ...);
 
 void	*Q_malloc (size_t size);
 void	*Q_calloc (size_t n, size_t size);
+void	*Q_realloc (void *p, size_t size);
 #define	Q_free(ptr)	if(ptr) { free(ptr); ptr = NULL; }
 
 char	*Q_strdup (const char *src);
@@ -559,6 +559,16 @@ void *Q_calloc (size_t n, size_t size)
 	return p;
 }
 
+void *Q_realloc (void *p, size_t size)
+{
+	p = realloc(p, size);
+
+	if (!p)
+		Sys_Error ("Q_realloc: Not enough memory free");
+
+	return p;
+}
+
 /*
 ===================
 Q_strdup
@@ -24,6 +24,14 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "cvar.h"
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 typedef struct cnode_s {
 	// common with leaf
 	int                contents; // 0, to differentiate from leafs
@@ -47,6 +55,7 @@ static char			loadname[32];	// for hunk tags
 
 static char			map_name[MAX_QPATH];
 static unsigned int	map_checksum, map_checksum2;
+static unsigned int	map_entitysum;		// entities lump, only for the map cache
 
 static int			numcmodels;
 static cmodel_t		map_cmodels[MAX_MAP_MODELS];
@@ -68,15 +77,23 @@ static byte			map_novis[MAX_MAP_LEAFS/8];
 
 static byte			*map_pvs;					// fully expanded and decompressed
 static byte			*map_phs;					// only valid if we are the server
+static int			*map_phs_rows;				// offset of every row in map_phs if it is compressed
+static byte			map_phs_row[MAX_MAP_LEAFS/8 + 4];	// compressed row expanded by CM_LeafPHS
 static int			map_vis_rowbytes;			// for both pvs and phs
 static int			map_vis_rowlongs;			// map_vis_rowbytes / 4
 
 static char			*map_entitystring;
+static int			map_entitylen;
+
+static byte			*map_cache;					// the map cache file, if the map came from there
+static int			map_cachesize;
 
 static qbool		map_halflife;
 
 static byte			*cmod_base;					// for CM_Load* functions
 
+static void CM_DecompressRow(const byte *in, const byte *end, byte *out, int rowbytes);
+
 
 /*
 ===============================================================================
@@ -89,6 +106,7 @@ HULL BOXES
 static hull_t		box_hull;
 static mclipnode_t	box_clipnodes[6];
 static mplane_t		box_planes[6];
+static cflatnode_t	box_flatnodes[6];
 
 /*
 ** CM_InitBoxHull
@@ -104,6 +122,7 @@ static void CM_InitBoxHull(void)
 	box_hull.planes = box_planes;
 	box_hull.firstclipnode = 0;
 	box_hull.lastclipnode = 5;
+	box_hull.flatnodes = box_flatnodes;
 
 	for (i = 0; i < 6; i++) {
 		box_clipnodes[i].planenum = i;
@@ -112,6 +131,11 @@ static void CM_InitBoxHull(void)
 		box_clipnodes[i].children[side ^ 1] = (i != 5) ? (i + 1) : CONTENTS_SOLID;
 		box_planes[i].type = i >> 1;
 		box_planes[i].normal[i >> 1] = 1;
+
+		box_flatnodes[i].type = box_planes[i].type;
+		box_flatnodes[i].normal[i >> 1] = 1;
+		box_flatnodes[i].children[0] = box_clipnodes[i].children[0];
+		box_flatnodes[i].children[1] = box_clipnodes[i].children[1];
 	}
 }
 
@@ -130,10 +154,38 @@ hull_t *CM_HullForBox (vec3_t mins, vec3_t maxs)
 	box_planes[4].dist = maxs[2];
 	box_planes[5].dist = mins[2];
 
+	box_flatnodes[0].dist = maxs[0];
+	box_flatnodes[1].dist = mins[0];
+	box_flatnodes[2].dist = maxs[1];
+	box_flatnodes[3].dist = mins[1];
+	box_flatnodes[4].dist = maxs[2];
+	box_flatnodes[5].dist = mins[2];
+
 	return &box_hull;
 }
 
-int CM_HullPointContents(hull_t *hull, int num, vec3_t p)
+static int FlatPointContents(hull_t *hull, int num, vec3_t p)
+{
+	const cflatnode_t *node;
+	float d;
+
+	while (num >= 0) {
+		if (num < hull->firstclipnode || num > hull->lastclipnode) {
+			if (map_halflife && num == hull->lastclipnode + 1) {
+				return CONTENTS_EMPTY;
+			}
+			Sys_Error("CM_HullPointContents: bad node number");
+		}
+
+		node = hull->flatnodes + num;
+		d = PlaneDiff(p, node);
+		num = (d < 0) ? node->children[1] : node->children[0];
+	}
+
+	return num;
+}
+
+static int ClipnodePointContents(hull_t *hull, int num, vec3_t p)
 {
 	mclipnode_t *node;
 	mplane_t *plane;
@@ -157,6 +209,14 @@ int CM_HullPointContents(hull_t *hull, int num, vec3_t p)
 	return num;
 }
 
+int CM_HullPointContents(hull_t *hull, int num, vec3_t p)
+{
+	if (hull->flatnodes)
+		return FlatPointContents(hull, num, p);
+
+	return ClipnodePointContents(hull, num, p);
+}
+
 /*
 ===============================================================================
 
@@ -295,35 +355,335 @@ start:
 	return TR_BLOCKED;
 }
 
-trace_t CM_HullTrace (hull_t *hull, vec3_t start, vec3_t end)
+/*
+==================
+FlatHullTrace
+
+Same walk as RecursiveHullTrace, on hull->flatnodes and with an explicit
+stack instead of recursion.  Every float is computed the same way, so the
+results are bit-identical.  Returns TR_OVERFLOW if the tree is deeper than
+the stack, the caller then has to start over with RecursiveHullTrace
+==================
+*/
+#define	TR_OVERFLOW		-1
+#define	HULLTRACE_STACK	256
+
+typedef struct {
+	int		num;
+	int		nearside;
+	int		oldcheck;			// -1 until the near side returned
+	float	t1, t2;
+	float	p1f, midf, p2f;
+	vec3_t	p1, mid, p2;
+} hulltraceframe_t;
+
+static int FlatHullTrace (hulltrace_local_t *htl, int num, const vec3_t start, const vec3_t end)
 {
-	int check;
+	hulltraceframe_t stack[HULLTRACE_STACK], *f = NULL;
+	const cflatnode_t *nodes = htl->hull->flatnodes, *node;
+	hull_t *hull = htl->hull;
+	trace_t *trace = &htl->trace;
+	int depth = 0, check, i;
+	float t1, t2, frac, p1f = 0, p2f = 1;
+	vec3_t p1, p2;
 
-	// this structure is passed as a pointer to RecursiveHullTrace
-	// so as not to use much stack but still be thread safe
-	hulltrace_local_t htl;
-	htl.hull = hull;
-	htl.leafcount = 0;
-	// fill in a default trace
-	memset (&htl.trace, 0, sizeof(htl.trace));
-	htl.trace.fraction = 1;
-	htl.trace.startsolid = false;
-	VectorCopy (end, htl.trace.endpos);
+	VectorCopy (start, p1);
+	VectorCopy (end, p2);
+
+	while (1) {
+		// go down until the segment ends up in a leaf
+		check = -1;
+		while (num >= 0) {
+			if (num < hull->firstclipnode || num > hull->lastclipnode)
+			{
+				if (map_halflife && num == hull->lastclipnode + 1) {
+					check = TR_EMPTY;
+					break;
+				}
+				Sys_Error ("FlatHullTrace: bad node number");
+			}
+
+			node = nodes + num;
+			if (node->type < 3) {
+				t1 = p1[node->type] - node->dist;
+				t2 = p2[node->type] - node->dist;
+			}
+			else {
+				t1 = DotProduct (node->normal, p1) - node->dist;
+				t2 = DotProduct (node->normal, p2) - node->dist;
+			}
+
+			if (t1 >= 0 && t2 >= 0) {
+				num = node->children[0];
+				continue;
+			}
+			if (t1 < 0 && t2 < 0) {
+				num = node->children[1];
+				continue;
+			}
+
+			if (depth == HULLTRACE_STACK)
+				return TR_OVERFLOW;
+
+			// split, remember the far side and do the near side first
+			f = &stack[depth++];
+			frac = t1 / (t1 - t2);
+			frac = bound (0, frac, 1);
+			f->midf = p1f + (p2f - p1f)*frac;
+			for (i = 0; i < 3; i++)
+				f->mid[i] = p1[i] + frac*(p2[i] - p1[i]);
+			f->num = num;
+			f->t1 = t1;
+			f->t2 = t2;
+			f->p1f = p1f;
+			f->p2f = p2f;
+			VectorCopy (p1, f->p1);
+			VectorCopy (p2, f->p2);
+			f->nearside = (t1 < t2) ? 1 : 0;
+			f->oldcheck = -1;
+
+			num = node->children[f->nearside];
+			p2f = f->midf;
+			VectorCopy (f->mid, p2);
+		}
+
+		if (check < 0) {
+			// this is a leaf node
+			htl->leafcount++;
+			if (num == CONTENTS_SOLID) {
+				if (htl->leafcount == 1)
+					trace->startsolid = true;
+				check = TR_SOLID;
+			}
+			else {
+				if (num == CONTENTS_EMPTY)
+					trace->inopen = true;
+				else
+					trace->inwater = true;
+				check = TR_EMPTY;
+			}
+		}
+
+		// return the result up until some split still has its far side to do
+		while (depth) {
+			f = &stack[depth - 1];
+
+			if (f->oldcheck < 0) {
+				if (check == TR_BLOCKED) {
+					depth--;
+					continue;
+				}
 
-	check = RecursiveHullTrace (&htl, hull->firstclipnode, 0, 1, start, end);
+				// if we started in solid, allow us to move out to an empty area
+				if (check == TR_SOLID && (trace->inopen || trace->inwater)) {
+					depth--;
+					continue;
+				}
+
+				f->oldcheck = check;
+				break;
+			}
 
+			depth--;
+			if (check == TR_EMPTY || check == TR_BLOCKED)
+				continue;
+			if (f->oldcheck != TR_EMPTY)
+				continue;	// still in solid
+
+			// near side is empty, far side is solid
+			// this is the impact point
+			node = nodes + f->num;
+			if (!f->nearside) {
+				VectorCopy (node->normal, trace->plane.normal);
+				trace->plane.dist = node->dist;
+			}
+			else {
+				VectorNegate (node->normal, trace->plane.normal);
+				trace->plane.dist = -node->dist;
+			}
+
+			// put the final point DIST_EPSILON pixels on the near side
+			if (f->t1 < f->t2)
+				frac = (f->t1 + DIST_EPSILON) / (f->t1 - f->t2);
+			else
+				frac = (f->t1 - DIST_EPSILON) / (f->t1 - f->t2);
+			frac = bound (0, frac, 1);
+			trace->fraction = f->p1f + (f->p2f - f->p1f)*frac;
+			for (i = 0; i < 3; i++)
+				trace->endpos[i] = f->p1[i] + frac*(f->p2[i] - f->p1[i]);
+
+			check = TR_BLOCKED;
+		}
+
+		if (!depth)
+			return check;
+
+		// go past the node
+		num = nodes[f->num].children[1 - f->nearside];
+		p1f = f->midf;
+		p2f = f->p2f;
+		VectorCopy (f->mid, p1);
+		VectorCopy (f->p2, p2);
+	}
+}
+
+static void CM_HullTraceInit (hulltrace_local_t *htl, hull_t *hull, vec3_t end)
+{
+	htl->hull = hull;
+	htl->leafcount = 0;
+	// fill in a default trace
+	memset (&htl->trace, 0, sizeof(htl->trace));
+	htl->trace.fraction = 1;
+	htl->trace.startsolid = false;
+	VectorCopy (end, htl->trace.endpos);
+}
+
+static void CM_HullTraceFinish (hulltrace_local_t *htl, int check, vec3_t start)
+{
 	if (check == TR_SOLID) {
-		htl.trace.startsolid = htl.trace.allsolid = true;
+		htl->trace.startsolid = htl->trace.allsolid = true;
 		// it would be logical to set fraction to 0, but original id code
 		// would leave it at 1.   We emulate that just in case.
 		// (FIXME: is it just QW, or NQ as well?)
 		//htl.trace.fraction = 0;
-		VectorCopy (start, htl.trace.endpos);
+		VectorCopy (start, htl->trace.endpos);
+	}
+}
+
+// the last traces through map hulls, replayed by sv_hulltrace_bench,
+// only recorded after "sv_hulltrace_bench record"
+#define	MAX_RECORDED_TRACES	4096
+
+typedef struct {
+	hull_t	*hull;
+	vec3_t	start, end;
+} recordedtrace_t;
+
+static recordedtrace_t	recordedtraces[MAX_RECORDED_TRACES];
+static unsigned int		numrecordedtraces;
+static qbool			recordtraces;
+
+trace_t CM_HullTrace (hull_t *hull, vec3_t start, vec3_t end)
+{
+	int check;
+
+	// this structure is passed as a pointer to RecursiveHullTrace
+	// so as not to use much stack but still be thread safe
+	hulltrace_local_t htl;
+
+	if (recordtraces && hull != &box_hull) {
+		recordedtrace_t *r = &recordedtraces[Sys_AtomicAdd (&numrecordedtraces, 1) & (MAX_RECORDED_TRACES - 1)];
+		r->hull = hull;
+		VectorCopy (start, r->start);
+		VectorCopy (end, r->end);
 	}
 
+	CM_HullTraceInit (&htl, hull, end);
+
+	check = TR_OVERFLOW;
+	if (hull->flatnodes)
+		check = FlatHullTrace (&htl, hull->firstclipnode, start, end);
+	if (check == TR_OVERFLOW) {
+		CM_HullTraceInit (&htl, hull, end);
+		check = RecursiveHullTrace (&htl, hull->firstclipnode, 0, 1, start, end);
+	}
+
+	CM_HullTraceFinish (&htl, check, start);
+
 	return htl.trace;
 }
 
+/*
+==================
+CM_HullTraceBench_f
+
+"record" starts recording traces, without it the recorded traces are
+replayed through both RecursiveHullTrace and FlatHullTrace, the results
+checked to be bit-identical and timed
+==================
+*/
+void CM_HullTraceBench_f (void)
+{
+	hulltrace_local_t htl1, htl2;
+	recordedtrace_t *r;
+	int i, j, check1, check2, count, loops, mismatches = 0, overflows = 0;
+	double start, t_recursive, t_flat;
+
+	if (!map_name[0]) {
+		Con_Printf ("No map loaded\n");
+		return;
+	}
+
+	if (Cmd_Argc () > 1 && !strcmp (Cmd_Argv (1), "record")) {
+		numrecordedtraces = 0;
+		recordtraces = true;
+		Con_Printf ("Recording traces, run %s again to replay them\n", Cmd_Argv (0));
+		return;
+	}
+
+	recordtraces = false;
+
+	count = min (numrecordedtraces, MAX_RECORDED_TRACES);
+	if (!count) {
+		Con_Printf ("No traces recorded, start with \"%s record\"\n", Cmd_Argv (0));
+		return;
+	}
+
+	loops = Cmd_Argc () > 1 ? bound (1, Q_atoi (Cmd_Argv (1)), 1000) : 10;
+
+	// same answers?
+	for (i = 0, r = recordedtraces; i < count; i++, r++) {
+		CM_HullTraceInit (&htl1, r->hull, r->end);
+		check1 = RecursiveHullTrace (&htl1, r->hull->firstclipnode, 0, 1, r->start, r->end);
+		CM_HullTraceFinish (&htl1, check1, r->start);
+
+		if (!r->hull->flatnodes) {
+			overflows++;
+			continue;
+		}
+
+		CM_HullTraceInit (&htl2, r->hull, r->end);
+		check2 = FlatHullTrace (&htl2, r->hull->firstclipnode, r->start, r->end);
+		if (check2 == TR_OVERFLOW) {
+			overflows++;
+			continue;
+		}
+		CM_HullTraceFinish (&htl2, check2, r->start);
+
+		if (check1 != check2 || htl1.leafcount != htl2.leafcount || memcmp (&htl1.trace, &htl2.trace, sizeof(trace_t))
+			|| FlatPointContents (r->hull, r->hull->firstclipnode, r->start) != ClipnodePointContents (r->hull, r->hull->firstclipnode, r->start))
+			mismatches++;
+	}
+
+	start = Sys_DoubleTime ();
+	for (j = 0; j < loops; j++)
+		for (i = 0, r = recordedtraces; i < count; i++, r++) {
+			CM_HullTraceInit (&htl1, r->hull, r->end);
+			RecursiveHullTrace (&htl1, r->hull->firstclipnode, 0, 1, r->start, r->end);
+		}
+	t_recursive = Sys_DoubleTime () - start;
+
+	start = Sys_DoubleTime ();
+	for (j = 0; j < loops; j++)
+		for (i = 0, r = recordedtraces; i < count; i++, r++) {
+			if (!r->hull->flatnodes)
+				continue;
+			CM_HullTraceInit (&htl2, r->hull, r->end);
+			FlatHullTrace (&htl2, r->hull->firstclipnode, r->start, r->end);
+		}
+	t_flat = Sys_DoubleTime () - start;
+
+	Con_Printf ("%d traces x %d\n", count, loops);
+	Con_Printf ("recursive : %8.3f ms, %6.3f us/trace\n", t_recursive * 1000, t_recursive * 1000000 / (count * loops));
+	Con_Printf ("flat      : %8.3f ms, %6.3f us/trace\n", t_flat * 1000, t_flat * 1000000 / (count * loops));
+	if (overflows)
+		Con_Printf ("%d traces couldn't use the flat hulls\n", overflows);
+	if (mismatches)
+		Con_Printf ("%d traces gave different results\n", mismatches);
+	else
+		Con_Printf ("all results identical\n");
+}
+
 //===========================================================================
 
 int	CM_NumInlineModels (void)
@@ -396,6 +756,12 @@ byte *CM_LeafPHS (const cleaf_t *leaf)
 		return NULL;
 	}
 
+	if (map_phs_rows) {
+		byte *row = map_phs + map_phs_rows[leaf - 1 - map_leafs];
+		CM_DecompressRow (row, map_phs + map_phs_rows[visleafs], map_phs_row, map_vis_rowbytes);
+		return map_phs_row;
+	}
+
 	return map_phs + (leaf - 1 - map_leafs) * map_vis_rowbytes;
 }
 
@@ -410,11 +776,9 @@ crosses a waterline.
 =============================================================================
 */
 
-static int	fatbytes;
 static byte	fatpvs[MAX_MAP_LEAFS/8];
-static vec3_t	fatpvs_org;
 
-static void AddToFatPVS_r (cnode_t *node)
+static void AddToFatPVS_r (cnode_t *node, const vec3_t org, byte *fat, int fatbytes)
 {
 	int i;
 	float d;
@@ -429,20 +793,20 @@ static void AddToFatPVS_r (cnode_t *node)
 			{
 				pvs = CM_LeafPVS ( (cleaf_t *)node);
 				for (i=0 ; i<fatbytes ; i++)
-					fatpvs[i] |= pvs[i];
+					fat[i] |= pvs[i];
 			}
 			return;
 		}
 
 		plane = node->plane;
-		d = DotProduct (fatpvs_org, plane->normal) - plane->dist;
+		d = DotProduct (org, plane->normal) - plane->dist;
 		if (d > 8)
 			node = node->children[0];
 		else if (d < -8)
 			node = node->children[1];
 		else
 		{ // go down both
-			AddToFatPVS_r (node->children[0]);
+			AddToFatPVS_r (node->children[0], org, fat, fatbytes);
 			node = node->children[1];
 		}
 	}
@@ -458,12 +822,94 @@ given point.
 */
 byte *CM_FatPVS (vec3_t org)
 {
-	VectorCopy (org, fatpvs_org);
+	return CM_FatPVSToBuffer (org, fatpvs);
+}
+
+/*
+=============
+CM_FatPVSToBuffer
+
+Same as CM_FatPVS but fills the caller's buffer of at least MAX_MAP_LEAFS/8
+bytes, so it may be used from several threads at once.
+=============
+*/
+byte *CM_FatPVSToBuffer (vec3_t org, byte *buffer)
+{
+	int fatbytes = (visleafs+31)>>3;
+
+	memset (buffer, 0, fatbytes);
+	AddToFatPVS_r (map_nodes, org, buffer, fatbytes);
+	return buffer;
+}
+
+
+/*
+=============
+CM_FatPVSLeafs
+
+Lists the non-solid leafs whose PVS make up the fat PVS of org, in tree
+order, so two points with the same list have the same fat PVS.
+Returns -1 if there are more than maxleafs.
+=============
+*/
+static int FatPVSLeafs_r (cnode_t *node, const vec3_t org, int *leafs, int count, int maxleafs)
+{
+	float d;
+
+	while (1)
+	{
+		if (count < 0)
+			return count;
+
+		if (node->contents < 0)
+		{
+			if (node->contents != CONTENTS_SOLID)
+			{
+				if (count == maxleafs)
+					return -1;
+				leafs[count++] = (cleaf_t *)node - map_leafs;
+			}
+			return count;
+		}
+
+		d = DotProduct (org, node->plane->normal) - node->plane->dist;
+		if (d > 8)
+			node = node->children[0];
+		else if (d < -8)
+			node = node->children[1];
+		else
+		{ // go down both
+			count = FatPVSLeafs_r (node->children[0], org, leafs, count, maxleafs);
+			node = node->children[1];
+		}
+	}
+}
+
+int CM_FatPVSLeafs (vec3_t org, int *leafs, int maxleafs)
+{
+	return FatPVSLeafs_r (map_nodes, org, leafs, 0, maxleafs);
+}
 
-	fatbytes = (visleafs+31)>>3;
-	memset (fatpvs, 0, fatbytes);
-	AddToFatPVS_r (map_nodes);
-	return fatpvs;
+/*
+=============
+CM_LeafsPVS
+
+Builds the fat PVS from a list returned by CM_FatPVSLeafs
+=============
+*/
+byte *CM_LeafsPVS (const int *leafs, int numleafs, byte *buffer)
+{
+	int i, j, fatbytes = (visleafs+31)>>3;
+	byte *pvs;
+
+	memset (buffer, 0, fatbytes);
+	for (i = 0; i < numleafs; i++)
+	{
+		pvs = CM_LeafPVS (map_leafs + leafs[i]);
+		for (j = 0; j < fatbytes; j++)
+			buffer[j] |= pvs[j];
+	}
+	return buffer;
 }
 
 
@@ -557,6 +1003,7 @@ int CM_FindTouchedLeafs (const vec3_t mins, const vec3_t maxs, int leafs[], int
 
 static void CM_LoadEntities (lump_t *l)
 {
+	map_entitylen = l->filelen;
 	if (!l->filelen) {
 		map_entitystring = NULL;
 		return;
@@ -906,6 +1353,61 @@ static void CM_MakeHull0(void)
 	}
 }
 
+/*
+=================
+CM_FlattenClipnodes
+
+Copies the planes into a cflatnode_t array laid out like clipnodes, returns
+NULL if some clipnode points at a plane that doesn't exist
+=================
+*/
+static cflatnode_t *CM_FlattenClipnodes(mclipnode_t *clipnodes, int count)
+{
+	cflatnode_t *out, *flat;
+	mplane_t *plane;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (clipnodes[i].planenum < 0 || clipnodes[i].planenum >= numplanes)
+			return NULL;
+	}
+
+	out = flat = (cflatnode_t *)Hunk_AllocName(count * sizeof(*out), loadname);
+	for (i = 0; i < count; i++, flat++, clipnodes++) {
+		plane = map_planes + clipnodes->planenum;
+		VectorCopy (plane->normal, flat->normal);
+		flat->dist = plane->dist;
+		flat->type = plane->type;
+		flat->children[0] = clipnodes->children[0];
+		flat->children[1] = clipnodes->children[1];
+	}
+
+	return out;
+}
+
+/*
+=================
+CM_FlattenHulls
+
+Hull 0 has its own clipnodes (CM_MakeHull0), the other hulls share the
+map clipnodes
+=================
+*/
+static void CM_FlattenHulls(void)
+{
+	cflatnode_t *hull0, *clip;
+	int i, j;
+
+	hull0 = CM_FlattenClipnodes(map_cmodels[0].hulls[0].clipnodes, numnodes);
+	clip = CM_FlattenClipnodes(map_clipnodes, numclipnodes);
+
+	for (i = 0; i < numcmodels; i++) {
+		map_cmodels[i].hulls[0].flatnodes = hull0;
+		for (j = 1; j < MAX_MAP_HULLS; j++)
+			map_cmodels[i].hulls[j].flatnodes = clip;
+	}
+}
+
 /*
 =================
 CM_LoadPlanes
@@ -944,133 +1446,329 @@ static void CM_LoadPlanes(lump_t *l)
 
 
 /*
-** DecompressVis
+** CM_DecompressRow
+**
+** Expands a row compressed the way vis rows are: a zero byte is followed
+** by the number of zero bytes it stands for.  Stops at end, the rest of
+** the row is left empty
 */
-static byte *DecompressVis(byte *in)
+static void CM_DecompressRow(const byte *in, const byte *end, byte *out, int rowbytes)
 {
-	static byte decompressed[MAX_MAP_LEAFS / 8];
-	int c, row;
-	byte *out;
+	byte *outend = out + rowbytes;
+	int c;
 
-	row = (visleafs + 7) >> 3;
-	out = decompressed;
-
-	if (!in) { // no vis info, so make all visible
-		while (row) {
-			*out++ = 0xff;
-			row--;
-		}
-		return decompressed;
-	}
-
-	do {
+	while (out < outend && in < end) {
 		if (*in) {
 			*out++ = *in++;
 			continue;
 		}
 
-		c = in[1];
+		if (in + 1 >= end)
+			break;
+		c = min(in[1], outend - out);
 		in += 2;
-		while (c) {
-			*out++ = 0;
-			c--;
-		}
-	} while (out - decompressed < row);
+		memset(out, 0, c);
+		out += c;
+	}
 
-	return decompressed;
+	if (out < outend)
+		memset(out, 0, outend - out);
 }
 
+/*
+** CM_CompressRow
+**
+** The reverse of CM_DecompressRow, out needs room for rowbytes * 3 / 2 + 2
+*/
+static int CM_CompressRow(const byte *in, byte *out, int rowbytes)
+{
+	byte *start = out;
+	int i, rep;
+
+	for (i = 0; i < rowbytes; i++) {
+		*out++ = in[i];
+		if (in[i])
+			continue;
+
+		for (rep = 1; i + 1 < rowbytes && !in[i + 1] && rep < 255; rep++)
+			i++;
+		*out++ = rep;
+	}
+
+	return out - start;
+}
+
+/*
+** CM_DecompressVisRow
+**
+** Expands the vis row of a leaf straight into the PVS
+*/
+static void CM_DecompressVisRow(byte *visdata, int vislen, int visofs, byte *out)
+{
+	int row = (visleafs + 7) >> 3;
+
+	if (visofs < 0 || visofs >= vislen) { // no vis info, so make all visible
+		memcpy(out, map_novis, map_vis_rowbytes);
+		return;
+	}
+
+	CM_DecompressRow(visdata + visofs, visdata + vislen, out, row);
+	memset(out + row, 0, map_vis_rowbytes - row);
+}
 
 /*
 ** CM_BuildPVS
 **
 ** Call after CM_LoadLeafs!
 */
-static void CM_BuildPVS(lump_t *lump_vis, lump_t *lump_leafs)
+static void CM_AllocPVS(void)
 {
-	byte *visdata, *scan;
-	dleaf_t *in;
-	int i;
-
 	map_vis_rowlongs = (visleafs + 31) >> 5;
 	map_vis_rowbytes = map_vis_rowlongs * 4;
 	map_pvs = (byte *)Hunk_Alloc(map_vis_rowbytes * visleafs);
+}
 
-	if (!lump_vis->filelen) {
-		memset(map_pvs, 0xff, map_vis_rowbytes * visleafs);
-		return;
+// neighbouring leafs often share their vis row, which then isn't expanded again
+#define CM_BUILDPVS(leaftype)														\
+	byte *visdata, *scan;															\
+	leaftype *in;																	\
+	int i, p, lastp = -1;															\
+																					\
+	CM_AllocPVS();																	\
+																					\
+	if (!lump_vis->filelen) {														\
+		memset(map_pvs, 0xff, map_vis_rowbytes * visleafs);							\
+		return;																		\
+	}																				\
+																					\
+	visdata = cmod_base + lump_vis->fileofs;										\
+																					\
+	/* go through all leafs and decompress visibility data */						\
+	in = (leaftype *)(cmod_base + lump_leafs->fileofs);								\
+	in++; /* pvs row 0 is leaf 1 */													\
+	scan = map_pvs;																	\
+	for (i = 0; i < visleafs; i++, in++, scan += map_vis_rowbytes) {				\
+		p = LittleLong(in->visofs);													\
+		if (i && p == lastp)														\
+			memcpy(scan, scan - map_vis_rowbytes, map_vis_rowbytes);				\
+		else																		\
+			CM_DecompressVisRow(visdata, lump_vis->filelen, p, scan);				\
+		lastp = p;																	\
 	}
 
-	// FIXME, add checks for lump_vis->filelen and leafs' visofs
+static void CM_BuildPVS(lump_t *lump_vis, lump_t *lump_leafs)
+{
+	CM_BUILDPVS(dleaf_t)
+}
 
-	visdata = cmod_base + lump_vis->fileofs;
+static void CM_BuildPVS29a(lump_t *lump_vis, lump_t *lump_leafs)
+{
+	CM_BUILDPVS(dleaf29a_t)
+}
 
-	// go through all leafs and decompress visibility data
-	in = (dleaf_t *)(cmod_base + lump_leafs->fileofs);
-	in++; // pvs row 0 is leaf 1
-	scan = map_pvs;
-	for (i = 0; i < visleafs; i++, in++, scan += map_vis_rowbytes) {
-		int p = LittleLong(in->visofs);
-		memcpy(scan, (p == -1) ? map_novis : DecompressVis(visdata + p), map_vis_rowbytes);
-	}
+static void CM_BuildPVSBSP2(lump_t *lump_vis, lump_t *lump_leafs)
+{
+	CM_BUILDPVS(dleaf_bsp2_t)
 }
 
-static void CM_BuildPVS29a(lump_t *lump_vis, lump_t *lump_leafs)
+/*
+** PHS building
+**
+** Row i of the PHS is row i of the PVS or'ed with the PVS rows of every
+** leaf visible from i.  Rows are done in blocks, by sv_phsthreads worker
+** threads if set, each block written straight into an expanded PHS or
+** compressed into its own buffer when the expanded PHS would be too big.
+*/
+#define PHS_MAXEXPANDED		0x100000	// bigger PHS is kept compressed
+#define PHS_BLOCKROWS		64
+#define PHS_MAXTHREADS		16
+
+typedef struct {
+	byte	*data;						// compressed rows
+	int		rows[PHS_BLOCKROWS];		// where each row starts in data
+	int		size;
+} phsblock_t;
+
+static struct {
+	phsblock_t		*blocks;			// NULL when writing map_phs directly
+	int				numblocks;
+	volatile int	nextblock;
+#ifndef CLIENTONLY
+	sys_sem_t		*done;
+#endif
+} phsbuild;
+
+static void CM_OrRow(unsigned *dest, const unsigned *src, int longs)
 {
-	byte *visdata, *scan;
-	dleaf29a_t *in;
-	int i;
+	int l = 0;
 
-	map_vis_rowlongs = (visleafs + 31) >> 5;
-	map_vis_rowbytes = map_vis_rowlongs * 4;
-	map_pvs = (byte *)Hunk_Alloc(map_vis_rowbytes * visleafs);
+#ifdef __SSE2__
+	for (; l + 4 <= longs; l += 4)
+		_mm_storeu_si128((__m128i *)(dest + l), _mm_or_si128(_mm_loadu_si128((const __m128i *)(dest + l)),
+															_mm_loadu_si128((const __m128i *)(src + l))));
+#endif
 
-	if (!lump_vis->filelen) {
-		memset(map_pvs, 0xff, map_vis_rowbytes * visleafs);
-		return;
+	for (; l < longs; l++)
+		dest[l] |= src[l];
+}
+
+static void CM_BuildPHSRow(int row, unsigned *dest)
+{
+	const unsigned *scanlongs = (unsigned *)map_pvs + row * map_vis_rowlongs;
+	const byte *scan = (const byte *)scanlongs;
+	int j, k, l, bitbyte, index1;
+
+	// copy from pvs
+	memcpy(dest, scanlongs, map_vis_rowbytes);
+
+	// or in hearable leafs
+	for (j = 0; j < map_vis_rowlongs; j++) {
+		if (!scanlongs[j])
+			continue;
+
+		for (k = j << 2; k < (j << 2) + 4; k++) {
+			bitbyte = scan[k];
+			for (l = 0; bitbyte; l++, bitbyte >>= 1) {
+				if (!(bitbyte & 1))
+					continue;
+				// or this pvs row into the phs
+				index1 = (k << 3) + l;
+				if (index1 >= visleafs)
+					break;
+				CM_OrRow(dest, (unsigned *)map_pvs + index1 * map_vis_rowlongs, map_vis_rowlongs);
+			}
+		}
 	}
+}
 
-	// FIXME, add checks for lump_vis->filelen and leafs' visofs
+static void CM_BuildPHSBlocks(void)
+{
+	unsigned row[(MAX_MAP_LEAFS + 31) / 32];
+	byte *out;
+	int b, i, first, last;
 
-	visdata = cmod_base + lump_vis->fileofs;
+	while ((b = Sys_AtomicAdd(&phsbuild.nextblock, 1)) < phsbuild.numblocks) {
+		first = b * PHS_BLOCKROWS;
+		last = min(first + PHS_BLOCKROWS, visleafs);
 
-	// go through all leafs and decompress visibility data
-	in = (dleaf29a_t *)(cmod_base + lump_leafs->fileofs);
-	in++; // pvs row 0 is leaf 1
-	scan = map_pvs;
-	for (i = 0; i < visleafs; i++, in++, scan += map_vis_rowbytes) {
-		int p = LittleLong(in->visofs);
-		memcpy(scan, (p == -1) ? map_novis : DecompressVis(visdata + p), map_vis_rowbytes);
+		if (!phsbuild.blocks) {
+			for (i = first; i < last; i++)
+				CM_BuildPHSRow(i, (unsigned *)map_phs + i * map_vis_rowlongs);
+			continue;
+		}
+
+		out = phsbuild.blocks[b].data = (byte *)Q_malloc((last - first) * (map_vis_rowbytes * 3 / 2 + 2));
+		for (i = first; i < last; i++) {
+			CM_BuildPHSRow(i, row);
+			phsbuild.blocks[b].rows[i - first] = out - phsbuild.blocks[b].data;
+			out += CM_CompressRow((byte *)row, out, map_vis_rowbytes);
+		}
+		phsbuild.blocks[b].size = out - phsbuild.blocks[b].data;
 	}
 }
 
-static void CM_BuildPVSBSP2(lump_t *lump_vis, lump_t *lump_leafs)
+#ifndef CLIENTONLY
+static DWORD WINAPI CM_PHSThread(void *unused)
 {
-	byte *visdata, *scan;
-	dleaf_bsp2_t *in;
-	int i;
+	CM_BuildPHSBlocks();
+	Sys_SemPost(phsbuild.done);
+	return 0;
+}
+#endif
 
-	map_vis_rowlongs = (visleafs + 31) >> 5;
-	map_vis_rowbytes = map_vis_rowlongs * 4;
-	map_pvs = (byte *)Hunk_Alloc(map_vis_rowbytes * visleafs);
+/*
+** CM_LoadPHSCache / CM_SavePHSCache
+**
+** Big maps keep their compressed PHS in maps/<map>.phs in the game dir,
+** valid as long as the map checksum and leaf count match
+*/
+#define PHSCACHE_VERSION	1
 
-	if (!lump_vis->filelen) {
-		memset(map_pvs, 0xff, map_vis_rowbytes * visleafs);
-		return;
+typedef struct {
+	char	id[4];						// "QPHS"
+	int		version;
+	int		checksum;					// map_checksum
+	int		visleafs;
+	int		rowbytes;
+	int		size;						// compressed rows, after visleafs + 1 offsets
+} phscache_t;
+
+static void CM_PHSCacheName(char *name, int size)
+{
+	// map_name isn't set until the map is loaded
+	strlcpy(name, va("%s/maps/%s.phs", fs_gamedir, loadname), size);
+}
+
+static qbool CM_LoadPHSCache(void)
+{
+	char name[MAX_OSPATH];
+	phscache_t header;
+	int i, *rows;
+	byte *data;
+	FILE *f;
+
+	CM_PHSCacheName(name, sizeof(name));
+	if (!(f = fopen(name, "rb")))
+		return false;
+
+	if (fread(&header, sizeof(header), 1, f) != 1 || strncmp(header.id, "QPHS", 4)
+		|| LittleLong(header.version) != PHSCACHE_VERSION || LittleLong(header.checksum) != (int)map_checksum
+		|| LittleLong(header.visleafs) != visleafs || LittleLong(header.rowbytes) != map_vis_rowbytes
+		|| LittleLong(header.size) <= 0
+		|| FS_FileLength(f) != (long)(sizeof(header) + (visleafs + 1) * sizeof(int) + LittleLong(header.size))) {
+		fclose(f);
+		return false;
+	}
+
+	rows = (int *)Hunk_AllocName((visleafs + 1) * sizeof(*rows), loadname);
+	data = (byte *)Hunk_AllocName(LittleLong(header.size), loadname);
+	if (fread(rows, sizeof(*rows), visleafs + 1, f) != (size_t)(visleafs + 1)
+		|| fread(data, 1, LittleLong(header.size), f) != (size_t)LittleLong(header.size)) {
+		fclose(f);
+		return false;
 	}
+	fclose(f);
 
-	// FIXME, add checks for lump_vis->filelen and leafs' visofs
+	for (i = 0; i <= visleafs; i++) {
+		rows[i] = LittleLong(rows[i]);
+		if (rows[i] < 0 || rows[i] > LittleLong(header.size) || (i && rows[i] < rows[i - 1]))
+			return false;
+	}
+	if (rows[visleafs] != LittleLong(header.size))
+		return false;
 
-	visdata = cmod_base + lump_vis->fileofs;
+	map_phs = data;
+	map_phs_rows = rows;
+	return true;
+}
 
-	// go through all leafs and decompress visibility data
-	in = (dleaf_bsp2_t *)(cmod_base + lump_leafs->fileofs);
-	in++; // pvs row 0 is leaf 1
-	scan = map_pvs;
-	for (i = 0; i < visleafs; i++, in++, scan += map_vis_rowbytes) {
-		int p = LittleLong(in->visofs);
-		memcpy(scan, (p == -1) ? map_novis : DecompressVis(visdata + p), map_vis_rowbytes);
+static void CM_SavePHSCache(void)
+{
+	char name[MAX_OSPATH];
+	phscache_t header;
+	int i, row;
+	FILE *f;
+
+	CM_PHSCacheName(name, sizeof(name));
+	FS_CreatePath(name);
+	if (!(f = fopen(name, "wb"))) {
+		Con_DPrintf("Couldn't write %s\n", name);
+		return;
+	}
+
+	memcpy(header.id, "QPHS", 4);
+	header.version = LittleLong(PHSCACHE_VERSION);
+	header.checksum = LittleLong(map_checksum);
+	header.visleafs = LittleLong(visleafs);
+	header.rowbytes = LittleLong(map_vis_rowbytes);
+	header.size = LittleLong(map_phs_rows[visleafs]);
+	fwrite(&header, sizeof(header), 1, f);
+	for (i = 0; i <= visleafs; i++) {
+		row = LittleLong(map_phs_rows[i]);
+		fwrite(&row, sizeof(row), 1, f);
 	}
+	fwrite(map_phs, 1, map_phs_rows[visleafs], f);
+	fclose(f);
 }
 
 /*
@@ -1081,47 +1779,356 @@ static void CM_BuildPVSBSP2(lump_t *lump_vis, lump_t *lump_leafs)
 */
 static void CM_BuildPHS (void)
 {
-	int i, j, k, l, index1, bitbyte;
-	unsigned *dest, *src;
-	byte *scan;
+#ifndef CLIENTONLY
+	extern cvar_t sv_phsthreads, sv_phscache;
+	int threads = bound(0, (int)sv_phsthreads.value, PHS_MAXTHREADS);
+	qbool cache = (int)sv_phscache.value;
+#else
+	int threads = 0;
+	qbool cache = false;
+#endif
+	qbool compress;
+	double start = Sys_DoubleTime();
+	int b, i, size;
+	byte *out;
 
 	map_phs = NULL;
-	if (map_vis_rowbytes * visleafs > 0x100000) {
+	map_phs_rows = NULL;
+	compress = map_vis_rowbytes * visleafs > PHS_MAXEXPANDED;
+
+	if (compress && cache && CM_LoadPHSCache()) {
+		Con_DPrintf("Loaded PHS from cache, %d bytes\n", map_phs_rows[visleafs]);
 		return;
 	}
 
-	map_phs = (byte *) Hunk_Alloc (map_vis_rowbytes * visleafs);
-	scan = map_pvs;
-	dest = (unsigned *)map_phs;
-	for (i = 0; i < visleafs; i++, dest += map_vis_rowlongs, scan += map_vis_rowbytes)
-	{
-		// copy from pvs
-		memcpy (dest, scan, map_vis_rowbytes);
+	memset(&phsbuild, 0, sizeof(phsbuild));
+	phsbuild.numblocks = (visleafs + PHS_BLOCKROWS - 1) / PHS_BLOCKROWS;
+	if (compress)
+		phsbuild.blocks = (phsblock_t *)Q_malloc(phsbuild.numblocks * sizeof(phsblock_t));
+	else
+		map_phs = (byte *) Hunk_Alloc (map_vis_rowbytes * visleafs);
 
-		// or in hearable leafs
-		for (j = 0; j < map_vis_rowbytes; j++)
-		{
-			bitbyte = scan[j];
-			if (!bitbyte)
-				continue;
-			for (k = 0; k < 8; k++)
-			{
-				if (! (bitbyte & (1<<k)) )
-					continue;
-				// or this pvs row into the phs
-				index1 = (j<<3) + k;
-				if (index1 >= visleafs)
-					continue;
-				src = (unsigned *)map_pvs + index1 * map_vis_rowlongs;
-				for (l = 0; l < map_vis_rowlongs; l++)
-					dest[l] |= src[l];
-			}
+	threads = min(threads, phsbuild.numblocks - 1);
+#ifndef CLIENTONLY
+	if (threads > 0) {
+		phsbuild.done = Sys_SemCreate(0);
+		for (i = 0; i < threads; i++)
+			Sys_CreateThread(CM_PHSThread, NULL);
+	}
+#endif
+
+	CM_BuildPHSBlocks();
+
+#ifndef CLIENTONLY
+	if (threads > 0) {
+		for (i = 0; i < threads; i++)
+			Sys_SemWait(phsbuild.done);
+		Sys_SemDestroy(phsbuild.done);
+	}
+#endif
+
+	if (compress) {
+		// stitch the blocks together in the hunk
+		for (b = size = 0; b < phsbuild.numblocks; b++)
+			size += phsbuild.blocks[b].size;
+
+		map_phs_rows = (int *)Hunk_AllocName((visleafs + 1) * sizeof(*map_phs_rows), loadname);
+		map_phs = out = (byte *)Hunk_AllocName(size, loadname);
+		for (b = 0; b < phsbuild.numblocks; b++) {
+			for (i = b * PHS_BLOCKROWS; i < min((b + 1) * PHS_BLOCKROWS, visleafs); i++)
+				map_phs_rows[i] = (out - map_phs) + phsbuild.blocks[b].rows[i - b * PHS_BLOCKROWS];
+			memcpy(out, phsbuild.blocks[b].data, phsbuild.blocks[b].size);
+			out += phsbuild.blocks[b].size;
+			Q_free(phsbuild.blocks[b].data);
 		}
+		map_phs_rows[visleafs] = size;
+		Q_free(phsbuild.blocks);
+
+		if (cache)
+			CM_SavePHSCache();
 	}
+
+	Con_DPrintf("Built %sPHS for %d leafs in %.3f seconds, %d thread%s\n", compress ? "compressed " : "",
+		visleafs, Sys_DoubleTime() - start, threads + 1, threads ? "s" : "");
 }
 
 
 
+/*
+** Map cache
+**
+** Everything CM_LoadMap prepares, written to maps/<map>.cmc in the game dir
+** after the map was loaded the slow way.  The next load of a map with the
+** same checksums, entities included, maps the file and only has to turn
+** the stored offsets back into pointers.  Pointers are stored as offsets
+** from the start of the file, 0 being NULL.  The header has the size of
+** the structures in it, so a cache written by a different build is just
+** ignored and rewritten.
+*/
+#define MAPCACHE_VERSION	2
+#define MAPCACHE_ALIGN		16
+
+enum {
+	MC_PLANES, MC_NODES, MC_LEAFS, MC_CLIPNODES, MC_HULL0, MC_FLATHULL0, MC_FLATCLIPNODES,
+	MC_CMODELS, MC_PVS, MC_PHS, MC_PHSROWS, MC_ENTITIES, MC_NUMREGIONS
+};
+
+typedef struct {
+	int		ofs;
+	int		size;
+} mapcacheregion_t;
+
+typedef struct {
+	char				id[4];			// "QCMC"
+	int					version;
+	int					layout[6];		// pointer and structure sizes
+	unsigned			checksum;		// map_checksum
+	unsigned			checksum2;		// map_checksum2
+	unsigned			entitysum;		// map_entitysum, the checksums above skip entities
+	unsigned			datasum;		// Com_BlockChecksum of everything after the header
+	int					filesize;
+	int					halflife;
+	int					numplanes, numnodes, numclipnodes, numleafs, visleafs, numcmodels;
+	int					rowbytes;
+	mapcacheregion_t	regions[MC_NUMREGIONS];
+} mapcache_t;
+
+static void CM_MapCacheLayout(int *layout)
+{
+	layout[0] = sizeof(void *);
+	layout[1] = sizeof(cnode_t);
+	layout[2] = sizeof(cleaf_t);
+	layout[3] = sizeof(cmodel_t);
+	layout[4] = sizeof(mplane_t);
+	layout[5] = sizeof(cflatnode_t);
+}
+
+static void CM_MapCacheName(char *name, int size)
+{
+	strlcpy(name, va("%s/maps/%s.cmc", fs_gamedir, loadname), size);
+}
+
+// turns a pointer into one of the regions into its file offset
+static intptr_t CM_MapCacheOfs(const void *p, void **mem, const mapcache_t *h)
+{
+	int i;
+
+	if (!p)
+		return 0;
+
+	for (i = 0; i < MC_NUMREGIONS; i++) {
+		if (mem[i] && (byte *)p >= (byte *)mem[i] && (byte *)p < (byte *)mem[i] + h->regions[i].size)
+			return h->regions[i].ofs + ((byte *)p - (byte *)mem[i]);
+	}
+
+	Sys_Error("CM_MapCacheOfs: pointer outside the map");
+	return 0;
+}
+
+static void CM_SaveMapCache(const char *name)
+{
+	char path[MAX_OSPATH], tmppath[MAX_OSPATH];
+	void *mem[MC_NUMREGIONS];
+	mapcache_t h;
+	cnode_t *nodes;
+	cleaf_t *leafs;
+	cmodel_t *cmodels;
+	byte *blob;
+	int i, j, pos;
+	FILE *f;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.id, "QCMC", 4);
+	h.version = MAPCACHE_VERSION;
+	CM_MapCacheLayout(h.layout);
+	h.checksum = map_checksum;
+	h.checksum2 = map_checksum2;
+	h.entitysum = map_entitysum;
+	h.halflife = map_halflife;
+	h.numplanes = numplanes;
+	h.numnodes = numnodes;
+	h.numclipnodes = numclipnodes;
+	h.numleafs = numleafs;
+	h.visleafs = visleafs;
+	h.numcmodels = numcmodels;
+	h.rowbytes = map_vis_rowbytes;
+
+	mem[MC_PLANES] = map_planes;					h.regions[MC_PLANES].size = numplanes * sizeof(mplane_t);
+	mem[MC_NODES] = map_nodes;						h.regions[MC_NODES].size = numnodes * sizeof(cnode_t);
+	mem[MC_LEAFS] = map_leafs;						h.regions[MC_LEAFS].size = numleafs * sizeof(cleaf_t);
+	mem[MC_CLIPNODES] = map_clipnodes;				h.regions[MC_CLIPNODES].size = numclipnodes * sizeof(mclipnode_t);
+	mem[MC_HULL0] = map_cmodels[0].hulls[0].clipnodes;	h.regions[MC_HULL0].size = numnodes * sizeof(mclipnode_t);
+	mem[MC_FLATHULL0] = map_cmodels[0].hulls[0].flatnodes;	h.regions[MC_FLATHULL0].size = mem[MC_FLATHULL0] ? numnodes * sizeof(cflatnode_t) : 0;
+	mem[MC_FLATCLIPNODES] = map_cmodels[0].hulls[1].flatnodes;	h.regions[MC_FLATCLIPNODES].size = mem[MC_FLATCLIPNODES] ? numclipnodes * sizeof(cflatnode_t) : 0;
+	mem[MC_CMODELS] = map_cmodels;					h.regions[MC_CMODELS].size = numcmodels * sizeof(cmodel_t);
+	mem[MC_PVS] = map_pvs;							h.regions[MC_PVS].size = map_vis_rowbytes * visleafs;
+	mem[MC_PHS] = map_phs;							h.regions[MC_PHS].size = !map_phs ? 0 : map_phs_rows ? map_phs_rows[visleafs] : map_vis_rowbytes * visleafs;
+	mem[MC_PHSROWS] = map_phs_rows;					h.regions[MC_PHSROWS].size = map_phs_rows ? (visleafs + 1) * sizeof(int) : 0;
+	mem[MC_ENTITIES] = map_entitystring;			h.regions[MC_ENTITIES].size = map_entitystring ? map_entitylen : 0;
+
+	pos = (sizeof(h) + MAPCACHE_ALIGN - 1) & ~(MAPCACHE_ALIGN - 1);
+	for (i = 0; i < MC_NUMREGIONS; i++) {
+		h.regions[i].ofs = pos;
+		pos = (pos + h.regions[i].size + MAPCACHE_ALIGN - 1) & ~(MAPCACHE_ALIGN - 1);
+	}
+	h.filesize = pos;
+
+	// put together everything after the header with the pointers turned into offsets
+	blob = (byte *)Q_malloc(h.filesize);
+	for (i = 0; i < MC_NUMREGIONS; i++) {
+		if (mem[i])
+			memcpy(blob + h.regions[i].ofs, mem[i], h.regions[i].size);
+	}
+
+	nodes = (cnode_t *)(blob + h.regions[MC_NODES].ofs);
+	for (i = 0; i < numnodes; i++) {
+		nodes[i].parent = (cnode_t *)CM_MapCacheOfs(map_nodes[i].parent, mem, &h);
+		nodes[i].plane = (mplane_t *)CM_MapCacheOfs(map_nodes[i].plane, mem, &h);
+		nodes[i].children[0] = (cnode_t *)CM_MapCacheOfs(map_nodes[i].children[0], mem, &h);
+		nodes[i].children[1] = (cnode_t *)CM_MapCacheOfs(map_nodes[i].children[1], mem, &h);
+	}
+
+	leafs = (cleaf_t *)(blob + h.regions[MC_LEAFS].ofs);
+	for (i = 0; i < numleafs; i++)
+		leafs[i].parent = (cnode_t *)CM_MapCacheOfs(map_leafs[i].parent, mem, &h);
+
+	cmodels = (cmodel_t *)(blob + h.regions[MC_CMODELS].ofs);
+	for (i = 0; i < numcmodels; i++) {
+		for (j = 0; j < MAX_MAP_HULLS; j++) {
+			cmodels[i].hulls[j].clipnodes = (mclipnode_t *)CM_MapCacheOfs(map_cmodels[i].hulls[j].clipnodes, mem, &h);
+			cmodels[i].hulls[j].planes = (mplane_t *)CM_MapCacheOfs(map_cmodels[i].hulls[j].planes, mem, &h);
+			cmodels[i].hulls[j].flatnodes = (cflatnode_t *)CM_MapCacheOfs(map_cmodels[i].hulls[j].flatnodes, mem, &h);
+		}
+	}
+
+	h.datasum = Com_BlockChecksum(blob + sizeof(h), h.filesize - sizeof(h));
+	memcpy(blob, &h, sizeof(h));
+
+	// write under another name first, so another server can't map half a file
+	CM_MapCacheName(path, sizeof(path));
+	strlcpy(tmppath, va("%s.tmp", path), sizeof(tmppath));
+	FS_CreatePath(tmppath);
+	if (!(f = fopen(tmppath, "wb"))) {
+		Con_DPrintf("Couldn't write %s\n", tmppath);
+		Q_free(blob);
+		return;
+	}
+	i = fwrite(blob, 1, h.filesize, f) == (size_t)h.filesize;
+	fclose(f);
+	Q_free(blob);
+
+#ifdef _WIN32
+	remove(path);	// rename doesn't replace files there
+#endif
+	if (!i || rename(tmppath, path)) {
+		remove(tmppath);
+		Con_DPrintf("Couldn't write %s\n", path);
+		return;
+	}
+
+	Con_DPrintf("Wrote map cache for %s, %d bytes\n", name, h.filesize);
+}
+
+// turns a stored offset back into a pointer, NULL if it doesn't point inside the file
+#define MAPCACHE_PTR(type, ofs)	((intptr_t)(ofs) > 0 && (intptr_t)(ofs) < map_cachesize ? (type *)(map_cache + (intptr_t)(ofs)) : NULL)
+
+static qbool CM_LoadMapCache(void)
+{
+	char path[MAX_OSPATH];
+	int layout[6], i, j;
+	mapcache_t h;
+	cmodel_t *cmodels;
+	byte *data;
+	FILE *f;
+
+	CM_MapCacheName(path, sizeof(path));
+	if (!(f = fopen(path, "rb")))
+		return false;
+
+	CM_MapCacheLayout(layout);
+	if (fread(&h, sizeof(h), 1, f) != 1 || strncmp(h.id, "QCMC", 4) || h.version != MAPCACHE_VERSION
+		|| memcmp(h.layout, layout, sizeof(layout)) || h.checksum != map_checksum || h.checksum2 != map_checksum2
+		|| h.entitysum != map_entitysum
+		|| h.halflife != (int)map_halflife || h.filesize != FS_FileLength(f)
+		|| h.numcmodels < 1 || h.numcmodels > MAX_MAP_MODELS || h.visleafs < 0 || h.visleafs > MAX_MAP_LEAFS) {
+		fclose(f);
+		return false;
+	}
+
+	for (i = 0; i < MC_NUMREGIONS; i++) {
+		if (h.regions[i].ofs < (int)sizeof(h) || h.regions[i].size < 0 || h.regions[i].ofs > h.filesize - h.regions[i].size) {
+			fclose(f);
+			return false;
+		}
+	}
+
+#ifndef _WIN32
+	// private, the offsets are turned into pointers in place
+	data = (byte *)mmap(NULL, h.filesize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+	fclose(f);
+	if (data == (byte *)MAP_FAILED)
+		return false;
+#else
+	data = (byte *)Hunk_AllocName(h.filesize, loadname);
+	fseek(f, 0, SEEK_SET);
+	i = fread(data, 1, h.filesize, f) == h.filesize;
+	fclose(f);
+	if (!i)
+		return false;
+#endif
+
+	if (Com_BlockChecksum(data + sizeof(h), h.filesize - sizeof(h)) != h.datasum) {
+#ifndef _WIN32
+		munmap(data, h.filesize);
+#endif
+		return false;
+	}
+
+	map_cache = data;
+	map_cachesize = h.filesize;
+
+	numplanes = h.numplanes;
+	numnodes = h.numnodes;
+	numclipnodes = h.numclipnodes;
+	numleafs = h.numleafs;
+	visleafs = h.visleafs;
+	numcmodels = h.numcmodels;
+	map_vis_rowbytes = h.rowbytes;
+	map_vis_rowlongs = h.rowbytes / 4;
+	map_entitylen = h.regions[MC_ENTITIES].size;
+
+	map_planes = MAPCACHE_PTR(mplane_t, h.regions[MC_PLANES].ofs);
+	map_nodes = MAPCACHE_PTR(cnode_t, h.regions[MC_NODES].ofs);
+	map_leafs = MAPCACHE_PTR(cleaf_t, h.regions[MC_LEAFS].ofs);
+	map_clipnodes = MAPCACHE_PTR(mclipnode_t, h.regions[MC_CLIPNODES].ofs);
+	map_pvs = MAPCACHE_PTR(byte, h.regions[MC_PVS].ofs);
+	map_phs = h.regions[MC_PHS].size ? MAPCACHE_PTR(byte, h.regions[MC_PHS].ofs) : NULL;
+	map_phs_rows = h.regions[MC_PHSROWS].size ? MAPCACHE_PTR(int, h.regions[MC_PHSROWS].ofs) : NULL;
+	map_entitystring = map_entitylen ? MAPCACHE_PTR(char, h.regions[MC_ENTITIES].ofs) : NULL;
+
+	for (i = 0; i < numnodes; i++) {
+		map_nodes[i].parent = MAPCACHE_PTR(cnode_t, map_nodes[i].parent);
+		map_nodes[i].plane = MAPCACHE_PTR(mplane_t, map_nodes[i].plane);
+		map_nodes[i].children[0] = MAPCACHE_PTR(cnode_t, map_nodes[i].children[0]);
+		map_nodes[i].children[1] = MAPCACHE_PTR(cnode_t, map_nodes[i].children[1]);
+	}
+
+	for (i = 0; i < numleafs; i++)
+		map_leafs[i].parent = MAPCACHE_PTR(cnode_t, map_leafs[i].parent);
+
+	cmodels = MAPCACHE_PTR(cmodel_t, h.regions[MC_CMODELS].ofs);
+	for (i = 0; i < numcmodels; i++) {
+		map_cmodels[i] = cmodels[i];
+		for (j = 0; j < MAX_MAP_HULLS; j++) {
+			map_cmodels[i].hulls[j].clipnodes = MAPCACHE_PTR(mclipnode_t, cmodels[i].hulls[j].clipnodes);
+			map_cmodels[i].hulls[j].planes = MAPCACHE_PTR(mplane_t, cmodels[i].hulls[j].planes);
+			map_cmodels[i].hulls[j].flatnodes = MAPCACHE_PTR(cflatnode_t, cmodels[i].hulls[j].flatnodes);
+		}
+	}
+
+	return true;
+}
+
 /*
 ** hunk was reset by host, so the data is no longer valid
 */
@@ -1136,7 +2143,15 @@ void CM_InvalidateMap (void)
 	map_leafs = NULL;
 	map_pvs = NULL;
 	map_phs = NULL;
+	map_phs_rows = NULL;
 	map_entitystring = NULL;
+
+	if (map_cache) {
+#ifndef _WIN32
+		munmap(map_cache, map_cachesize);
+#endif
+		map_cache = NULL;
+	}
 }
 
 /*
@@ -1146,7 +2161,10 @@ typedef void(*BuildPVSFunction)(lump_t *lump_vis, lump_t *lump_leafs);
 cmodel_t *CM_LoadMap (char *name, qbool clientload, unsigned *checksum, unsigned *checksum2)
 {
 #ifndef CLIENTONLY
-	extern cvar_t sv_bspversion, sv_halflifebsp;
+	extern cvar_t sv_bspversion, sv_halflifebsp, sv_mapcache;
+	qbool cache = (int)sv_mapcache.value;
+#else
+	qbool cache = false;
 #endif
 
 	unsigned int i;
@@ -1239,8 +2257,10 @@ cmodel_t *CM_LoadMap (char *name, qbool clientload, unsigned *checksum, unsigned
 	// checksum all of the map, except for entities
 	map_checksum = map_checksum2 = 0;
 	for (i = 0; i < HEADER_LUMPS; i++) {
-		if (i == LUMP_ENTITIES)
+		if (i == LUMP_ENTITIES) {
+			map_entitysum = Com_BlockChecksum(cmod_base + header->lumps[i].fileofs, header->lumps[i].filelen);
 			continue;
+		}
 		map_checksum ^= LittleLong(Com_BlockChecksum(cmod_base + header->lumps[i].fileofs, header->lumps[i].filelen));
 
 		if (i == LUMP_VISIBILITY || i == LUMP_LEAFS || i == LUMP_NODES)
@@ -1251,6 +2271,15 @@ cmodel_t *CM_LoadMap (char *name, qbool clientload, unsigned *checksum, unsigned
 		*checksum = map_checksum;
 	*checksum2 = map_checksum2;
 
+	if (!clientload && cache && CM_LoadMapCache()) {
+		Con_DPrintf("Loaded %s from the map cache\n", name);
+		numrecordedtraces = 0;
+		recordtraces = false;
+		strlcpy (map_name, name, sizeof(map_name));
+		Q_free(padded_buf);
+		return &map_cmodels[0];
+	}
+
 	// load into heap
 	CM_LoadPlanes (&header->lumps[LUMP_PLANES]);
 	if (LittleLong(header->version) == Q1_BSPVERSION29a) {
@@ -1275,11 +2304,17 @@ cmodel_t *CM_LoadMap (char *name, qbool clientload, unsigned *checksum, unsigned
 	CM_LoadSubmodels (&header->lumps[LUMP_MODELS]);
 
 	CM_MakeHull0 ();
+	CM_FlattenHulls ();
+	numrecordedtraces = 0;
+	recordtraces = false;
 
 	cm_load_pvs_func (&header->lumps[LUMP_VISIBILITY], &header->lumps[LUMP_LEAFS]);
 
-	if (!clientload) // client doesn't need PHS
+	if (!clientload) { // client doesn't need PHS
 		CM_BuildPHS ();
+		if (cache)
+			CM_SaveMapCache (name);
+	}
 
 	strlcpy (map_name, name, sizeof(map_name));
 
@@ -41,6 +41,15 @@ typedef struct mplane_s {
 	byte	pad[2];
 } mplane_t;
 
+// clipnode with its plane folded in, indexed like hull_t->clipnodes
+typedef struct cflatnode_s {
+	vec3_t	normal;
+	float	dist;
+	int		type;			// mplane_t type, < 3 is axial
+	int		children[2];	// negative numbers are contents
+	int		pad;			// two nodes per cache line
+} cflatnode_t;
+
 // !!! if this is changed, it must be changed in asm_i386.h too !!!
 typedef struct {
 	mclipnode_t	*clipnodes;
@@ -49,6 +58,7 @@ typedef struct {
 	int			lastclipnode;
 	vec3_t		clip_mins;
 	vec3_t		clip_maxs;
+	cflatnode_t	*flatnodes;		// NULL if the hull couldn't be flattened
 } hull_t;
 
 typedef struct {
@@ -84,6 +94,9 @@ int CM_LeafAmbientLevel (const struct cleaf_s *leaf, int ambient_channel);
 byte *CM_LeafPVS (const struct cleaf_s *leaf);
 byte *CM_LeafPHS (const struct cleaf_s *leaf); // only for the server
 byte *CM_FatPVS (vec3_t org);
+byte *CM_FatPVSToBuffer (vec3_t org, byte *buffer);
+int CM_FatPVSLeafs (vec3_t org, int *leafs, int maxleafs);
+byte *CM_LeafsPVS (const int *leafs, int numleafs, byte *buffer);
 int CM_FindTouchedLeafs (const vec3_t mins, const vec3_t maxs, int leafs[], int maxleafs, int headnode, int *topnode);
 char *CM_EntityString (void);
 int CM_NumInlineModels (void);
@@ -91,5 +104,6 @@ cmodel_t *CM_InlineModel (char *name);
 void CM_InvalidateMap (void);
 cmodel_t *CM_LoadMap (char *name, qbool clientload, unsigned *checksum, unsigned *checksum2);
 void CM_Init (void);
+void CM_HullTraceBench_f (void);
 
 #endif /* !__CMODEL_H__ */
@@ -20,6 +20,10 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 // net.c
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
+#endif
+
 #ifdef SERVERONLY
 #include "qwsvdef.h"
 #else
@@ -27,6 +31,14 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "server.h"
 #endif
 
+#if defined(__linux__) && !defined(CLIENTONLY)
+#define NET_USE_EPOLL
+#define NET_USE_RECVMMSG
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
 #ifdef _WIN32
 WSADATA		winsockdata;
 #endif
@@ -40,6 +52,10 @@ netadr_t	net_local_sv_ipadr;
 netadr_t	net_local_sv_tcpipadr;
 
 cvar_t		sv_local_addr = {"sv_local_addr", "", CVAR_ROM};
+#ifdef NET_USE_RECVMMSG
+cvar_t		sv_recvbatch = {"sv_recvbatch", "32"}; // max UDP packets per recvmmsg() call, 0 or 1 - use recvfrom()
+cvar_t		sv_sendbatch = {"sv_sendbatch", "1"}; // queue UDP packets and send them with sendmmsg() at end of frame, 0 - send immediately
+#endif
 #endif
 
 netadr_t	net_from;
@@ -270,6 +286,25 @@ qbool NET_CompareBaseAdr (const netadr_t a, const netadr_t b)
 	return false;
 }
 
+qbool NET_IsLocalAddress (const netadr_t a)
+{
+	if (a.type == NA_LOOPBACK)
+		return true;
+
+	if (a.type != NA_IP)
+		return false;
+
+	if (a.ip[0] == 127)
+		return true;
+
+#ifndef CLIENTONLY
+	if (net_local_sv_ipadr.type == NA_IP && NET_CompareBaseAdr (a, net_local_sv_ipadr))
+		return true;
+#endif
+
+	return false;
+}
+
 qbool NET_CompareAdr (const netadr_t a, const netadr_t b)
 {
 #ifndef SERVERONLY
@@ -516,7 +551,10 @@ static void sv_tcp_connection_free(svtcpstream_t *drop, qbool unlink)
 
 	// well, think socket may be zero, but most of the time zero is stdin fd, so better not close it
 	if (drop->socketnum && drop->socketnum != INVALID_SOCKET)
+	{
+		NET_EventDel(drop->socketnum);
 		closesocket(drop->socketnum);
+	}
 
 	Q_free(drop);
 }
@@ -534,6 +572,114 @@ int sv_tcp_connection_count(void)
 
 //=============================================================================
 
+#ifdef NET_USE_RECVMMSG
+//
+// Batched receive for server UDP socket.
+// Up to sv_recvbatch datagrams are read with one recvmmsg() call into preallocated buffers,
+// then handed out one by one to NET_GetPacket() in the same order as kernel delivered them.
+//
+
+#define NET_RECV_BATCH 64
+
+typedef struct
+{
+	sizebuf_t	msg[NET_RECV_BATCH];
+	netadr_t	from[NET_RECV_BATCH];
+	int			count;	// packets received by last recvmmsg()
+	int			next;	// next packet to hand out
+} net_recvbatch_t;
+
+static net_recvbatch_t	net_recvbatch;
+static byte				net_recvbatch_buf[NET_RECV_BATCH][MSG_BUF_SIZE];
+
+static void NET_ClearRecvBatch (void)
+{
+	int i;
+
+	for (i = 0; i < NET_RECV_BATCH; i++)
+		SZ_Init (&net_recvbatch.msg[i], net_recvbatch_buf[i], sizeof(net_recvbatch_buf[i]));
+
+	net_recvbatch.count = net_recvbatch.next = 0;
+}
+
+static qbool NET_GetUDPPacketBatch (int socket, int batch, netadr_t *from_adr, sizebuf_t *message)
+{
+	struct mmsghdr msgs[NET_RECV_BATCH];
+	struct iovec iov[NET_RECV_BATCH];
+	struct sockaddr_storage from[NET_RECV_BATCH];
+	net_recvbatch_t *rb = &net_recvbatch;
+	sizebuf_t *msg;
+	int i, ret, err;
+
+	while (1)
+	{
+		// hand out what we already have
+		while (rb->next < rb->count)
+		{
+			i = rb->next++;
+			msg = &rb->msg[i];
+			*from_adr = rb->from[i];
+
+			if (msg->cursize >= message->maxsize)
+			{
+				Con_Printf ("Oversize packet from %s\n", NET_AdrToString (*from_adr));
+				continue;
+			}
+
+			memcpy (message->data, msg->data, msg->cursize);
+			message->cursize = msg->cursize;
+			return true;
+		}
+
+		batch = bound(1, batch, NET_RECV_BATCH);
+		memset (msgs, 0, sizeof(msgs[0]) * batch);
+		for (i = 0; i < batch; i++)
+		{
+			iov[i].iov_base = rb->msg[i].data;
+			iov[i].iov_len = min(rb->msg[i].maxsize, message->maxsize);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		}
+
+		rb->count = rb->next = 0;
+
+		ret = recvmmsg (socket, msgs, batch, MSG_DONTWAIT, NULL);
+		if (ret == -1)
+		{
+			err = qerrno;
+
+			if (err == EWOULDBLOCK || err == EAGAIN)
+				return false; // common error, does not spam in logs.
+
+			if (err == ECONNABORTED || err == ECONNRESET)
+			{
+				Con_DPrintf ("Connection lost or aborted\n");
+				return false;
+			}
+
+			Con_Printf ("NET_GetPacket: recvmmsg: (%i): %s\n", err, strerror(err));
+			return false;
+		}
+
+		if (ret == 0)
+			return false;
+
+		for (i = 0; i < ret; i++)
+		{
+			SockadrToNetadr (&from[i], &rb->from[i]);
+			// truncated datagram fills whole buffer, so it caught by oversize check above
+			rb->msg[i].cursize = msgs[i].msg_len;
+		}
+		rb->count = ret;
+
+		svs.stats.recv_batches++;
+		svs.stats.recv_batched += ret;
+	}
+}
+#endif // NET_USE_RECVMMSG
+
 qbool NET_GetUDPPacket (netsrc_t netsrc, netadr_t *from_adr, sizebuf_t *message)
 {
 	int ret, err;
@@ -544,6 +690,12 @@ qbool NET_GetUDPPacket (netsrc_t netsrc, netadr_t *from_adr, sizebuf_t *message)
 	if (socket == INVALID_SOCKET)
 		return false;
 
+#ifdef NET_USE_RECVMMSG
+	// also drain what left in batch if sv_recvbatch was just turned off
+	if (netsrc == NS_SERVER && ((int)sv_recvbatch.value > 1 || net_recvbatch.next < net_recvbatch.count))
+		return NET_GetUDPPacketBatch (socket, (int)sv_recvbatch.value, from_adr, message);
+#endif
+
 	fromlen = sizeof(from);
 	ret = recvfrom (socket, (char *)message->data, message->maxsize, 0, (struct sockaddr *)&from, &fromlen);
 	SockadrToNetadr (&from, from_adr);
@@ -582,6 +734,7 @@ qbool NET_GetUDPPacket (netsrc_t netsrc, netadr_t *from_adr, sizebuf_t *message)
 	return ret;
 }
 
+
 #ifndef SERVERONLY
 qbool NET_GetTCPPacket_CL (netsrc_t netsrc, netadr_t *from, sizebuf_t *message)
 {
@@ -900,6 +1053,90 @@ qbool NET_SendTCPPacket_SV (netsrc_t netsrc, int length, void *data, netadr_t to
 }
 #endif
 
+#ifdef NET_USE_RECVMMSG
+//
+// Batched send for server UDP socket.
+// Packets are copied to send queue and sent by NET_SendFlush() with one sendmmsg() call,
+// server does that once per frame after client messages and demo/QTV data are sent.
+//
+
+#define NET_SEND_BATCH		1024 // UIO_MAXIOV
+#define NET_SEND_BUF_SIZE	(1024 * 1024)
+
+typedef struct
+{
+	struct mmsghdr			msgs[NET_SEND_BATCH];
+	struct iovec			iov[NET_SEND_BATCH];
+	struct sockaddr_storage	to[NET_SEND_BATCH];
+	int						count;		// queued packets
+	int						bufused;	// bytes used in buf
+	byte					buf[NET_SEND_BUF_SIZE];
+} net_sendbatch_t;
+
+static net_sendbatch_t	net_sendbatch;
+
+void NET_SendFlush (void)
+{
+	net_sendbatch_t *sb = &net_sendbatch;
+	int socket = svs.socketip;
+	int sent, ret, err;
+
+	if (!sb->count)
+		return;
+
+	for (sent = 0; socket != INVALID_SOCKET && sent < sb->count; )
+	{
+		ret = sendmmsg (socket, sb->msgs + sent, sb->count - sent, 0);
+		if (ret == -1)
+		{
+			err = qerrno;
+
+			if (err == EWOULDBLOCK || err == ECONNREFUSED || err == EADDRNOTAVAIL)
+				; // nothing
+			else
+				Con_Printf ("NET_SendPacket: sendmmsg: (%i): %s %i\n", err, strerror(err), socket);
+
+			sent++; // skip packet which failed, same as sendto() would lost it
+			continue;
+		}
+
+		sent += ret;
+		svs.stats.send_batches++;
+		svs.stats.send_batched += ret;
+	}
+
+	sb->count = sb->bufused = 0;
+}
+
+static void NET_SendQueue (int length, void *data, netadr_t to)
+{
+	net_sendbatch_t *sb = &net_sendbatch;
+	int i;
+
+	if (sb->count >= NET_SEND_BATCH || sb->bufused + length > (int)sizeof(sb->buf))
+		NET_SendFlush ();
+
+	i = sb->count++;
+
+	memcpy (sb->buf + sb->bufused, data, length);
+	NetadrToSockadr (&to, &sb->to[i]);
+
+	sb->iov[i].iov_base = sb->buf + sb->bufused;
+	sb->iov[i].iov_len = length;
+	memset (&sb->msgs[i], 0, sizeof(sb->msgs[i]));
+	sb->msgs[i].msg_hdr.msg_iov = &sb->iov[i];
+	sb->msgs[i].msg_hdr.msg_iovlen = 1;
+	sb->msgs[i].msg_hdr.msg_name = &sb->to[i];
+	sb->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+	sb->bufused += length;
+}
+#else
+void NET_SendFlush (void)
+{
+}
+#endif // NET_USE_RECVMMSG
+
 qbool NET_SendUDPPacket (netsrc_t netsrc, int length, void *data, netadr_t to)
 {
 	struct sockaddr_storage addr;
@@ -909,6 +1146,20 @@ qbool NET_SendUDPPacket (netsrc_t netsrc, int length, void *data, netadr_t to)
 	if (socket == INVALID_SOCKET)
 		return false;
 
+#ifdef NET_USE_RECVMMSG
+	if (netsrc == NS_SERVER)
+	{
+		if ((int)sv_sendbatch.value && length > 0 && length <= NET_SEND_BUF_SIZE)
+		{
+			NET_SendQueue (length, data, to);
+			return true;
+		}
+
+		// keep packets order if sv_sendbatch was just turned off
+		NET_SendFlush ();
+	}
+#endif
+
 	NetadrToSockadr (&to, &addr);
 
 	ret = sendto (socket, data, length, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
@@ -1188,13 +1439,192 @@ int UDP_OpenSocket (unsigned short int port)
 	return newsocket;
 }
 
-qbool NET_Sleep(int msec, qbool stdinissocket)
+//=============================================================================
+//
+// Event backend.
+//
+// On linux server sleeps in epoll_wait() instead of select(), descriptors are registered once when
+// they are opened (UDP socket, QTV/TCP listen socket, pending QTV connections, QTV streams and qizmo tcp connections)
+// and server wakes up on real activity on any of them. Sockets are edge-triggered, they are read by
+// SV_Frame() on its own pace anyway, so there is no point to wake up again for data we already know about.
+// Frame deadline (sys_select_timeout) is handled by timerfd which gives us microsecond precision.
+//
+
+#ifdef NET_USE_EPOLL
+
+#define NET_MAX_EVENTS 64
+
+static int		net_epollfd = INVALID_SOCKET;
+static int		net_timerfd = INVALID_SOCKET;
+static int		net_epoll_stdin = 0; // 0 - not registered, 1 - registered, -1 - can't be watched (regular file), always ready
+
+static void NET_EventInit (void)
+{
+	struct epoll_event ev = {0};
+
+	if (COM_CheckParm("-noepoll"))
+		return;
+
+	if ((net_epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	{
+		Con_Printf ("NET_EventInit: epoll_create1: (%i): %s\n", qerrno, strerror(qerrno));
+		net_epollfd = INVALID_SOCKET;
+		return;
+	}
+
+	if ((net_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+	{
+		Con_Printf ("NET_EventInit: timerfd_create: (%i): %s\n", qerrno, strerror(qerrno));
+		close(net_epollfd);
+		net_epollfd = net_timerfd = INVALID_SOCKET;
+		return;
+	}
+
+	// timer is level-triggered, we read it out once it fired
+	ev.events = EPOLLIN;
+	ev.data.fd = net_timerfd;
+	if (epoll_ctl(net_epollfd, EPOLL_CTL_ADD, net_timerfd, &ev) == -1)
+	{
+		Con_Printf ("NET_EventInit: epoll_ctl: (%i): %s\n", qerrno, strerror(qerrno));
+		close(net_timerfd);
+		close(net_epollfd);
+		net_epollfd = net_timerfd = INVALID_SOCKET;
+		return;
+	}
+
+	Con_DPrintf("epoll event loop initialized\n");
+}
+
+static void NET_EventShutdown (void)
+{
+	if (net_timerfd != INVALID_SOCKET)
+		close(net_timerfd);
+	if (net_epollfd != INVALID_SOCKET)
+		close(net_epollfd);
+
+	net_epollfd = net_timerfd = INVALID_SOCKET;
+	net_epoll_stdin = 0;
+}
+
+void NET_EventAdd (int fd)
+{
+	struct epoll_event ev = {0};
+
+	if (net_epollfd == INVALID_SOCKET || fd == INVALID_SOCKET)
+		return;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(net_epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		// socket may be passed from pending QTV connection to stream/tcpconnection, that fine.
+		if (qerrno == EEXIST && epoll_ctl(net_epollfd, EPOLL_CTL_MOD, fd, &ev) != -1)
+			return;
+
+		Con_DPrintf ("NET_EventAdd: epoll_ctl: (%i): %s\n", qerrno, strerror(qerrno));
+	}
+}
+
+void NET_EventDel (int fd)
+{
+	if (net_epollfd == INVALID_SOCKET || fd == INVALID_SOCKET)
+		return;
+
+	// closing descriptor removes it from set anyway, unless it was inherited by forked Sys_Script(),
+	// so remove it explicitly, error here is not interesting.
+	epoll_ctl(net_epollfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static qbool NET_EventStdin (qbool stdinissocket)
+{
+	struct epoll_event ev = {0};
+
+	if (!stdinissocket)
+	{
+		if (net_epoll_stdin > 0)
+			epoll_ctl(net_epollfd, EPOLL_CTL_DEL, 0, NULL);
+		net_epoll_stdin = 0;
+		return false;
+	}
+
+	if (net_epoll_stdin)
+		return net_epoll_stdin < 0;
+
+	// stdin is level-triggered, Sys_ConsoleInput() reads only one line per frame
+	ev.events = EPOLLIN;
+	ev.data.fd = 0;
+	if (epoll_ctl(net_epollfd, EPOLL_CTL_ADD, 0, &ev) == -1)
+	{
+		// EPERM: regular file, select() would report it as always ready, so do we
+		net_epoll_stdin = -1;
+		return true;
+	}
+
+	net_epoll_stdin = 1;
+	return false;
+}
+
+static qbool NET_EventSleep (int usec, qbool stdinissocket)
+{
+	struct epoll_event events[NET_MAX_EVENTS];
+	struct itimerspec its = {{0}};
+	qbool stdin_ready;
+	uint64_t expirations;
+	int i, n;
+
+	stdin_ready = NET_EventStdin(stdinissocket);
+	if (stdin_ready)
+		usec = 0; // stdin always ready, do not block then
+
+	its.it_value.tv_sec = usec / 1000000;
+	its.it_value.tv_nsec = (usec % 1000000) * 1000;
+	if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+		its.it_value.tv_nsec = 1; // zero value disarms timer
+
+	if (timerfd_settime(net_timerfd, 0, &its, NULL) == -1)
+	{
+		Con_DPrintf ("NET_Sleep: timerfd_settime: (%i): %s\n", qerrno, strerror(qerrno));
+		return stdin_ready;
+	}
+
+	n = epoll_wait(net_epollfd, events, NET_MAX_EVENTS, -1);
+
+	for (i = 0; i < n; i++)
+	{
+		if (events[i].data.fd == net_timerfd)
+			read(net_timerfd, &expirations, sizeof(expirations));
+		else if (events[i].data.fd == 0)
+			stdin_ready = true;
+	}
+
+	return stdin_ready;
+}
+
+#else // NET_USE_EPOLL
+
+void NET_EventAdd (int fd)
+{
+}
+
+void NET_EventDel (int fd)
+{
+}
+
+#endif // NET_USE_EPOLL
+
+qbool NET_Sleep(int usec, qbool stdinissocket)
 {
 	struct timeval	timeout;
 	fd_set			fdset;
 	qbool			stdin_ready = false;
 	int				maxfd = 0;
 
+#ifdef NET_USE_EPOLL
+	if (net_epollfd != INVALID_SOCKET)
+		return NET_EventSleep(usec, stdinissocket);
+#endif
+
 	FD_ZERO (&fdset);
 
 	if (stdinissocket)
@@ -1209,8 +1639,8 @@ qbool NET_Sleep(int msec, qbool stdinissocket)
 		maxfd = max(svs.socketip, maxfd);
 	}
 
-	timeout.tv_sec = msec/1000;
-	timeout.tv_usec = (msec%1000)*1000;
+	timeout.tv_sec = usec/1000000;
+	timeout.tv_usec = usec%1000000;
 	switch (select(maxfd + 1, &fdset, NULL, NULL, &timeout))
 	{
 		case -1: break;
@@ -1276,6 +1706,10 @@ void NET_Init (void)
 	// init the message buffer
 	SZ_Init (&net_message, net_message_buffer, sizeof(net_message_buffer));
 
+#ifdef NET_USE_EPOLL
+	NET_EventInit ();
+#endif
+
 	Con_DPrintf("UDP Initialized\n");
 
 #ifndef SERVERONLY
@@ -1288,6 +1722,11 @@ void NET_Init (void)
 #ifndef CLIENTONLY
 
 	Cvar_Register (&sv_local_addr);
+#ifdef NET_USE_RECVMMSG
+	Cvar_Register (&sv_recvbatch);
+	Cvar_Register (&sv_sendbatch);
+	NET_ClearRecvBatch ();
+#endif
 
 	svs.socketip = INVALID_SOCKET;
 // TCPCONNECT -->
@@ -1312,6 +1751,10 @@ void NET_Shutdown (void)
 	NET_CloseClient();
 #endif
 
+#ifdef NET_USE_EPOLL
+	NET_EventShutdown ();
+#endif
+
 #ifdef _WIN32
 	WSACleanup ();
 #endif
@@ -1376,6 +1819,7 @@ void NET_InitServer_TCP(unsigned short int port)
 	if (svs.sockettcp != INVALID_SOCKET)
 	{
 		Con_Printf("Server TCP port closed\n");
+		NET_EventDel(svs.sockettcp);
 		closesocket(svs.sockettcp);
 		svs.sockettcp = INVALID_SOCKET;
 		net_local_sv_tcpipadr.type = NA_INVALID;
@@ -1387,6 +1831,7 @@ void NET_InitServer_TCP(unsigned short int port)
 
 		if (svs.sockettcp != INVALID_SOCKET)
 		{
+			NET_EventAdd(svs.sockettcp);
 			// get local address.
 			NET_GetLocalAddress (svs.sockettcp, &net_local_sv_tcpipadr);
 			Con_Printf("Opening server TCP port %u\n", (unsigned int)port);
@@ -1412,6 +1857,7 @@ void NET_InitServer (void)
 	if (svs.socketip == INVALID_SOCKET)
 	{
 		svs.socketip = UDP_OpenSocket (port);
+		NET_EventAdd(svs.socketip);
 	}
 
 	if (svs.socketip != INVALID_SOCKET)
@@ -1448,12 +1894,21 @@ void NET_InitServer (void)
 
 void NET_CloseServer (void)
 {
+	// send what left in queue, like disconnect messages from SV_FinalMessage()
+	NET_SendFlush ();
+
 	if (svs.socketip != INVALID_SOCKET)
 	{
+		NET_EventDel(svs.socketip);
 		closesocket(svs.socketip);
 		svs.socketip = INVALID_SOCKET;
 	}
 
+#ifdef NET_USE_RECVMMSG
+	// drop packets which was received from closed socket
+	NET_ClearRecvBatch ();
+#endif
+
 	net_local_sv_ipadr.type = NA_LOOPBACK; // FIXME: why not NA_INVALID?
 
 // TCPCONNECT -->
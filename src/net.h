@@ -162,6 +162,8 @@ void	SockadrToNetadr (const struct sockaddr_storage *s, netadr_t *a);
 qbool	NET_CompareAdr (const netadr_t a, const netadr_t b);
 // compare netart_t, ignore port.
 qbool	NET_CompareBaseAdr (const netadr_t a, const netadr_t b);
+// loopback, 127.x.x.x or the address of this machine.
+qbool	NET_IsLocalAddress (const netadr_t a);
 // print netadr_t as string, xxx.xxx.xxx.xxx:xxxxx notation.
 char	*NET_AdrToString (const netadr_t a);
 // print netadr_t as string, port skipped, xxx.xxx.xxx.xxx notation.
@@ -177,11 +179,19 @@ void	NET_InitServer (void);
 void	NET_CloseServer (void);
 qbool	NET_GetPacket (netsrc_t sock);
 void	NET_SendPacket (netsrc_t sock, int length, void *data, netadr_t to);
+// send server UDP packets queued by NET_SendPacket(), if any.
+void	NET_SendFlush (void);
 
 void	NET_GetLocalAddress (int socket, netadr_t *out);
 
 void	NET_ClearLoopback (void);
-qbool	NET_Sleep(int msec, qbool stdinissocket);
+// wait up to usec microseconds for network/stdin activity, return true if stdin is ready.
+qbool	NET_Sleep(int usec, qbool stdinissocket);
+
+// register descriptor in event set so NET_Sleep() wakes up when it is readable.
+void	NET_EventAdd (int fd);
+// remove descriptor from event set, must be called before socket closed.
+void	NET_EventDel (int fd);
 
 // GETER: return port of UDP server socket.
 int		NET_UDPSVPort (void);
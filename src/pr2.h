@@ -30,6 +30,7 @@ typedef void (*pr2_trapcall_t)(byte* base, uintptr_t mask, pr2val_t* stack, pr2v
 //extern int usedll;
 extern cvar_t sv_progtype;
 extern vm_t* sv_vm;
+extern volatile int pr2_syscall;	// API call being executed, -1 if none
 
 
 void		PR2_Init(void);
@@ -56,6 +56,11 @@ void PR2_RunError(char *error, ...)
 
 	Con_Printf("%s\n", string);
 
+	// SV_Error does not come back through sv_syscall, so the profiler
+	// must not keep seeing the call we died in
+	pr2_syscall = -1;
+	pr_xbuiltin = 0;
+
 	SV_Error("Program error: %s", string);
 }
 
@@ -2940,11 +2945,113 @@ pr2_trapcall_t pr2_API[]=
     };
 int pr2_numAPI = sizeof(pr2_API)/sizeof(pr2_API[0]);
 
+// names for pr2_API, in the same order, used by the sampling profiler
+char *pr2_APIname[]=
+    {
+        "PF2_GetApiVersion",
+        "PF2_DPrint",
+        "PF2_Error",
+        "PF2_GetEntityToken",
+        "PF2_Spawn",
+        "PF2_Remove",
+        "PF2_precache_sound",
+        "PF2_precache_model",
+        "PF2_lightstyle",
+        "PF2_setorigin",
+        "PF2_setsize",
+        "PF2_setmodel",
+        "PF2_bprint",
+        "PF2_sprint",
+        "PF2_centerprint",
+        "PF2_ambientsound",
+        "PF2_sound",
+        "PF2_traceline",
+        "PF2_checkclient",
+        "PF2_stuffcmd",
+        "PF2_localcmd",
+        "PF2_cvar",
+        "PF2_cvar_set",
+        "PF2_FindRadius",
+        "PF2_walkmove",
+        "PF2_droptofloor",
+        "PF2_checkbottom",
+        "PF2_pointcontents",
+        "PF2_nextent",
+        "PF2_fixme",
+        "PF2_makestatic",
+        "PF2_setspawnparms",
+        "PF2_changelevel",
+        "PF2_logfrag",
+        "PF2_infokey",
+        "PF2_multicast",
+        "PF2_disable_updates",
+        "PF2_WriteByte",
+        "PF2_WriteChar",
+        "PF2_WriteShort",
+        "PF2_WriteLong",
+        "PF2_WriteAngle",
+        "PF2_WriteCoord",
+        "PF2_WriteString",
+        "PF2_WriteEntity",
+        "PR2_FlushSignon",
+        "PF2_memset",
+        "PF2_memcpy",
+        "PF2_strncpy",
+        "PF2_sin",
+        "PF2_cos",
+        "PF2_atan2",
+        "PF2_sqrt",
+        "PF2_floor",
+        "PF2_ceil",
+        "PF2_acos",
+        "PF2_cmdargc",
+        "PF2_cmdargv",
+        "PF2_TraceCapsule",
+        "PF2_FS_OpenFile",
+        "PF2_FS_CloseFile",
+        "PF2_FS_ReadFile",
+        "PF2_FS_WriteFile",
+        "PF2_FS_SeekFile",
+        "PF2_FS_TellFile",
+        "PF2_FS_GetFileList",
+        "PF2_cvar_set_float",
+        "PF2_cvar_string",
+        "PF2_Map_Extension",
+        "PF2_strcmp",
+        "PF2_strncmp",
+        "PF2_stricmp",
+        "PF2_strnicmp",
+        "PF2_Find",
+        "PF2_executecmd",
+        "PF2_conprint",
+        "PF2_readcmd",
+        "PF2_redirectcmd",
+        "PF2_Add_Bot",
+        "PF2_Remove_Bot",
+        "PF2_SetBotUserInfo",
+        "PF2_SetBotCMD",
+        "PF2_QVMstrftime",
+        "PF2_cmdargs",
+        "PF2_tokenize",
+        "PF2_strlcpy",
+        "PF2_strlcat",
+        "PF2_makevectors",
+        "PF2_nextclient",
+        "PF2_precache_vwep_model",
+        "PF2_setpause",
+        "PF2_SetUserInfo",
+        "PF2_MoveToGoal",
+    };
+
+// API call being executed, -1 if none, read by the sampling profiler
+volatile int pr2_syscall = -1;
+
 intptr_t sv_syscall(intptr_t arg, ...) //must passed ints
 {
 	intptr_t args[20];
 	va_list argptr;
 	pr2val_t ret;
+	int old_syscall;
 
 	if( arg >= pr2_numAPI )
 		PR2_RunError ("sv_syscall: Bad API call number");
@@ -2972,7 +3079,10 @@ intptr_t sv_syscall(intptr_t arg, ...) //must passed ints
 	args[19]=va_arg(argptr, intptr_t);
 	va_end(argptr);
 
+	old_syscall = pr2_syscall;
+	pr2_syscall = arg;
 	pr2_API[arg] ( 0, (uintptr_t)~0, (pr2val_t*)args, &ret);
+	pr2_syscall = old_syscall;
 
 	return ret._int;
 }
@@ -2980,11 +3090,15 @@ intptr_t sv_syscall(intptr_t arg, ...) //must passed ints
 int sv_sys_callex(byte *data, unsigned int mask, int fn, pr2val_t*arg)
 {
 	pr2val_t ret;
+	int old_syscall;
 
 	if( fn >= pr2_numAPI )
 		PR2_RunError ("sv_sys_callex: Bad API call number");
 
+	old_syscall = pr2_syscall;
+	pr2_syscall = fn;
 	pr2_API[fn](data, mask, arg,&ret);
+	pr2_syscall = old_syscall;
 	return ret._int;
 }
 
@@ -38,12 +38,18 @@ cvar_t sv_pr2references = {"sv_pr2references", "0"};
 #ifdef QVM_PROFILE
 extern cvar_t sv_enableprofile;
 #endif
+#ifdef QVM_JIT
+extern cvar_t sv_qvmjit;
+#endif
 //int usedll;
 
 void ED2_PrintEdicts (void);
 void PR2_Profile_f (void);
 void ED2_PrintEdict_f (void);
 void ED_Count (void);
+void PR2_SampleProfile_f (void);
+void PR2_ProfileLock (qbool lock);
+void PR2_ProfileFlush (void);
 void PR2_Init(void)
 {
 	int p;
@@ -57,6 +63,9 @@ void PR2_Init(void)
 #ifdef QVM_PROFILE
 	Cvar_Register(&sv_enableprofile);
 #endif
+#ifdef QVM_JIT
+	Cvar_Register(&sv_qvmjit);
+#endif
 
 	p = COM_CheckParm ("-progtype");
 
@@ -73,6 +82,8 @@ void PR2_Init(void)
 	Cmd_AddCommand ("edicts", ED2_PrintEdicts);
 	Cmd_AddCommand ("edictcount", ED_Count);
 	Cmd_AddCommand ("profile", PR2_Profile_f);
+	Cmd_AddCommand ("pr_compare", PR_Compare_f);
+	Cmd_AddCommand ("sampleprofile", PR2_SampleProfile_f);
 	Cmd_AddCommand ("mod", PR2_GameConsoleCommand);
 
 	memset(pr_newstrtbl, 0, sizeof(pr_newstrtbl));
@@ -300,6 +311,8 @@ void PR2_LoadEnts(char *data)
 //===========================================================================
 void PR2_GameStartFrame(qbool isBotFrame)
 {
+	PR2_ProfileFlush();
+
 	if (isBotFrame && (!sv_vm || sv_vm->type == VM_NONE || !gamedata || gamedata->APIversion < 15)) {
 		return;
 	}
@@ -487,6 +500,8 @@ void PR2_GameShutDown(void)
 //===========================================================================
 void PR2_UnLoadProgs(void)
 {
+	PR2_ProfileLock(true);
+
 	if (sv_vm)
 	{
 		VM_Unload( sv_vm );
@@ -496,6 +511,8 @@ void PR2_UnLoadProgs(void)
 	{
 		PR1_UnLoadProgs();
 	}
+
+	PR2_ProfileLock(false);
 }
 
 //===========================================================================
@@ -503,6 +520,8 @@ void PR2_UnLoadProgs(void)
 //===========================================================================
 void PR2_LoadProgs(void)
 {
+	PR2_ProfileLock(true);
+
 	sv_vm = (vm_t *) VM_Load(sv_vm, (vm_type_t) (int) sv_progtype.value, sv_progsname.string, sv_syscall, sv_sys_callex);
 
 	if ( sv_vm )
@@ -513,6 +532,8 @@ void PR2_LoadProgs(void)
 	{
 		PR1_LoadProgs ();
 	}
+
+	PR2_ProfileLock(false);
 }
 
 //===========================================================================
@@ -571,4 +592,346 @@ void PR2_ClearEdict(edict_t* e)
 	}
 }
 
+//===========================================================================
+// Sampling profiler
+//
+// A thread wakes up at a fixed rate and records the game code call stack
+// the main thread is in: QC function numbers, or QVM code addresses as
+// published by ENTER and LEAVE, plus the PF2 syscall or QC builtin being
+// executed. Native game libraries only show syscalls. The main thread turns
+// samples into "func;func;func count" lines, the folded stack format
+// flamegraph tools read, every frame and before the progs are unloaded.
+// prof_lock keeps the sampler away while progs are (un)loaded.
+//===========================================================================
+
+#define PROF_MAXDEPTH	32
+#define PROF_RING		4096		// raw samples between flushes
+#define PROF_HASHSIZE	1024
+
+typedef struct
+{
+	int		depth;
+	int		call;				// pr2_syscall or pr_xbuiltin
+	int		frames[PROF_MAXDEPTH];	// innermost first
+} profsample_t;
+
+typedef struct profstack_s
+{
+	struct profstack_s	*next;
+	int					count;
+	char				name[1];
+} profstack_t;
+
+extern char *pr2_APIname[];
+extern int pr2_numAPI;
+
+static profsample_t	prof_ring[PROF_RING];
+static int			prof_head, prof_tail;	// protected by prof_lock
+static sys_mutex_t	*prof_lock;
+static volatile int	prof_running;			// generation of the running sampler, 0 if stopped
+static int			prof_generation;
+static int			prof_interval;			// milliseconds
+static int			prof_samples, prof_idle, prof_dropped;
+static double		prof_starttime, prof_time;
+static profstack_t	*prof_stacks[PROF_HASHSIZE];
+static int			prof_numstacks;
+
+// sampler thread, with prof_lock held
+static void PR2_ProfileSample (void)
+{
+	profsample_t *s;
+
+	if (prof_head - prof_tail >= PROF_RING)
+	{
+		prof_dropped++;
+		return;
+	}
+
+	s = &prof_ring[prof_head % PROF_RING];
+	s->depth = 0;
+	if (!sv_vm || sv_vm->type == VM_NONE)
+	{
+		s->call = pr_xbuiltin;
+		s->depth = PR_SampleStack (s->frames, PROF_MAXDEPTH);
+	}
+	else
+	{
+		s->call = pr2_syscall;
+		if (sv_vm->type == VM_BYTECODE)
+			s->depth = QVM_SampleStack ((qvm_t *) sv_vm->hInst, s->frames, PROF_MAXDEPTH);
+		if (s->call >= 0)
+			s->call++;		// 0 means no call, as for builtins
+	}
+
+	if (!s->depth && !s->call)
+	{
+		prof_idle++;
+		return;
+	}
+
+	prof_head++;
+}
+
+static DWORD WINAPI PR2_ProfileThread (void *param)
+{
+	int generation = (int) (intptr_t) param;
+
+	while (prof_running == generation)
+	{
+		Sys_Sleep (prof_interval);
+
+		Sys_MutexLock (prof_lock);
+		if (prof_running == generation)
+			PR2_ProfileSample ();
+		Sys_MutexUnlock (prof_lock);
+	}
+
+	return 0;
+}
+
+static void PR2_ProfileAdd (const char *name)
+{
+	profstack_t *p;
+	unsigned int hash = 0;
+	const char *c;
+
+	for (c = name; *c; c++)
+		hash = hash * 31 + (unsigned char) *c;
+	hash %= PROF_HASHSIZE;
+
+	for (p = prof_stacks[hash]; p; p = p->next)
+	{
+		if (!strcmp (p->name, name))
+		{
+			p->count++;
+			return;
+		}
+	}
+
+	p = (profstack_t *) Q_malloc (sizeof(*p) + strlen (name));
+	strcpy (p->name, name);
+	p->count = 1;
+	p->next = prof_stacks[hash];
+	prof_stacks[hash] = p;
+	prof_numstacks++;
+}
+
+// main thread, folds the raw samples into prof_stacks
+static void PR2_ProfileFold (void)
+{
+	profsample_t *s;
+	char name[2048];
+	const char *func;
+	int i;
+
+	for ( ; prof_tail != prof_head; prof_tail++)
+	{
+		s = &prof_ring[prof_tail % PROF_RING];
+
+		if (!sv_vm || sv_vm->type == VM_NONE)
+			strlcpy (name, "qc", sizeof(name));
+		else if (sv_vm->type == VM_BYTECODE)
+			strlcpy (name, "qvm", sizeof(name));
+		else
+			strlcpy (name, "native", sizeof(name));
+
+		for (i = s->depth - 1; i >= 0; i--)
+		{
+			if (!sv_vm || sv_vm->type == VM_NONE)
+				func = PR1_GetString (pr_functions[s->frames[i]].s_name);
+			else
+				func = QVM_SampleName ((qvm_t *) sv_vm->hInst, s->frames[i]);
+			strlcat (name, ";", sizeof(name));
+			strlcat (name, func, sizeof(name));
+		}
+
+		if (s->call)
+		{
+			strlcat (name, ";", sizeof(name));
+			if (!sv_vm || sv_vm->type == VM_NONE)
+				strlcat (name, va ("builtin#%d", s->call), sizeof(name));
+			else if (s->call - 1 < pr2_numAPI)
+				strlcat (name, pr2_APIname[s->call - 1], sizeof(name));
+		}
+
+		PR2_ProfileAdd (name);
+		prof_samples++;
+	}
+}
+
+/*
+=================
+PR2_ProfileLock
+
+Keeps the sampler out while the progs change, what was sampled is
+folded first while the names are still there
+=================
+*/
+void PR2_ProfileLock (qbool lock)
+{
+	if (!prof_lock)
+		return;
+
+	if (lock)
+	{
+		Sys_MutexLock (prof_lock);
+		PR2_ProfileFold ();
+	}
+	else
+	{
+		Sys_MutexUnlock (prof_lock);
+	}
+}
+
+/*
+=================
+PR2_ProfileFlush
+
+Folds pending samples, called every frame and before the progs change
+=================
+*/
+void PR2_ProfileFlush (void)
+{
+	if (!prof_lock || prof_head == prof_tail)
+		return;
+
+	Sys_MutexLock (prof_lock);
+	PR2_ProfileFold ();
+	Sys_MutexUnlock (prof_lock);
+}
+
+static void PR2_ProfileClear (void)
+{
+	profstack_t *p, *next;
+	int i;
+
+	for (i = 0; i < PROF_HASHSIZE; i++)
+	{
+		for (p = prof_stacks[i]; p; p = next)
+		{
+			next = p->next;
+			Q_free (p);
+		}
+		prof_stacks[i] = NULL;
+	}
+
+	prof_numstacks = prof_samples = prof_idle = prof_dropped = 0;
+	prof_time = 0;
+	if (prof_running)
+		prof_starttime = Sys_DoubleTime ();
+}
+
+static void PR2_ProfileStop (void)
+{
+	if (!prof_running)
+		return;
+
+	Sys_MutexLock (prof_lock);
+	prof_running = 0;
+	PR2_ProfileFold ();
+	Sys_MutexUnlock (prof_lock);
+
+	prof_time += Sys_DoubleTime () - prof_starttime;
+}
+
+static void PR2_ProfileDump (const char *filename)
+{
+	profstack_t *p;
+	char base[MAX_OSPATH], name[MAX_OSPATH];
+	char *s, *t;
+	FILE *f;
+	int i;
+
+	// this can come in over rcon, keep it to a .folded file in the game dir
+	if (FS_UnsafeFilename (filename))
+	{
+		Con_Printf ("Bad profile name %s\n", filename);
+		return;
+	}
+
+	strlcpy (base, filename, sizeof(base));
+	for (s = t = base; *t; t++)
+		if (*t == '/' || *t == '\\')
+			s = t;
+	COM_StripExtension (s);	// only in the last path component
+	strlcpy (name, va ("%s/%s.folded", fs_gamedir, base), sizeof(name));
+
+	if (!(f = fopen (name, "wb")))
+	{
+		Con_Printf ("Couldn't open %s\n", name);
+		return;
+	}
+
+	for (i = 0; i < PROF_HASHSIZE; i++)
+		for (p = prof_stacks[i]; p; p = p->next)
+			fprintf (f, "%s %d\n", p->name, p->count);
+
+	fclose (f);
+	Con_Printf ("Wrote %d stacks to %s\n", prof_numstacks, name);
+}
+
+/*
+=================
+PR2_SampleProfile_f
+
+sampleprofile start [rate] | stop | dump [file] | clear
+=================
+*/
+void PR2_SampleProfile_f (void)
+{
+	char *cmd = Cmd_Argv (1);
+	double time;
+	int rate;
+
+	if (!strcmp (cmd, "start"))
+	{
+		if (prof_running)
+		{
+			Con_Printf ("Sampling profiler is already running\n");
+			return;
+		}
+
+		rate = Cmd_Argc () > 2 ? Q_atoi (Cmd_Argv (2)) : 1000;
+		rate = bound (1, rate, 1000);
+		prof_interval = 1000 / rate;
+
+		if (!prof_lock)
+			prof_lock = Sys_MutexCreate ();
+
+		prof_starttime = Sys_DoubleTime ();
+		prof_running = ++prof_generation;
+		Sys_CreateThread (PR2_ProfileThread, (void *) (intptr_t) prof_running);
+
+		Con_Printf ("Sampling game code every %d ms\n", prof_interval);
+		return;
+	}
+	else if (!strcmp (cmd, "stop"))
+	{
+		PR2_ProfileStop ();
+	}
+	else if (!strcmp (cmd, "dump"))
+	{
+		PR2_ProfileFlush ();
+		PR2_ProfileDump (Cmd_Argc () > 2 ? Cmd_Argv (2) : "profile");
+		return;
+	}
+	else if (!strcmp (cmd, "clear"))
+	{
+		PR2_ProfileFlush ();
+		PR2_ProfileClear ();
+		return;
+	}
+	else if (Cmd_Argc () > 1)
+	{
+		Con_Printf ("usage: sampleprofile [start [rate] | stop | dump [file] | clear]\n");
+		return;
+	}
+
+	PR2_ProfileFlush ();
+	time = prof_time + (prof_running ? Sys_DoubleTime () - prof_starttime : 0);
+	Con_Printf ("sampling %s, %.1f seconds\n", prof_running ? "on" : "off", time);
+	Con_Printf ("%d samples in game code, %d outside, %d dropped, %d stacks\n",
+		prof_samples, prof_idle, prof_dropped, prof_numstacks);
+}
+
 #endif /* USE_PR2 */
@@ -174,10 +174,26 @@ void PR2_Profile_f(void)
 #endif
 }
 
+static void QVM_Decode( qvm_t * qvm );
+
+#ifdef QVM_JIT
+#include <stddef.h>
+#include <sys/mman.h>
+
+cvar_t	sv_qvmjit = {"sv_qvmjit","1"};
+
+static qbool QVM_JitCompile( qvm_t * qvm );
+static void QVM_JitFree( qvm_t * qvm );
+#endif
+
 void VM_UnloadQVM( qvm_t * qvm )
 {
-	if(qvm)
-		Q_free( qvm );
+	if(!qvm)
+		return;
+#ifdef QVM_JIT
+	QVM_JitFree( qvm );
+#endif
+	Q_free( qvm );
 }
 
 void VM_Unload( vm_t * vm )
@@ -256,9 +272,15 @@ void VM_PrintInfo( vm_t * vm)
 		Con_DPrintf("native\n");
 		break;
 	case VM_BYTECODE:
-		Con_DPrintf("bytecode interpreted\n");
 		if((qvm=(qvm_t *)vm->hInst))
 		{
+#ifdef QVM_JIT
+			Con_DPrintf(qvm->jit_entry ? "bytecode compiled\n" : "bytecode interpreted\n");
+			if(qvm->jit_entry)
+				Con_DPrintf("      native code: %8xh\n", qvm->jit_size);
+#else
+			Con_DPrintf("bytecode interpreted\n");
+#endif
 			Con_DPrintf("     code  length: %8xh\n", qvm->len_cs*sizeof(qvm->cs[0]));
 			Con_DPrintf("instruction count: %8d\n", qvm->len_cs);
 			Con_DPrintf("     data  length: %8xh\n", qvm->len_ds);
@@ -385,7 +407,12 @@ qbool VM_LoadBytecode( vm_t * vm, sys_callex_t syscall1 )
 	}
 	// create vitrual machine
 	if(vm->hInst)
+	{
 		qvm = (qvm_t *)vm->hInst;
+#ifdef QVM_JIT
+		QVM_JitFree( qvm );
+#endif
+	}
 	else
 		qvm = (qvm_t *) Q_malloc (sizeof (qvm_t));
 
@@ -477,7 +504,12 @@ qbool VM_LoadBytecode( vm_t * vm, sys_callex_t syscall1 )
 		memcpy( dst, src, header->litLength );
 	}
 
+	QVM_Decode( qvm );
 	LoadMapFile( qvm, vm->name );
+#ifdef QVM_JIT
+	if ( !QVM_JitCompile( qvm ) )
+		Con_Printf( "VM_LoadBytecode: %s will run interpreted\n", name );
+#endif
 	vm->type = VM_BYTECODE;
 	vm->hInst = qvm;
 	return true;
@@ -610,6 +642,59 @@ void  QVM_StackTrace( qvm_t * qvm )
 	}
 }
 
+/*
+  Called by the sampling profiler from its own thread while the VM may be
+  running. Only the LP and PC published by ENTER and LEAVE are used and
+  every frame is bounds checked, a torn read gives a short stack.
+  Fills pcs innermost first.
+*/
+int QVM_SampleStack( qvm_t * qvm, int *pcs, int max )
+{
+	int     LP, PC, num, n;
+
+	if ( !qvm->reenter )
+		return 0;
+
+	LP = qvm->LP;
+	PC = qvm->PC;
+	for ( n = 0; n < max; n++ )
+	{
+		if ( PC <= 0 || PC >= qvm->len_cs )
+			break;
+		pcs[n] = PC;
+
+		if ( LP < qvm->len_ds - qvm->len_ss || LP > qvm->len_ds - 2 * (int) sizeof( int ) )
+			break;
+		num = *( int * ) ( qvm->ds + LP + sizeof( int ) );
+		if ( num < 2 * (int) sizeof( int ) || num > qvm->len_ss )
+			break;
+		LP += num;
+		if ( LP > qvm->len_ds - (int) sizeof( int ) )
+			break;
+		PC = *( int * ) ( qvm->ds + LP );
+	}
+
+	return n;
+}
+
+// function containing pc, without a map file functions are named by address
+char *QVM_SampleName( qvm_t * qvm, int pc )
+{
+	symbols_t *sym;
+
+	if ( qvm->sym_info )
+	{
+		sym = QVM_FindName( qvm, pc );
+		if ( sym )
+			return sym->name;
+	}
+
+	while ( pc > 0 && qvm->cs[pc].opcode != OP_ENTER )
+		pc--;
+
+	return va( "qvm_%x", pc );
+}
+
 void QVM_RunError( qvm_t * qvm, char *error, ... )
 {
 	va_list argptr;
@@ -625,6 +710,9 @@ void QVM_RunError( qvm_t * qvm, char *error, ... )
 
 	Con_Printf( "%s\n", string );
 
+	pr2_syscall = -1;
+	pr_xbuiltin = 0;
+
 	SV_Error( "QVM Program error" );
 }
 
@@ -639,58 +727,630 @@ int trap_Call( qvm_t * qvm, int apinum )
 }
 
 
-void PrintInstruction( qvm_t * qvm );
+/*
+  Pre-decoded interpreter
+
+  QVM_Decode turns cs into a stream of qvm_op_t at load time. Branch
+  targets are resolved and range checked, common pairs are fused into
+  superinstructions, and the code is split into basic blocks. The first
+  instruction of a block carries the op stack bounds and the length of
+  the block, so the SAFE_QVM and runaway checks run once per block
+  instead of once per instruction. Computed jumps, calls and returns
+  check the bounds of the instruction they land on.
+*/
 
-int QVM_Exec( register qvm_t * qvm, int command, int arg0, int arg1, int arg2, int arg3,
-              int arg4, int arg5, int arg6, int arg7, int arg8, int arg9, int arg10, int arg11 )
+enum
 {
-	qvm_parm_type_t opStack[OPSTACKSIZE + 1];	//in q3 stack var of QVM_Exec size~0x400;
+	QOP_LOCAL_LOAD4 = OP_CVFI + 1,	// LOCAL x; LOAD4
+	QOP_CONST_STORE4,				// CONST x; STORE4
+	QOP_CONST_JUMP,					// CONST x; JUMP
+	QOP_INVALID,
+	QOP_EXIT,						// branch to PC <= 0 returns from vmMain
+	QOP_BADPC,						// branch past the end of cs
+	QOP_BLOCK,						// block entry checks, then the real op
+	QOP_NUMOPS
+};
+
+#if defined(__GNUC__)
+#define QVM_COMPUTED_GOTO
+#endif
+
+#ifdef QVM_COMPUTED_GOTO
+#define QVM_CASE(x)			op_##x:
+#define QVM_DISPATCH()		goto *ip->label
+#else
+#define QVM_CASE(x)			case x:
+#define QVM_DISPATCH()		continue
+#endif
+#define QVM_NEXT()			{ ip++; QVM_DISPATCH(); }
+
+#define QVM_SYNC()			( qvm->PC = ip - code, qvm->SP = sp - opStack, qvm->LP = lp )
+#define QVM_FAIL(msg)		{ QVM_SYNC(); QVM_RunError( qvm, msg " at %8x", qvm->PC ); }
+
+#ifdef SAFE_QVM
+#define QVM_CHECKSTACK() \
+	if ( sp - opStack + ip->sp_lo < 0 ) \
+		QVM_FAIL( "QVM opStack underflow" ) \
+	if ( sp - opStack + ip->sp_hi > OPSTACKSIZE ) \
+		QVM_FAIL( "QVM opStack overflow" )
+#define QVM_CHECKPC(x) \
+	if ( (x) >= qvm->len_cs ) \
+	{ \
+		QVM_SYNC(); \
+		QVM_RunError( qvm, "QVM PC out of range, %8d\n", (x) ); \
+	}
+#else
+#define QVM_CHECKSTACK()
+#define QVM_CHECKPC(x)
+#endif
+
 #ifdef QVM_RUNAWAY_PROTECTION
-	int 	cycles[MAX_PROC_CALL],cycles_p=0;
+#define QVM_CHECKCYCLES() \
+	if ( ( cycles[cycles_p] += ip->blocklen ) > MAX_CYCLES ) \
+		QVM_FAIL( "QVM runaway loop error" )
+// targets of computed jumps aren't always block leaders, count the jump itself
+#define QVM_CHECKJUMP() \
+	if ( ++cycles[cycles_p] > MAX_CYCLES ) \
+		QVM_FAIL( "QVM runaway loop error" )
+#else
+#define QVM_CHECKCYCLES()
+#define QVM_CHECKJUMP()
 #endif
-#ifdef QVM_PROFILE
-	profile_t *profile_func = NULL;
-	symbols_t *sym;
+
+// computed jump, call or return
+#define QVM_JUMPTO(x) \
+	if ( (x) <= 0 ) \
+		goto done; \
+	QVM_CHECKPC( x ); \
+	ip = code + (x); \
+	QVM_CHECKSTACK(); \
+	QVM_CHECKJUMP(); \
+	QVM_DISPATCH()
+
+#ifdef QVM_DATA_PROTECTION
+#define QVM_CHECKREAD(x, size) \
+	if ( (unsigned int) (x) > (unsigned int) ( qvm->len_ds - (size) ) && !PR2_IsValidReadAddress( qvm, (intptr_t) ds + (x) ) ) \
+	{ \
+		QVM_SYNC(); \
+		QVM_RunError( qvm, "data load %d out of range %8x\n", (size), (x) ); \
+	}
+#define QVM_CHECKWRITE(x, size) \
+	if ( (unsigned int) (x) > (unsigned int) ( qvm->len_ds - (size) ) && !PR2_IsValidWriteAddress( qvm, (intptr_t) ds + (x) ) ) \
+	{ \
+		QVM_SYNC(); \
+		QVM_RunError( qvm, "data store %d out of range %8x\n", (size), (x) ); \
+	}
+#else
+#define QVM_CHECKREAD(x, size)	(x) &= qvm->ds_mask;
+#define QVM_CHECKWRITE(x, size)	(x) &= qvm->ds_mask;
 #endif
-	int     savePC, saveSP, saveLP, ivar = 0;
-	qvm_instruction_t op;
 
-	savePC = qvm->PC;
-	saveSP = qvm->SP;
-	saveLP = qvm->LP;
+#define QVM_COMPARE(f, o) \
+	sp -= 2; \
+	if ( sp[1].f o sp[2].f ) \
+	{ \
+		ip = code + ip->parm; \
+		QVM_DISPATCH(); \
+	} \
+	QVM_NEXT()
+
+#define QVM_BINARY(f, o) \
+	sp[-1].f o sp[0].f; \
+	sp--; \
+	QVM_NEXT()
+
+#ifdef QVM_COMPUTED_GOTO
+static const void **qvm_labels;
+#endif
+
+// called with a NULL qvm it only publishes its label table for QVM_Decode
+static int QVM_ExecDecoded( qvm_t * qvm, qvm_parm_type_t * opStack )
+{
+#ifdef QVM_COMPUTED_GOTO
+	static const void *labels[QOP_NUMOPS] = {
+		[OP_UNDEF] = &&op_OP_UNDEF, [OP_IGNORE] = &&op_OP_IGNORE, [OP_BREAK] = &&op_OP_BREAK,
+		[OP_ENTER] = &&op_OP_ENTER, [OP_LEAVE] = &&op_OP_LEAVE, [OP_CALL] = &&op_OP_CALL,
+		[OP_PUSH] = &&op_OP_PUSH, [OP_POP] = &&op_OP_POP, [OP_CONST] = &&op_OP_CONST,
+		[OP_LOCAL] = &&op_OP_LOCAL, [OP_JUMP] = &&op_OP_JUMP,
+		[OP_EQ] = &&op_OP_EQ, [OP_NE] = &&op_OP_NE,
+		[OP_LTI] = &&op_OP_LTI, [OP_LEI] = &&op_OP_LEI, [OP_GTI] = &&op_OP_GTI, [OP_GEI] = &&op_OP_GEI,
+		[OP_LTU] = &&op_OP_LTU, [OP_LEU] = &&op_OP_LEU, [OP_GTU] = &&op_OP_GTU, [OP_GEU] = &&op_OP_GEU,
+		[OP_EQF] = &&op_OP_EQF, [OP_NEF] = &&op_OP_NEF,
+		[OP_LTF] = &&op_OP_LTF, [OP_LEF] = &&op_OP_LEF, [OP_GTF] = &&op_OP_GTF, [OP_GEF] = &&op_OP_GEF,
+		[OP_LOAD1] = &&op_OP_LOAD1, [OP_LOAD2] = &&op_OP_LOAD2, [OP_LOAD4] = &&op_OP_LOAD4,
+		[OP_STORE1] = &&op_OP_STORE1, [OP_STORE2] = &&op_OP_STORE2, [OP_STORE4] = &&op_OP_STORE4,
+		[OP_ARG] = &&op_OP_ARG, [OP_BLOCK_COPY] = &&op_OP_BLOCK_COPY,
+		[OP_SEX8] = &&op_OP_SEX8, [OP_SEX16] = &&op_OP_SEX16,
+		[OP_NEGI] = &&op_OP_NEGI, [OP_ADD] = &&op_OP_ADD, [OP_SUB] = &&op_OP_SUB,
+		[OP_DIVI] = &&op_OP_DIVI, [OP_DIVU] = &&op_OP_DIVU, [OP_MODI] = &&op_OP_MODI, [OP_MODU] = &&op_OP_MODU,
+		[OP_MULI] = &&op_OP_MULI, [OP_MULU] = &&op_OP_MULU,
+		[OP_BAND] = &&op_OP_BAND, [OP_BOR] = &&op_OP_BOR, [OP_BXOR] = &&op_OP_BXOR, [OP_BCOM] = &&op_OP_BCOM,
+		[OP_LSH] = &&op_OP_LSH, [OP_RSHI] = &&op_OP_RSHI, [OP_RSHU] = &&op_OP_RSHU,
+		[OP_NEGF] = &&op_OP_NEGF, [OP_ADDF] = &&op_OP_ADDF, [OP_SUBF] = &&op_OP_SUBF,
+		[OP_DIVF] = &&op_OP_DIVF, [OP_MULF] = &&op_OP_MULF,
+		[OP_CVIF] = &&op_OP_CVIF, [OP_CVFI] = &&op_OP_CVFI,
+		[QOP_LOCAL_LOAD4] = &&op_QOP_LOCAL_LOAD4, [QOP_CONST_STORE4] = &&op_QOP_CONST_STORE4,
+		[QOP_CONST_JUMP] = &&op_QOP_CONST_JUMP, [QOP_INVALID] = &&op_QOP_INVALID,
+		[QOP_EXIT] = &&op_QOP_EXIT, [QOP_BADPC] = &&op_QOP_BADPC, [QOP_BLOCK] = &&op_QOP_BLOCK
+	};
+#endif
+	qvm_op_t *code, *ip;
+	qvm_parm_type_t *sp;
+	byte *ds;
+	int lp, ivar;
+#ifdef QVM_RUNAWAY_PROTECTION
+	int cycles[MAX_PROC_CALL], cycles_p = 0;
+#endif
 
+#ifdef QVM_COMPUTED_GOTO
+	if ( !qvm )
+	{
+		qvm_labels = labels;
+		return 0;
+	}
+#else
+	if ( !qvm )
+		return 0;
+#endif
 
-#ifdef QVM_PROFILE
-	if((int)sv_enableprofile.value)
-		profile_func = ProfileEnterFunction(0);
+	code = qvm->code;
+	ip = code;
+	sp = opStack;
+	ds = qvm->ds;
+	lp = qvm->LP;
+#ifdef QVM_RUNAWAY_PROTECTION
+	cycles[0] = 0;
 #endif
-	if ( !qvm->reenter )
+
+#ifdef QVM_COMPUTED_GOTO
+	QVM_DISPATCH();
+
+op_QOP_BLOCK:
+	QVM_CHECKSTACK();
+	QVM_CHECKCYCLES();
+	goto *labels[ip->op];
+#else
+	for ( ;; )
 	{
-		//FIXME check last exit REGISTERS
-		qvm->LP = qvm->len_ds - sizeof(int);
+		if ( ip->blocklen )
+		{
+			QVM_CHECKSTACK();
+			QVM_CHECKCYCLES();
+		}
+
+		switch ( ip->op )
+		{
+#endif
+		QVM_CASE( OP_UNDEF )
+			QVM_SYNC();
+			QVM_RunError( qvm, "OP_UNDEF\n" );
+
+		QVM_CASE( OP_IGNORE )
+			QVM_NEXT();
+
+		QVM_CASE( OP_BREAK )
+			QVM_SYNC();
+			QVM_RunError( qvm, "OP_BREAK\n" );
+
+		QVM_CASE( QOP_INVALID )
+			QVM_SYNC();
+			QVM_RunError( qvm, "invalid opcode %2.2x at off=%8x\n", qvm->cs[qvm->PC].opcode, qvm->PC );
+
+		QVM_CASE( QOP_BADPC )
+			QVM_FAIL( "QVM PC out of range" );
+
+		QVM_CASE( QOP_EXIT )
+			goto done;
+
+		QVM_CASE( OP_ENTER )
+			lp -= ip->parm;
+#ifdef SAFE_QVM
+			if ( lp < qvm->len_ds - qvm->len_ss )
+				QVM_FAIL( "QVM Stack overflow" );
+			if ( lp > qvm->len_ds - 2 * (int) sizeof( int ) )
+				QVM_FAIL( "QVM Stack underflow" );
+#endif
+			*( int * ) ( ds + lp + sizeof( int ) ) = ip->parm;
+#ifdef QVM_RUNAWAY_PROTECTION
+			if ( ++cycles_p >= MAX_PROC_CALL )
+				QVM_FAIL( "MAX_PROC_CALL reached" );
+			cycles[cycles_p] = 0;
+#endif
+			// published for QVM_SampleStack
+			qvm->PC = ip - code;
+			qvm->LP = lp;
+			QVM_NEXT();
+
+		QVM_CASE( OP_LEAVE )
+			lp += ip->parm;
+#ifdef SAFE_QVM
+			if ( lp < qvm->len_ds - qvm->len_ss || lp > qvm->len_ds - 2 * (int) sizeof( int ) )
+				QVM_FAIL( "QVM Stack underflow" );
+#endif
+#ifdef QVM_RUNAWAY_PROTECTION
+			if ( cycles_p > 0 )
+				cycles_p--;
+#endif
+			ivar = *( int * ) ( ds + lp );
+			qvm->PC = ivar;
+			qvm->LP = lp;
+			QVM_JUMPTO( ivar );
+
+		QVM_CASE( OP_CALL )
+			*( int * ) ( ds + lp ) = ip - code + 1;
+			ivar = sp->_int;
+			sp--;
+			if ( ivar < 0 )
+			{
+				QVM_SYNC();
+				sp++;
+				sp->_int = trap_Call( qvm, -ivar - 1 );
+				QVM_NEXT();
+			}
+			QVM_JUMPTO( ivar );
+
+		QVM_CASE( OP_PUSH )
+			sp++;
+			QVM_NEXT();
+
+		QVM_CASE( OP_POP )
+			sp--;
+			QVM_NEXT();
+
+		QVM_CASE( OP_CONST )
+			sp++;
+			sp->_int = ip->parm;
+			QVM_NEXT();
+
+		QVM_CASE( OP_LOCAL )
+			sp++;
+			sp->_int = lp + ip->parm;
+			QVM_NEXT();
+
+		QVM_CASE( OP_JUMP )
+			ivar = sp->_int;
+			sp--;
+			QVM_JUMPTO( ivar );
+
+		QVM_CASE( QOP_CONST_JUMP )
+			ip = code + ip->parm;
+			QVM_DISPATCH();
+
+		QVM_CASE( OP_EQ )	QVM_COMPARE( _int, == );
+		QVM_CASE( OP_NE )	QVM_COMPARE( _int, != );
+		QVM_CASE( OP_LTI )	QVM_COMPARE( _int, < );
+		QVM_CASE( OP_LEI )	QVM_COMPARE( _int, <= );
+		QVM_CASE( OP_GTI )	QVM_COMPARE( _int, > );
+		QVM_CASE( OP_GEI )	QVM_COMPARE( _int, >= );
+		QVM_CASE( OP_LTU )	QVM_COMPARE( _uint, < );
+		QVM_CASE( OP_LEU )	QVM_COMPARE( _uint, <= );
+		QVM_CASE( OP_GTU )	QVM_COMPARE( _uint, > );
+		QVM_CASE( OP_GEU )	QVM_COMPARE( _uint, >= );
+		QVM_CASE( OP_EQF )	QVM_COMPARE( _float, == );
+		QVM_CASE( OP_NEF )	QVM_COMPARE( _float, != );
+		QVM_CASE( OP_LTF )	QVM_COMPARE( _float, < );
+		QVM_CASE( OP_LEF )	QVM_COMPARE( _float, <= );
+		QVM_CASE( OP_GTF )	QVM_COMPARE( _float, > );
+		QVM_CASE( OP_GEF )	QVM_COMPARE( _float, >= );
+
+		QVM_CASE( OP_LOAD1 )
+			ivar = sp->_int;
+			QVM_CHECKREAD( ivar, 1 );
+			sp->_int = *( char * ) ( ds + ivar );
+			QVM_NEXT();
+
+		QVM_CASE( OP_LOAD2 )
+			ivar = sp->_int;
+			QVM_CHECKREAD( ivar, 2 );
+			sp->_int = *( short * ) ( ds + ivar );
+			QVM_NEXT();
+
+		QVM_CASE( OP_LOAD4 )
+			ivar = sp->_int;
+			QVM_CHECKREAD( ivar, 4 );
+			sp->_int = *( int * ) ( ds + ivar );
+			QVM_NEXT();
+
+		QVM_CASE( QOP_LOCAL_LOAD4 )
+			ivar = lp + ip->parm;
+			QVM_CHECKREAD( ivar, 4 );
+			sp++;
+			sp->_int = *( int * ) ( ds + ivar );
+			ip += 2;
+			QVM_DISPATCH();
+
+		QVM_CASE( OP_STORE1 )
+			ivar = sp[-1]._int;
+			QVM_CHECKWRITE( ivar, 1 );
+			*( char * ) ( ds + ivar ) = sp->_int & 0xff;
+			sp -= 2;
+			QVM_NEXT();
+
+		QVM_CASE( OP_STORE2 )
+			ivar = sp[-1]._int;
+			QVM_CHECKWRITE( ivar, 2 );
+			*( short * ) ( ds + ivar ) = sp->_int & 0xffff;
+			sp -= 2;
+			QVM_NEXT();
+
+		QVM_CASE( OP_STORE4 )
+			ivar = sp[-1]._int;
+			QVM_CHECKWRITE( ivar, 4 );
+			*( int * ) ( ds + ivar ) = sp->_int;
+			sp -= 2;
+			QVM_NEXT();
+
+		QVM_CASE( QOP_CONST_STORE4 )
+			ivar = sp->_int;
+			QVM_CHECKWRITE( ivar, 4 );
+			*( int * ) ( ds + ivar ) = ip->parm;
+			sp--;
+			ip += 2;
+			QVM_DISPATCH();
+
+		QVM_CASE( OP_ARG )
+			ivar = lp + ip->parm;
+			QVM_CHECKWRITE( ivar, 4 );
+			*( int * ) ( ds + ivar ) = sp->_int;
+			sp--;
+			QVM_NEXT();
+
+		QVM_CASE( OP_BLOCK_COPY )
+			{
+				int off1, off2, len;
+
+				off1 = sp[-1]._int;
+				off2 = sp[0]._int;
+				len = ip->parm;
+#ifdef QVM_DATA_PROTECTION
+				if (!PR2_IsValidWriteAddress(qvm, (intptr_t)ds + off1) || !PR2_IsValidWriteAddress(qvm, (intptr_t)ds + off1 + len) ||
+					!PR2_IsValidReadAddress(qvm, (intptr_t)ds + off2) || !PR2_IsValidReadAddress(qvm, (intptr_t)ds + off2 + len)) {
+					QVM_SYNC();
+					QVM_RunError(qvm, "block copy out of range %8x\n", off1);
+				}
+				memmove( ds + off1, ds + off2, len );
+#else
+				memmove( ds + (off1 & qvm->ds_mask), ds + (off2 & qvm->ds_mask), len );
+#endif
+				sp -= 2;
+			}
+			QVM_NEXT();
+
+		QVM_CASE( OP_SEX8 )
+			sp->_int = (signed char) sp->_int;
+			QVM_NEXT();
+
+		QVM_CASE( OP_SEX16 )
+			sp->_int = (short) sp->_int;
+			QVM_NEXT();
+
+		QVM_CASE( OP_NEGI )
+			sp->_int = -sp->_int;
+			QVM_NEXT();
+
+		QVM_CASE( OP_BCOM )
+			sp->_int = ~sp->_int;
+			QVM_NEXT();
+
+		QVM_CASE( OP_ADD )	QVM_BINARY( _int, += );
+		QVM_CASE( OP_SUB )	QVM_BINARY( _int, -= );
+		QVM_CASE( OP_DIVI )	QVM_BINARY( _int, /= );
+		QVM_CASE( OP_DIVU )	QVM_BINARY( _uint, /= );
+		QVM_CASE( OP_MODI )	QVM_BINARY( _int, %= );
+		QVM_CASE( OP_MODU )	QVM_BINARY( _uint, %= );
+		QVM_CASE( OP_MULI )	QVM_BINARY( _int, *= );
+		QVM_CASE( OP_MULU )	QVM_BINARY( _uint, *= );
+		QVM_CASE( OP_BAND )	QVM_BINARY( _int, &= );
+		QVM_CASE( OP_BOR )	QVM_BINARY( _int, |= );
+		QVM_CASE( OP_BXOR )	QVM_BINARY( _int, ^= );
+		QVM_CASE( OP_LSH )	QVM_BINARY( _int, <<= );
+		QVM_CASE( OP_RSHI )	QVM_BINARY( _int, >>= );
+		QVM_CASE( OP_RSHU )	QVM_BINARY( _uint, >>= );
+		QVM_CASE( OP_ADDF )	QVM_BINARY( _float, += );
+		QVM_CASE( OP_SUBF )	QVM_BINARY( _float, -= );
+		QVM_CASE( OP_MULF )	QVM_BINARY( _float, *= );
+		QVM_CASE( OP_DIVF )	QVM_BINARY( _float, /= );
+
+		QVM_CASE( OP_NEGF )
+			sp->_float = -sp->_float;
+			QVM_NEXT();
+
+		QVM_CASE( OP_CVIF )
+			sp->_float = sp->_int;
+			QVM_NEXT();
+
+		QVM_CASE( OP_CVFI )
+			sp->_int = sp->_float;
+			QVM_NEXT();
+
+#ifndef QVM_COMPUTED_GOTO
+		default:
+			QVM_FAIL( "invalid decoded opcode" );
+		}
 	}
-	if ( qvm->reenter++ > MAX_vmMain_Call )
-		QVM_RunError( qvm, "QVM_Exec MAX_vmMain_Call reached");
+#endif
 
-	qvm->PC = 0;
-	qvm->SP = 0;
-	qvm->LP -= 14 * sizeof(int);
+done:
+	return sp->_int;
+}
 
-	STACK_INT( 0 )  = 0;	// return addres;
-	STACK_INT( 1 )  = 14 * sizeof(int);	//11 params + command + retaddr + num args;
-	STACK_INT( 2 )  = command;
-	STACK_INT( 3 )  = arg0;
-	STACK_INT( 4 )  = arg1;
-	STACK_INT( 5 )  = arg2;
-	STACK_INT( 6 )  = arg3;
-	STACK_INT( 7 )  = arg4;
-	STACK_INT( 8 )  = arg5;
-	STACK_INT( 9 )  = arg6;
-	STACK_INT( 10 ) = arg7;
-	STACK_INT( 11 ) = arg8;
-	STACK_INT( 12 ) = arg9;
-	STACK_INT( 13 ) = arg10;
-	STACK_INT( 14 ) = arg11;
+static void QVM_StackEffect( int op, int *reads, int *delta )
+{
+	*reads = 0;
+	*delta = 0;
+
+	switch ( op )
+	{
+	case OP_PUSH:
+	case OP_CONST:
+	case OP_LOCAL:
+		*delta = 1;
+		break;
+
+	case OP_POP:
+		*delta = -1;
+		break;
+
+	case OP_CALL:
+	case OP_LOAD1:
+	case OP_LOAD2:
+	case OP_LOAD4:
+	case OP_SEX8:
+	case OP_SEX16:
+	case OP_NEGI:
+	case OP_BCOM:
+	case OP_NEGF:
+	case OP_CVIF:
+	case OP_CVFI:
+		*reads = 1;
+		break;
+
+	case OP_JUMP:
+	case OP_ARG:
+		*reads = 1;
+		*delta = -1;
+		break;
+
+	case OP_STORE1:
+	case OP_STORE2:
+	case OP_STORE4:
+	case OP_BLOCK_COPY:
+		*reads = 2;
+		*delta = -2;
+		break;
+
+	default:
+		if ( op >= OP_EQ && op <= OP_GEF )
+		{
+			*reads = 2;
+			*delta = -2;
+		}
+		else if ( ( op >= OP_ADD && op <= OP_BXOR ) || ( op >= OP_LSH && op <= OP_MULF ) )
+		{
+			*reads = 2;
+			*delta = -1;
+		}
+		break;
+	}
+}
+
+static int QVM_DecodeTarget( qvm_t * qvm, int target )
+{
+	if ( target <= 0 )
+		return qvm->len_cs;
+	if ( target >= qvm->len_cs )
+		return qvm->len_cs + 1;
+	return target;
+}
+
+static void QVM_Decode( qvm_t * qvm )
+{
+	qvm_instruction_t *cs = qvm->cs;
+	qvm_op_t *code;
+	byte *leader;
+	int i, op, next, parm, reads, delta, lo, hi, len;
+
+	code = (qvm_op_t *) Hunk_AllocName( ( qvm->len_cs + 2 ) * sizeof( qvm_op_t ), "qvmops" );
+	leader = (byte *) Q_malloc( qvm->len_cs + 1 );
+
+	// find basic blocks
+	leader[0] = 1;
+	for ( i = 0; i < qvm->len_cs; i++ )
+	{
+		op = cs[i].opcode;
+		parm = cs[i].parm._int;
+
+		if ( op == OP_ENTER )
+			leader[i] = 1;
+		else if ( op == OP_CALL || op == OP_JUMP || op == OP_LEAVE )
+			leader[i + 1] = 1;
+		else if ( op >= OP_EQ && op <= OP_GEF )
+		{
+			leader[i + 1] = 1;
+			if ( parm > 0 && parm < qvm->len_cs )
+				leader[parm] = 1;
+		}
+		else if ( op == OP_CONST && i + 1 < qvm->len_cs && cs[i + 1].opcode == OP_JUMP && parm > 0 && parm < qvm->len_cs )
+			leader[parm] = 1;
+	}
+
+	for ( i = 0; i < qvm->len_cs; i++ )
+	{
+		op = cs[i].opcode;
+		next = i + 1 < qvm->len_cs && !leader[i + 1] ? (int) cs[i + 1].opcode : -1;
+		code[i].parm = cs[i].parm._int;
+
+		if ( op < OP_UNDEF || op > OP_CVFI )
+			op = QOP_INVALID;
+		else if ( op >= OP_EQ && op <= OP_GEF )
+			code[i].parm = QVM_DecodeTarget( qvm, code[i].parm );
+		// fuse pairs, unless something branches between them
+		else if ( op == OP_LOCAL && next == OP_LOAD4 )
+			op = QOP_LOCAL_LOAD4;
+		else if ( op == OP_CONST && next == OP_STORE4 )
+			op = QOP_CONST_STORE4;
+		else if ( op == OP_CONST && next == OP_JUMP )
+		{
+			op = QOP_CONST_JUMP;
+			code[i].parm = QVM_DecodeTarget( qvm, code[i].parm );
+		}
+		code[i].op = op;
+	}
+	code[qvm->len_cs].op = QOP_EXIT;
+	code[qvm->len_cs + 1].op = QOP_BADPC;
+
+	// op stack bounds and length from each instruction to the end of its block
+	lo = hi = len = 0;
+	for ( i = qvm->len_cs - 1; i >= 0; i-- )
+	{
+		QVM_StackEffect( cs[i].opcode, &reads, &delta );
+
+		if ( i + 1 < qvm->len_cs && !leader[i + 1] )
+		{
+			lo = min( delta + lo, min( 0, delta ) );
+			hi = max( delta + hi, max( 0, delta ) );
+			len++;
+		}
+		else
+		{
+			lo = min( 0, delta );
+			hi = max( 0, delta );
+			len = 1;
+		}
+		if ( reads )
+			lo = min( lo, 1 - reads );
+
+		code[i].sp_lo = bound( -OPSTACKSIZE - 1, lo, 0 );
+		code[i].sp_hi = bound( 0, hi, OPSTACKSIZE + 1 );
+		code[i].blocklen = leader[i] ? len : 0;
+	}
+
+#ifdef QVM_COMPUTED_GOTO
+	QVM_ExecDecoded( NULL, NULL );
+	for ( i = 0; i < qvm->len_cs + 2; i++ )
+		code[i].label = qvm_labels[code[i].blocklen ? QOP_BLOCK : code[i].op];
+#endif
+
+	Q_free( leader );
+	qvm->code = code;
+}
+
+void PrintInstruction( qvm_t * qvm );
+
+#ifdef QVM_PROFILE
+// reference interpreter, checks and counts every instruction for PR2_Profile_f
+static int QVM_ExecProfiled( register qvm_t * qvm, qvm_parm_type_t * opStack )
+{
+#ifdef QVM_RUNAWAY_PROTECTION
+	int 	cycles[MAX_PROC_CALL],cycles_p=0;
+#endif
+	profile_t *profile_func = NULL;
+	symbols_t *sym;
+	int     ivar = 0;
+	qvm_instruction_t op;
+
+	if((int)sv_enableprofile.value)
+		profile_func = ProfileEnterFunction(0);
 #ifdef QVM_RUNAWAY_PROTECTION
 	cycles[cycles_p] = 0;
 #endif
@@ -763,7 +1423,7 @@ int QVM_Exec( register qvm_t * qvm, int command, int arg0, int arg1, int arg2, i
 			if((int)sv_enableprofile.value)
 			{
 				sym = QVM_FindName( qvm, qvm->PC );
-				profile_func = ProfileEnterFunction(sym->off);
+				profile_func = ProfileEnterFunction(sym ? sym->off : 0);
 			}
 #endif
 
@@ -1138,13 +1798,868 @@ int QVM_Exec( register qvm_t * qvm, int command, int arg0, int arg1, int arg2, i
 	}
 	while ( qvm->PC > 0 );
 
-	ivar = opStack[qvm->SP]._int;
-	qvm->PC = savePC;
-	qvm->SP = saveSP;
-	qvm->LP = saveLP;
-	qvm->reenter--;
-	return ivar;
+	return opStack[qvm->SP]._int;
 }
+#endif
+
+int QVM_Exec( register qvm_t * qvm, int command, int arg0, int arg1, int arg2, int arg3,
+              int arg4, int arg5, int arg6, int arg7, int arg8, int arg9, int arg10, int arg11 )
+{
+	qvm_parm_type_t opStack[OPSTACKSIZE + 2];	//in q3 stack var of QVM_Exec size~0x400; one more for the jit
+	int     savePC, saveSP, saveLP, ivar = 0;
+
+	savePC = qvm->PC;
+	saveSP = qvm->SP;
+	saveLP = qvm->LP;
+
+	if ( !qvm->reenter )
+	{
+		//FIXME check last exit REGISTERS
+		qvm->LP = qvm->len_ds - sizeof(int);
+	}
+	if ( qvm->reenter++ > MAX_vmMain_Call )
+		QVM_RunError( qvm, "QVM_Exec MAX_vmMain_Call reached");
+
+	qvm->PC = 0;
+	qvm->SP = 0;
+	qvm->LP -= 14 * sizeof(int);
+
+	STACK_INT( 0 )  = 0;	// return addres;
+	STACK_INT( 1 )  = 14 * sizeof(int);	//11 params + command + retaddr + num args;
+	STACK_INT( 2 )  = command;
+	STACK_INT( 3 )  = arg0;
+	STACK_INT( 4 )  = arg1;
+	STACK_INT( 5 )  = arg2;
+	STACK_INT( 6 )  = arg3;
+	STACK_INT( 7 )  = arg4;
+	STACK_INT( 8 )  = arg5;
+	STACK_INT( 9 )  = arg6;
+	STACK_INT( 10 ) = arg7;
+	STACK_INT( 11 ) = arg8;
+	STACK_INT( 12 ) = arg9;
+	STACK_INT( 13 ) = arg10;
+	STACK_INT( 14 ) = arg11;
+
+	if ( qvm->LP < qvm->len_ds - qvm->len_ss || qvm->LP > qvm->len_ds - 2 * (int) sizeof( int ) )
+		QVM_RunError( qvm, "QVM Stack overflow at %8x", qvm->PC );
+
+	// profiling counts instructions, that needs the reference interpreter
+#ifdef QVM_PROFILE
+	if ( (int)sv_enableprofile.value )
+		ivar = QVM_ExecProfiled( qvm, opStack );
+	else
+#endif
+#ifdef QVM_JIT
+	if ( qvm->jit_entry && (int)sv_qvmjit.value )
+		ivar = qvm->jit_entry( qvm, opStack + 2, qvm->LP );
+	else
+#endif
+		ivar = QVM_ExecDecoded( qvm, opStack );
+
+	qvm->PC = savePC;
+	qvm->SP = saveSP;
+	qvm->LP = saveLP;
+	qvm->reenter--;
+	return ivar;
+}
+#ifdef QVM_JIT
+/*
+  x86-64 code generator
+
+  Every QVM instruction is translated to a fixed native sequence, there is
+  no register allocation. Register usage inside generated code:
+
+	rbx		opStack index, only bl is ever modified so it wraps at 256,
+			operands are read down to 2 below it, QVM_Exec leaves room for
+			that below the opStack it passes in
+	rbp		backward branch budget, runaway loop protection
+	r12		qvm->ds
+	r13		opStack base
+	r14d	LP
+	r15		qvm
+
+  QVM procedures are native procedures: OP_CALL is a call through
+  jit_calltable and OP_LEAVE is a ret, each QVM frame takes 16 bytes of
+  native stack so rsp stays aligned for calls to C helpers.
+  Loads and stores inside the data segment are done inline, anything else
+  goes through the same checks the interpreter does.
+*/
+
+typedef enum
+{
+	JITERR_RUNAWAY,
+	JITERR_BADTARGET,
+	JITERR_OVERFLOW,
+	JITERR_UNDERFLOW,
+	JITERR_UNDEF,
+	JITERR_BREAK,
+	JITERR_OPCODE
+} jiterror_t;
+
+typedef struct
+{
+	byte	*code;		// NULL while sizing
+	int		pos;
+	int		*instrofs;
+	int		stub_error;
+	int		stub_badtarget;
+} jitbuf_t;
+
+static void QVM_JitError( qvm_t * qvm, int pc, int error )
+{
+	qvm->PC = pc;
+
+	switch ( error )
+	{
+	case JITERR_RUNAWAY:
+		QVM_RunError( qvm, "QVM runaway loop error at %8x", pc );
+	case JITERR_BADTARGET:
+		QVM_RunError( qvm, "QVM PC out of range, %8d\n", pc );
+	case JITERR_OVERFLOW:
+		QVM_RunError( qvm, "QVM Stack overflow at %8x", pc );
+	case JITERR_UNDERFLOW:
+		QVM_RunError( qvm, "QVM Stack underflow at %8x", pc );
+	case JITERR_UNDEF:
+		QVM_RunError( qvm, "OP_UNDEF\n" );
+	case JITERR_BREAK:
+		QVM_RunError( qvm, "OP_BREAK\n" );
+	default:
+		QVM_RunError( qvm, "invalid opcode %2.2x at off=%8x\n", qvm->cs[pc].opcode, pc );
+	}
+}
+
+static int QVM_JitLoad( qvm_t * qvm, int addr, int size, int pc )
+{
+	byte *p;
+
+#ifdef QVM_DATA_PROTECTION
+	if (!PR2_IsValidReadAddress(qvm, (intptr_t)qvm->ds + addr))
+	{
+		qvm->PC = pc;
+		QVM_RunError( qvm, "data load %d out of range %8x\n", size, addr );
+	}
+	p = qvm->ds + addr;
+#else
+	p = qvm->ds + (addr & qvm->ds_mask);
+#endif
+
+	if ( size == 1 )
+		return *( char * ) p;
+	if ( size == 2 )
+		return *( short * ) p;
+	return *( int * ) p;
+}
+
+static void QVM_JitStore( qvm_t * qvm, int addr, int value, int size, int pc )
+{
+	byte *p;
+
+#ifdef QVM_DATA_PROTECTION
+	if (!PR2_IsValidWriteAddress(qvm, (intptr_t)qvm->ds + addr))
+	{
+		qvm->PC = pc;
+		QVM_RunError( qvm, "data store %d out of range %8x\n", size, addr );
+	}
+	p = qvm->ds + addr;
+#else
+	p = qvm->ds + (addr & qvm->ds_mask);
+#endif
+
+	if ( size == 1 )
+		*( char * ) p = value & 0xff;
+	else if ( size == 2 )
+		*( short * ) p = value & 0xffff;
+	else
+		*( int * ) p = value;
+}
+
+static void QVM_JitBlockCopy( qvm_t * qvm, int off1, int off2, int len, int pc )
+{
+#ifdef QVM_DATA_PROTECTION
+	if (!PR2_IsValidWriteAddress(qvm, (intptr_t)qvm->ds + off1) || !PR2_IsValidWriteAddress(qvm, (intptr_t)qvm->ds + off1 + len) ||
+		!PR2_IsValidReadAddress(qvm, (intptr_t)qvm->ds + off2) || !PR2_IsValidReadAddress(qvm, (intptr_t)qvm->ds + off2 + len)) {
+		qvm->PC = pc;
+		QVM_RunError(qvm, "block copy out of range %8x\n", off1);
+	}
+	memmove( qvm->ds + off1, qvm->ds + off2, len );
+#else
+	memmove( qvm->ds + (off1 & qvm->ds_mask), qvm->ds + (off2 & qvm->ds_mask), len );
+#endif
+}
+
+static int QVM_JitSyscall( qvm_t * qvm, int apinum )
+{
+	return qvm->syscall( qvm->ds, qvm->ds_mask, apinum, ( pr2val_t* ) ( qvm->ds + qvm->LP + 2*sizeof(int) ) );
+}
+
+static void Jit1( jitbuf_t *b, int v )
+{
+	if ( b->code )
+		b->code[b->pos] = v;
+	b->pos++;
+}
+
+static void Jit2( jitbuf_t *b, int v1, int v2 )
+{
+	Jit1( b, v1 );
+	Jit1( b, v2 );
+}
+
+static void Jit3( jitbuf_t *b, int v1, int v2, int v3 )
+{
+	Jit1( b, v1 );
+	Jit1( b, v2 );
+	Jit1( b, v3 );
+}
+
+static void Jit4( jitbuf_t *b, int v )
+{
+	if ( b->code )
+		memcpy( b->code + b->pos, &v, 4 );
+	b->pos += 4;
+}
+
+static void Jit8( jitbuf_t *b, const void *v )
+{
+	uint64_t u = (uint64_t) (uintptr_t) v;
+
+	if ( b->code )
+		memcpy( b->code + b->pos, &u, 8 );
+	b->pos += 8;
+}
+
+// <prefix> <rex.b> [0f] op reg, [r13 + rbx*4 + disp]
+static void JitOpStack( jitbuf_t *b, int prefix, qbool twobyte, int op, int reg, int disp )
+{
+	if ( prefix )
+		Jit1( b, prefix );
+	Jit1( b, 0x41 );
+	if ( twobyte )
+		Jit1( b, 0x0f );
+	Jit2( b, op, 0x44 | ( reg << 3 ) );
+	Jit2( b, 0x9d, disp & 0xff );
+}
+
+#define JitLoadTop(b, reg, disp)	JitOpStack( b, 0, false, 0x8b, reg, disp )	// mov reg, [top]
+#define JitStoreTop(b, reg, disp)	JitOpStack( b, 0, false, 0x89, reg, disp )	// mov [top], reg
+#define JitIncTop(b)				Jit2( b, 0xfe, 0xc3 )						// inc bl
+#define JitDecTop(b)				Jit2( b, 0xfe, 0xcb )						// dec bl
+#define JitSubTop(b, n)				Jit3( b, 0x80, 0xeb, n )					// sub bl, n
+#define JitSyncLP(b)				Jit3( b, 0x45, 0x89, 0xb7 ), Jit4( b, (int)offsetof(qvm_t, LP) )	// mov [r15 + LP], r14d
+#define JitSyncPC(b, pc)			Jit3( b, 0x41, 0xc7, 0x87 ), Jit4( b, (int)offsetof(qvm_t, PC) ), Jit4( b, pc )	// mov [r15 + PC], pc
+#define JitArgQvm(b)				Jit3( b, 0x4c, 0x89, 0xff )					// mov rdi, r15
+
+static void JitMovImm64( jitbuf_t *b, int reg, const void *v )
+{
+	Jit2( b, 0x48, 0xb8 + reg );
+	Jit8( b, v );
+}
+
+static void JitCallHelper( jitbuf_t *b, const void *fn )
+{
+	JitMovImm64( b, 0, fn );
+	Jit2( b, 0xff, 0xd0 );		// call rax
+}
+
+static void JitJmp( jitbuf_t *b, int target )
+{
+	Jit1( b, 0xe9 );
+	Jit4( b, target - ( b->pos + 4 ) );
+}
+
+static void JitJcc( jitbuf_t *b, int cc, int target )
+{
+	Jit2( b, 0x0f, 0x80 | cc );
+	Jit4( b, target - ( b->pos + 4 ) );
+}
+
+// short forward jump, returns the displacement byte for JitPatch8
+static int JitJcc8( jitbuf_t *b, int cc )
+{
+	Jit2( b, cc < 0 ? 0xeb : 0x70 | cc, 0 );
+	return b->pos - 1;
+}
+
+static void JitPatch8( jitbuf_t *b, int at )
+{
+	if ( b->code )
+		b->code[at] = b->pos - ( at + 1 );
+}
+
+static void JitRunError( jitbuf_t *b, int pc, int error )
+{
+	Jit1( b, 0xbe );	// mov esi, pc
+	Jit4( b, pc );
+	Jit1( b, 0xba );	// mov edx, error
+	Jit4( b, error );
+	JitJmp( b, b->stub_error );
+}
+
+#define CC_B	0x2
+#define CC_AE	0x3
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_BE	0x6
+#define CC_A	0x7
+#define CC_S	0x8
+#define CC_P	0xa
+#define CC_L	0xc
+#define CC_GE	0xd
+#define CC_LE	0xe
+#define CC_G	0xf
+#define CC_JMP	-1
+
+static void JitBudget( jitbuf_t *b, int pc )
+{
+	int skip;
+
+	Jit2( b, 0xff, 0xcd );		// dec ebp
+	skip = JitJcc8( b, CC_NE );
+	JitRunError( b, pc, JITERR_RUNAWAY );
+	JitPatch8( b, skip );
+}
+
+// conditional branch to a constant target, backward branches count
+// against the runaway budget
+static void JitBranch( jitbuf_t *b, int cc, int pc, int target )
+{
+	int skip;
+
+	if ( target > pc )
+	{
+		JitJcc( b, cc, b->instrofs[target] );
+		return;
+	}
+
+	skip = JitJcc8( b, cc ^ 1 );
+	Jit2( b, 0xff, 0xcd );		// dec ebp
+	JitJcc( b, CC_NE, b->instrofs[target] );
+	JitRunError( b, pc, JITERR_RUNAWAY );
+	JitPatch8( b, skip );
+}
+
+// load [ds + eax] into eax
+static void JitLoad( jitbuf_t *b, qvm_t *qvm, int size, int pc )
+{
+	int slow, done;
+
+	Jit1( b, 0x3d );			// cmp eax, len_ds - size
+	Jit4( b, qvm->len_ds - size );
+	slow = JitJcc8( b, CC_A );
+	if ( size == 4 )
+		Jit1( b, 0x41 ), Jit3( b, 0x8b, 0x04, 0x04 );					// mov eax, [r12 + rax]
+	else if ( size == 2 )
+		Jit2( b, 0x41, 0x0f ), Jit3( b, 0xbf, 0x04, 0x04 );			// movsx eax, word [r12 + rax]
+	else
+		Jit2( b, 0x41, 0x0f ), Jit3( b, (char) -1 < 0 ? 0xbe : 0xb6, 0x04, 0x04 );	// movsx/movzx eax, byte [r12 + rax]
+	done = JitJcc8( b, CC_JMP );
+	JitPatch8( b, slow );
+	JitSyncLP( b );
+	JitArgQvm( b );
+	Jit2( b, 0x89, 0xc6 );		// mov esi, eax
+	Jit1( b, 0xba );			// mov edx, size
+	Jit4( b, size );
+	Jit1( b, 0xb9 );			// mov ecx, pc
+	Jit4( b, pc );
+	JitCallHelper( b, (void *) QVM_JitLoad );
+	JitPatch8( b, done );
+}
+
+// store ecx to [ds + eax]
+static void JitStore( jitbuf_t *b, qvm_t *qvm, int size, int pc )
+{
+	int slow, done;
+
+	Jit1( b, 0x3d );			// cmp eax, len_ds - size
+	Jit4( b, qvm->len_ds - size );
+	slow = JitJcc8( b, CC_A );
+	if ( size == 4 )
+		Jit1( b, 0x41 ), Jit3( b, 0x89, 0x0c, 0x04 );					// mov [r12 + rax], ecx
+	else if ( size == 2 )
+		Jit2( b, 0x66, 0x41 ), Jit3( b, 0x89, 0x0c, 0x04 );			// mov [r12 + rax], cx
+	else
+		Jit1( b, 0x41 ), Jit3( b, 0x88, 0x0c, 0x04 );					// mov [r12 + rax], cl
+	done = JitJcc8( b, CC_JMP );
+	JitPatch8( b, slow );
+	JitSyncLP( b );
+	JitArgQvm( b );
+	Jit2( b, 0x89, 0xc6 );		// mov esi, eax
+	Jit2( b, 0x89, 0xca );		// mov edx, ecx
+	Jit1( b, 0xb9 );			// mov ecx, size
+	Jit4( b, size );
+	Jit2( b, 0x41, 0xb8 );		// mov r8d, pc
+	Jit4( b, pc );
+	JitCallHelper( b, (void *) QVM_JitStore );
+	JitPatch8( b, done );
+}
+
+// pop two, op eax, [top]
+static void JitBinaryOp( jitbuf_t *b, qbool twobyte, int op )
+{
+	JitLoadTop( b, 0, -4 );
+	JitOpStack( b, 0, twobyte, op, 0, 0 );
+	JitDecTop( b );
+	JitStoreTop( b, 0, 0 );
+}
+
+static void JitShiftOp( jitbuf_t *b, int modrm )
+{
+	JitLoadTop( b, 0, -4 );
+	JitLoadTop( b, 1, 0 );
+	Jit2( b, 0xd3, modrm );		// shl/sar/shr eax, cl
+	JitDecTop( b );
+	JitStoreTop( b, 0, 0 );
+}
+
+static void JitDivOp( jitbuf_t *b, qbool sign, qbool mod )
+{
+	JitLoadTop( b, 0, -4 );
+	if ( sign )
+		Jit1( b, 0x99 );		// cdq
+	else
+		Jit2( b, 0x31, 0xd2 );	// xor edx, edx
+	JitOpStack( b, 0, false, 0xf7, sign ? 7 : 6, 0 );	// idiv/div dword [top]
+	JitDecTop( b );
+	JitStoreTop( b, mod ? 2 : 0, 0 );
+}
+
+static void JitFloatOp( jitbuf_t *b, int op )
+{
+	JitOpStack( b, 0xf3, true, 0x10, 0, -4 );	// movss xmm0, [top - 1]
+	JitOpStack( b, 0xf3, true, op, 0, 0 );		// op xmm0, [top]
+	JitDecTop( b );
+	JitOpStack( b, 0xf3, true, 0x11, 0, 0 );	// movss [top], xmm0
+}
+
+static void JitCompare( jitbuf_t *b, int cc, int pc, int target )
+{
+	JitLoadTop( b, 0, -4 );
+	JitLoadTop( b, 1, 0 );
+	JitSubTop( b, 2 );
+	Jit2( b, 0x39, 0xc8 );		// cmp eax, ecx
+	JitBranch( b, cc, pc, target );
+}
+
+static void JitCompareFloat( jitbuf_t *b, opcode_t op, int pc, int target )
+{
+	int skip;
+
+	JitOpStack( b, 0xf3, true, 0x10, 0, -4 );	// movss xmm0, [top - 1]
+	JitOpStack( b, 0xf3, true, 0x10, 1, 0 );	// movss xmm1, [top]
+	JitSubTop( b, 2 );
+
+	// unordered compares set ZF, PF and CF, so only NEF may branch on them
+	switch ( op )
+	{
+	case OP_EQF:
+		Jit3( b, 0x0f, 0x2e, 0xc1 );	// ucomiss xmm0, xmm1
+		skip = JitJcc8( b, CC_P );
+		JitBranch( b, CC_E, pc, target );
+		JitPatch8( b, skip );
+		break;
+	case OP_NEF:
+		Jit3( b, 0x0f, 0x2e, 0xc1 );
+		JitBranch( b, CC_P, pc, target );
+		JitBranch( b, CC_NE, pc, target );
+		break;
+	case OP_LTF:
+		Jit3( b, 0x0f, 0x2e, 0xc8 );	// ucomiss xmm1, xmm0
+		JitBranch( b, CC_A, pc, target );
+		break;
+	case OP_LEF:
+		Jit3( b, 0x0f, 0x2e, 0xc8 );
+		JitBranch( b, CC_AE, pc, target );
+		break;
+	case OP_GTF:
+		Jit3( b, 0x0f, 0x2e, 0xc1 );
+		JitBranch( b, CC_A, pc, target );
+		break;
+	default:
+		Jit3( b, 0x0f, 0x2e, 0xc1 );
+		JitBranch( b, CC_AE, pc, target );
+		break;
+	}
+}
+
+static void JitInstruction( jitbuf_t *b, qvm_t *qvm, int pc )
+{
+	qvm_instruction_t op = qvm->cs[pc];
+	int skip, done;
+
+	switch ( op.opcode )
+	{
+	case OP_UNDEF:
+		JitRunError( b, pc, JITERR_UNDEF );
+		break;
+
+	case OP_IGNORE:
+		break;
+
+	case OP_BREAK:
+		JitRunError( b, pc, JITERR_BREAK );
+		break;
+
+	case OP_ENTER:
+		Jit2( b, 0x48, 0x83 ), Jit2( b, 0xec, 0x08 );	// sub rsp, 8
+		Jit3( b, 0x41, 0x81, 0xee );					// sub r14d, size
+		Jit4( b, op.parm._int );
+		Jit3( b, 0x41, 0x81, 0xfe );					// cmp r14d, len_ds - len_ss
+		Jit4( b, qvm->len_ds - qvm->len_ss );
+		skip = JitJcc8( b, CC_GE );
+		JitRunError( b, pc, JITERR_OVERFLOW );
+		JitPatch8( b, skip );
+		Jit3( b, 0x43, 0xc7, 0x44 ), Jit2( b, 0x34, 0x04 );	// mov [r12 + r14 + 4], size
+		Jit4( b, op.parm._int );
+		JitSyncLP( b );									// published for QVM_SampleStack
+		JitSyncPC( b, pc );
+		break;
+
+	case OP_LEAVE:
+		Jit3( b, 0x41, 0x81, 0xc6 );					// add r14d, size
+		Jit4( b, op.parm._int );
+		Jit3( b, 0x41, 0x81, 0xfe );					// cmp r14d, len_ds - 8
+		Jit4( b, qvm->len_ds - 2 * (int) sizeof( int ) );
+		skip = JitJcc8( b, CC_BE );
+		JitRunError( b, pc, JITERR_UNDERFLOW );
+		JitPatch8( b, skip );
+		JitSyncLP( b );
+		Jit3( b, 0x43, 0x8b, 0x04 ), Jit1( b, 0x34 );	// mov eax, [r12 + r14]
+		Jit3( b, 0x41, 0x89, 0x87 );					// mov [r15 + PC], eax
+		Jit4( b, (int)offsetof(qvm_t, PC) );
+		Jit2( b, 0x48, 0x83 ), Jit2( b, 0xc4, 0x08 );	// add rsp, 8
+		Jit1( b, 0xc3 );								// ret
+		break;
+
+	case OP_CALL:
+		JitLoadTop( b, 0, 0 );
+		JitDecTop( b );
+		Jit3( b, 0x43, 0xc7, 0x44 ), Jit2( b, 0x34, 0x00 );	// mov [r12 + r14], pc + 1
+		Jit4( b, pc + 1 );
+		Jit2( b, 0x85, 0xc0 );							// test eax, eax
+		skip = JitJcc8( b, CC_S );
+		Jit1( b, 0x3d );								// cmp eax, len_cs
+		Jit4( b, qvm->len_cs );
+		JitJcc( b, CC_AE, b->stub_badtarget );
+		JitMovImm64( b, 1, qvm->jit_calltable );
+		Jit3( b, 0xff, 0x14, 0xc1 );					// call [rcx + rax * 8]
+		done = JitJcc8( b, CC_JMP );
+		JitPatch8( b, skip );
+		JitSyncLP( b );
+		JitArgQvm( b );
+		Jit2( b, 0x89, 0xc6 );							// mov esi, eax
+		Jit2( b, 0xf7, 0xd6 );							// not esi
+		JitCallHelper( b, (void *) QVM_JitSyscall );
+		JitIncTop( b );
+		JitStoreTop( b, 0, 0 );
+		JitPatch8( b, done );
+		break;
+
+	case OP_PUSH:
+		JitIncTop( b );
+		break;
+
+	case OP_POP:
+		JitDecTop( b );
+		break;
+
+	case OP_CONST:
+		JitIncTop( b );
+		JitOpStack( b, 0, false, 0xc7, 0, 0 );			// mov [top], const
+		Jit4( b, op.parm._int );
+		break;
+
+	case OP_LOCAL:
+		Jit3( b, 0x41, 0x8d, 0x86 );					// lea eax, [r14 + offset]
+		Jit4( b, op.parm._int );
+		JitIncTop( b );
+		JitStoreTop( b, 0, 0 );
+		break;
+
+	case OP_JUMP:
+		JitLoadTop( b, 0, 0 );
+		JitDecTop( b );
+		JitBudget( b, pc );
+		Jit1( b, 0x3d );								// cmp eax, len_cs
+		Jit4( b, qvm->len_cs );
+		JitJcc( b, CC_AE, b->stub_badtarget );
+		JitMovImm64( b, 1, qvm->jit_jumptable );
+		Jit3( b, 0xff, 0x24, 0xc1 );					// jmp [rcx + rax * 8]
+		break;
+
+	case OP_EQ:		JitCompare( b, CC_E, pc, op.parm._int );	break;
+	case OP_NE:		JitCompare( b, CC_NE, pc, op.parm._int );	break;
+	case OP_LTI:	JitCompare( b, CC_L, pc, op.parm._int );	break;
+	case OP_LEI:	JitCompare( b, CC_LE, pc, op.parm._int );	break;
+	case OP_GTI:	JitCompare( b, CC_G, pc, op.parm._int );	break;
+	case OP_GEI:	JitCompare( b, CC_GE, pc, op.parm._int );	break;
+	case OP_LTU:	JitCompare( b, CC_B, pc, op.parm._int );	break;
+	case OP_LEU:	JitCompare( b, CC_BE, pc, op.parm._int );	break;
+	case OP_GTU:	JitCompare( b, CC_A, pc, op.parm._int );	break;
+	case OP_GEU:	JitCompare( b, CC_AE, pc, op.parm._int );	break;
+
+	case OP_EQF:
+	case OP_NEF:
+	case OP_LTF:
+	case OP_LEF:
+	case OP_GTF:
+	case OP_GEF:
+		JitCompareFloat( b, op.opcode, pc, op.parm._int );
+		break;
+
+	case OP_LOAD1:
+	case OP_LOAD2:
+	case OP_LOAD4:
+		JitLoadTop( b, 0, 0 );
+		JitLoad( b, qvm, op.opcode == OP_LOAD1 ? 1 : op.opcode == OP_LOAD2 ? 2 : 4, pc );
+		JitStoreTop( b, 0, 0 );
+		break;
+
+	case OP_STORE1:
+	case OP_STORE2:
+	case OP_STORE4:
+		JitLoadTop( b, 0, -4 );
+		JitLoadTop( b, 1, 0 );
+		JitSubTop( b, 2 );
+		JitStore( b, qvm, op.opcode == OP_STORE1 ? 1 : op.opcode == OP_STORE2 ? 2 : 4, pc );
+		break;
+
+	case OP_ARG:
+		Jit3( b, 0x41, 0x8d, 0x86 );					// lea eax, [r14 + offset]
+		Jit4( b, op.parm._int );
+		JitLoadTop( b, 1, 0 );
+		JitDecTop( b );
+		JitStore( b, qvm, 4, pc );
+		break;
+
+	case OP_BLOCK_COPY:
+		JitLoadTop( b, 6, -4 );							// mov esi, [top - 1]
+		JitLoadTop( b, 2, 0 );							// mov edx, [top]
+		JitSubTop( b, 2 );
+		JitSyncLP( b );
+		JitArgQvm( b );
+		Jit1( b, 0xb9 );								// mov ecx, len
+		Jit4( b, op.parm._int );
+		Jit2( b, 0x41, 0xb8 );							// mov r8d, pc
+		Jit4( b, pc );
+		JitCallHelper( b, (void *) QVM_JitBlockCopy );
+		break;
+
+	case OP_SEX8:
+	case OP_SEX16:
+		JitOpStack( b, 0, true, op.opcode == OP_SEX8 ? 0xbe : 0xbf, 0, 0 );	// movsx eax, [top]
+		JitStoreTop( b, 0, 0 );
+		break;
+
+	case OP_NEGI:	JitOpStack( b, 0, false, 0xf7, 3, 0 );	break;	// neg dword [top]
+	case OP_BCOM:	JitOpStack( b, 0, false, 0xf7, 2, 0 );	break;	// not dword [top]
+	case OP_ADD:	JitBinaryOp( b, false, 0x03 );	break;
+	case OP_SUB:	JitBinaryOp( b, false, 0x2b );	break;
+	case OP_MULI:
+	case OP_MULU:	JitBinaryOp( b, true, 0xaf );	break;
+	case OP_BAND:	JitBinaryOp( b, false, 0x23 );	break;
+	case OP_BOR:	JitBinaryOp( b, false, 0x0b );	break;
+	case OP_BXOR:	JitBinaryOp( b, false, 0x33 );	break;
+	case OP_DIVI:	JitDivOp( b, true, false );		break;
+	case OP_DIVU:	JitDivOp( b, false, false );	break;
+	case OP_MODI:	JitDivOp( b, true, true );		break;
+	case OP_MODU:	JitDivOp( b, false, true );		break;
+	case OP_LSH:	JitShiftOp( b, 0xe0 );			break;
+	case OP_RSHI:	JitShiftOp( b, 0xf8 );			break;
+	case OP_RSHU:	JitShiftOp( b, 0xe8 );			break;
+
+	case OP_NEGF:
+		JitOpStack( b, 0, false, 0x81, 6, 0 );			// xor dword [top], 0x80000000
+		Jit4( b, 0x80000000 );
+		break;
+
+	case OP_ADDF:	JitFloatOp( b, 0x58 );	break;
+	case OP_SUBF:	JitFloatOp( b, 0x5c );	break;
+	case OP_MULF:	JitFloatOp( b, 0x59 );	break;
+	case OP_DIVF:	JitFloatOp( b, 0x5e );	break;
+
+	case OP_CVIF:
+		JitOpStack( b, 0xf3, true, 0x2a, 0, 0 );		// cvtsi2ss xmm0, [top]
+		JitOpStack( b, 0xf3, true, 0x11, 0, 0 );		// movss [top], xmm0
+		break;
+
+	case OP_CVFI:
+		JitOpStack( b, 0xf3, true, 0x2c, 0, 0 );		// cvttss2si eax, [top]
+		JitStoreTop( b, 0, 0 );
+		break;
+
+	default:
+		JitRunError( b, pc, JITERR_OPCODE );
+		break;
+	}
+}
+
+static void JitGenerate( jitbuf_t *b, qvm_t *qvm )
+{
+	int i;
+
+	b->pos = 0;
+
+	// int entry( qvm_t *qvm, qvm_parm_type_t *opstack, int lp )
+	Jit1( b, 0x53 );						// push rbx
+	Jit1( b, 0x55 );						// push rbp
+	Jit2( b, 0x41, 0x54 );					// push r12
+	Jit2( b, 0x41, 0x55 );					// push r13
+	Jit2( b, 0x41, 0x56 );					// push r14
+	Jit2( b, 0x41, 0x57 );					// push r15
+	Jit2( b, 0x48, 0x83 ), Jit2( b, 0xec, 0x08 );	// sub rsp, 8
+	Jit3( b, 0x49, 0x89, 0xff );			// mov r15, rdi
+	Jit3( b, 0x49, 0x89, 0xf5 );			// mov r13, rsi
+	Jit3( b, 0x41, 0x89, 0xd6 );			// mov r14d, edx
+	Jit2( b, 0x49, 0xbc );					// mov r12, ds
+	Jit8( b, qvm->ds );
+	Jit2( b, 0x31, 0xdb );					// xor ebx, ebx
+	Jit1( b, 0xbd );						// mov ebp, MAX_CYCLES
+	Jit4( b, MAX_CYCLES );
+	Jit2( b, 0x31, 0xc0 );					// xor eax, eax
+	JitMovImm64( b, 1, qvm->jit_calltable );
+	Jit2( b, 0xff, 0x11 );					// call [rcx]
+	JitLoadTop( b, 0, 0 );
+	Jit2( b, 0x48, 0x83 ), Jit2( b, 0xc4, 0x08 );	// add rsp, 8
+	Jit2( b, 0x41, 0x5f );					// pop r15
+	Jit2( b, 0x41, 0x5e );					// pop r14
+	Jit2( b, 0x41, 0x5d );					// pop r13
+	Jit2( b, 0x41, 0x5c );					// pop r12
+	Jit1( b, 0x5d );						// pop rbp
+	Jit1( b, 0x5b );						// pop rbx
+	Jit1( b, 0xc3 );						// ret
+
+	for ( i = 0; i < qvm->len_cs; i++ )
+	{
+		b->instrofs[i] = b->pos;
+		JitInstruction( b, qvm, i );
+	}
+
+	// esi = pc, edx = error
+	b->stub_error = b->pos;
+	Jit2( b, 0x48, 0x83 ), Jit2( b, 0xe4, 0xf0 );	// and rsp, -16
+	JitSyncLP( b );
+	JitArgQvm( b );
+	JitCallHelper( b, (void *) QVM_JitError );
+	Jit1( b, 0xcc );						// int3
+
+	// eax = target
+	b->stub_badtarget = b->pos;
+	Jit2( b, 0x89, 0xc6 );					// mov esi, eax
+	Jit1( b, 0xba );						// mov edx, JITERR_BADTARGET
+	Jit4( b, JITERR_BADTARGET );
+	JitJmp( b, b->stub_error );
+}
+
+static void QVM_JitFree( qvm_t * qvm )
+{
+	if ( qvm->jit_code )
+		munmap( qvm->jit_code, qvm->jit_size );
+	Q_free( qvm->jit_calltable );
+	Q_free( qvm->jit_jumptable );
+	qvm->jit_code = NULL;
+	qvm->jit_size = 0;
+	qvm->jit_entry = NULL;
+}
+
+// OP_ENTER is only entered through OP_CALL, which pushed the return address
+static qbool JitFallsThrough( opcode_t op )
+{
+	return op != OP_LEAVE && op != OP_JUMP && op != OP_UNDEF && op != OP_BREAK;
+}
+
+/*
+  QVM_JitCompile
+
+  Two passes over the code, the first one only sizes the output and
+  records instruction offsets. All branches use rel32 displacements so
+  both passes produce identical layouts.
+*/
+static qbool QVM_JitCompile( qvm_t * qvm )
+{
+	jitbuf_t b;
+	int i, target;
+	opcode_t op;
+	byte *code;
+
+	QVM_JitFree( qvm );
+
+	// constant operands are trusted by the generated code, check them once
+	for ( i = 0; i < qvm->len_cs; i++ )
+	{
+		op = qvm->cs[i].opcode;
+		target = qvm->cs[i].parm._int;
+
+		if ( op == OP_ENTER && ( target < 2 * (int) sizeof( int ) || target > qvm->len_ss ) )
+		{
+			Con_Printf( "QVM_JitCompile: bad frame size %d at %8x\n", target, i );
+			return false;
+		}
+
+		// the interpreter copes with running into a procedure, native frames don't
+		if ( ( op == OP_ENTER && i > 0 && JitFallsThrough( qvm->cs[i - 1].opcode ) )
+			|| ( i == qvm->len_cs - 1 && JitFallsThrough( op ) ) )
+		{
+			Con_Printf( "QVM_JitCompile: code falls through at %8x\n", i );
+			return false;
+		}
+
+		if ( op >= OP_EQ && op <= OP_GEF &&
+			( target < 0 || target >= qvm->len_cs || qvm->cs[target].opcode == OP_ENTER ) )
+		{
+			Con_Printf( "QVM_JitCompile: bad branch target %8x at %8x\n", target, i );
+			return false;
+		}
+	}
+
+	memset( &b, 0, sizeof( b ) );
+	b.instrofs = (int *) Q_malloc( qvm->len_cs * sizeof( int ) );
+	qvm->jit_calltable = (void **) Q_malloc( qvm->len_cs * sizeof( void * ) );
+	qvm->jit_jumptable = (void **) Q_malloc( qvm->len_cs * sizeof( void * ) );
+
+	JitGenerate( &b, qvm );
+
+	code = mmap( NULL, b.pos, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0 );
+	if ( code == MAP_FAILED )
+	{
+		Con_Printf( "QVM_JitCompile: couldn't allocate %d bytes\n", b.pos );
+		Q_free( b.instrofs );
+		QVM_JitFree( qvm );
+		return false;
+	}
+
+	qvm->jit_code = code;
+	qvm->jit_size = b.pos;
+	b.code = code;
+	JitGenerate( &b, qvm );
+
+	for ( i = 0; i < qvm->len_cs; i++ )
+	{
+		if ( qvm->cs[i].opcode == OP_ENTER )
+		{
+			qvm->jit_calltable[i] = code + b.instrofs[i];
+			qvm->jit_jumptable[i] = code + b.stub_badtarget;
+		}
+		else
+		{
+			qvm->jit_calltable[i] = code + b.stub_badtarget;
+			qvm->jit_jumptable[i] = code + b.instrofs[i];
+		}
+	}
+	Q_free( b.instrofs );
+
+	if ( mprotect( code, qvm->jit_size, PROT_READ | PROT_EXEC ) )
+	{
+		Con_Printf( "QVM_JitCompile: couldn't make code executable\n" );
+		QVM_JitFree( qvm );
+		return false;
+	}
+
+	qvm->jit_entry = (int (*)(qvm_t *, qvm_parm_type_t *, int)) code;
+	Con_DPrintf( "QVM_JitCompile: %d instructions, %d bytes of code\n", qvm->len_cs, qvm->jit_size );
+	return true;
+}
+#endif /* QVM_JIT */
+
 /*
   QVM Debug stuff
 */
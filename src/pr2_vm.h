@@ -27,6 +27,11 @@
 #define QVM_DATA_PROTECTION
 #define QVM_PROFILE
 
+// translate bytecode to native code at load time, see QVM_JitCompile
+#if defined(__x86_64__) && !defined(_WIN32)
+#define QVM_JIT
+#endif
+
 #ifdef _WIN32
 #define EXPORT_FN __cdecl
 #else
@@ -181,6 +186,16 @@ typedef struct {
 	qvm_parm_type_t	parm;
 } qvm_instruction_t;
 
+// pre-decoded instruction, see QVM_Decode
+typedef struct {
+	const void	*label;		// handler, for computed goto dispatch
+	int			op;			// opcode_t or superinstruction
+	int			parm;		// branch targets are range checked
+	short		sp_lo;		// op stack bounds to the end of the block
+	short		sp_hi;
+	int			blocklen;	// instructions in the block, 0 if not a block entry
+} qvm_op_t;
+
 typedef struct symbols_s
 {
 	int off;
@@ -189,9 +204,10 @@ typedef struct symbols_s
 	char name[1];
 }symbols_t;
 
-typedef struct {
+typedef struct qvm_s {
 	// segments
 	qvm_instruction_t *cs;
+	qvm_op_t *code;		// cs decoded for QVM_ExecDecoded
 	unsigned char *ds;	// DATASEG + LITSEG + BSSSEG
 	unsigned char *ss;	// q3asm add stack at end of BSSSEG, defaultsize = 0x10000
 
@@ -210,6 +226,15 @@ typedef struct {
 	int	reenter;
 	symbols_t* sym_info;
 	sys_callex_t syscall;
+
+#ifdef QVM_JIT
+	// native code, NULL if the bytecode could not be compiled
+	byte	*jit_code;
+	int		jit_size;
+	void	**jit_calltable;	// native address per instruction, OP_ENTER only
+	void	**jit_jumptable;	// native address per instruction, anything but OP_ENTER
+	int		(*jit_entry) (struct qvm_s *qvm, qvm_parm_type_t *opstack, int lp);
+#endif
 } qvm_t;
 
 
@@ -253,6 +278,8 @@ vm_t* VM_Load(vm_t *vm, vm_type_t type, char *name,sys_call_t syscall,sys_callex
 extern intptr_t VM_Call(vm_t *vm, int /*command*/, int /*arg0*/, int , int , int , int , int , 
 				int , int , int , int , int , int /*arg11*/);
 void  QVM_StackTrace( qvm_t * qvm );
+int   QVM_SampleStack( qvm_t * qvm, int *pcs, int max );
+char *QVM_SampleName( qvm_t * qvm, int pc );
 void VM_PrintInfo( vm_t * vm);
 
 #endif /* !__PR2_VM_H__ */
@@ -1222,6 +1222,8 @@ void PR1_LoadProgs (void)
 	for (i = 0; i < progs->numglobals; i++)
 		((int *)pr_globals)[i] = LittleLong (((int *)pr_globals)[i]);
 
+	PR_LinkStatements();
+
 	PR_InitBuiltins();
 }
 
@@ -1247,6 +1249,7 @@ void PR1_Init (void)
 	Cmd_AddCommand ("edicts", ED_PrintEdicts);
 	Cmd_AddCommand ("edictcount", ED_Count);
 	Cmd_AddCommand ("profile", PR_Profile_f);
+	Cmd_AddCommand ("pr_compare", PR_Compare_f);
 
 	memset(pr_newstrtbl, 0, sizeof(pr_newstrtbl));
 }
@@ -40,6 +40,7 @@ int			localstack_used;
 qbool		pr_trace;
 dfunction_t	*pr_xfunction;
 int			pr_xstatement;
+volatile int	pr_xbuiltin;	// builtin being executed, 0 if none
 
 
 int			pr_argc;
@@ -135,6 +136,7 @@ char *pr_opnames[] =
 
 char *PR_GlobalString (int ofs);
 char *PR_GlobalStringNoContents (int ofs);
+static void PR_CompareFree (void);
 
 
 //=============================================================================
@@ -210,6 +212,35 @@ void PR_StackTrace (void)
 }
 
 
+/*
+============
+PR_SampleStack
+
+Called by the sampling profiler from its own thread while progs may be
+running, fills funcs with function numbers, innermost first
+============
+*/
+int PR_SampleStack (int *funcs, int max)
+{
+	dfunction_t *f;
+	int i, n, depth;
+
+	depth = pr_depth;
+	if (!progs || depth <= 0 || depth >= MAX_STACK_DEPTH)
+		return 0;
+
+	// pr_stack[0] holds whatever was running before the outermost call
+	f = pr_xfunction;
+	for (i = depth, n = 0; i > 0 && n < max; f = pr_stack[--i].f)
+	{
+		if (f < pr_functions || f >= pr_functions + progs->numfunctions)
+			break;
+		funcs[n++] = f - pr_functions;
+	}
+
+	return n;
+}
+
 /*
 ============
 PR_Profile_f
@@ -276,6 +307,8 @@ void PR_RunError (char *error, ...)
 	Con_Printf ("%s\n", string);
 
 	pr_depth = 0; // dump the stack so SV_Error can shutdown functions
+	pr_xbuiltin = 0; // and the builtin we failed in, for the profiler
+	PR_CompareFree ();
 
 	SV_Error ("Program error");
 }
@@ -350,40 +383,21 @@ int PR_LeaveFunction (void)
 
 /*
 ============================================================================
-PR_ExecuteProgram
+PR_ExecuteStatements
 
-The interpretation main loop
+The interpretation main loop, runs from the statement after s until the
+function entered at exitdepth returns
 ============================================================================
 */
-void PR_ExecuteProgram (func_t fnum)
+static void PR_ExecuteStatements (int s, int runaway, int exitdepth)
 {
 	eval_t *a = NULL, *b = NULL, *c = NULL;
-	int s;
 	dstatement_t *st = NULL;
-	dfunction_t *f, *newf;
-	int runaway;
-	int i;
+	dfunction_t *newf;
+	int i, oldbuiltin;
 	edict_t *ed;
-	int exitdepth;
 	eval_t *ptr;
 
-	if (!fnum || fnum >= progs->numfunctions)
-	{
-		if (pr_global_struct->self)
-			ED_Print (PROG_TO_EDICT(pr_global_struct->self));
-		SV_Error ("PR_ExecuteProgram: NULL function");
-	}
-
-	f = &pr_functions[fnum];
-
-	runaway = 100000;
-	pr_trace = false;
-
-	// make a stack frame
-	exitdepth = pr_depth;
-
-	s = PR_EnterFunction (f);
-
 	while (1)
 	{
 		s++; // next statement
@@ -631,7 +645,10 @@ void PR_ExecuteProgram (func_t fnum)
 				i = -newf->first_statement;
 				if (i >= pr_numbuiltins)
 					PR_RunError ("Bad builtin call number");
+				oldbuiltin = pr_xbuiltin;
+				pr_xbuiltin = i;
 				pr_builtins[i] ();
+				pr_xbuiltin = oldbuiltin;
 				break;
 			}
 
@@ -664,7 +681,783 @@ void PR_ExecuteProgram (func_t fnum)
 			PR_RunError ("Bad opcode %i", st->op);
 		}
 	}
+}
+
+/*
+============================================================================
+Linked statements
+
+PR_LinkStatements resolves the operands of every statement to global
+pointers and turns branch offsets into range checked deltas once, when
+the progs are loaded. Statements are grouped into blocks that end at a
+branch, call or return, so the runaway counter and profile are updated
+once per block instead of once per statement. Whenever that could
+change what happens (the runaway counter about to expire, tracing
+switched on by a builtin) execution continues in PR_ExecuteStatements,
+a statement early so the runaway error reports the same statement.
+============================================================================
+*/
+
+typedef struct prlinked_s
+{
+	const void	*label;		// handler, for computed goto dispatch
+	eval_t		*a, *b, *c;
+	int			op;
+	int			jump;		// branch delta, or argument count for calls
+	int			blocklen;	// statements to the end of the block, 0 if not a block entry
+} prlinked_t;
+
+// pseudo opcodes, only seen by the linked executor
+#define OP_BADSTATEMENT	(OP_BITOR + 1)	// past the last statement, catches bad branches
+#define OP_BADOPCODE	(OP_BITOR + 2)
+#define OP_BLOCK		(OP_BITOR + 3)	// block entry, accounts for the whole block
+#define PR_NUMOPS		(OP_BITOR + 4)
+
+#if defined(__GNUC__)
+#define PR_COMPUTED_GOTO
+#endif
+
+#ifdef PR_COMPUTED_GOTO
+#define PR_CASE(x)		op_##x:
+#define PR_DISPATCH()	goto *ip->label
+#else
+#define PR_CASE(x)		case x:
+#define PR_DISPATCH()	continue
+#endif
+#define PR_NEXT()		{ ip++; PR_DISPATCH(); }
+
+static prlinked_t	*pr_linked;
+static int			pr_numlinked;
+#ifdef PR_COMPUTED_GOTO
+static const void	**pr_labels;
+#endif
+
+// returns when the function entered at s + 1 returns to exitdepth
+static void PR_ExecuteLinked (int s, int runaway, int exitdepth)
+{
+#ifdef PR_COMPUTED_GOTO
+	static const void *labels[PR_NUMOPS] = {
+		[OP_DONE] = &&op_OP_DONE,
+		[OP_MUL_F] = &&op_OP_MUL_F, [OP_MUL_V] = &&op_OP_MUL_V, [OP_MUL_FV] = &&op_OP_MUL_FV, [OP_MUL_VF] = &&op_OP_MUL_VF,
+		[OP_DIV_F] = &&op_OP_DIV_F,
+		[OP_ADD_F] = &&op_OP_ADD_F, [OP_ADD_V] = &&op_OP_ADD_V,
+		[OP_SUB_F] = &&op_OP_SUB_F, [OP_SUB_V] = &&op_OP_SUB_V,
+		[OP_EQ_F] = &&op_OP_EQ_F, [OP_EQ_V] = &&op_OP_EQ_V, [OP_EQ_S] = &&op_OP_EQ_S, [OP_EQ_E] = &&op_OP_EQ_E, [OP_EQ_FNC] = &&op_OP_EQ_FNC,
+		[OP_NE_F] = &&op_OP_NE_F, [OP_NE_V] = &&op_OP_NE_V, [OP_NE_S] = &&op_OP_NE_S, [OP_NE_E] = &&op_OP_NE_E, [OP_NE_FNC] = &&op_OP_NE_FNC,
+		[OP_LE] = &&op_OP_LE, [OP_GE] = &&op_OP_GE, [OP_LT] = &&op_OP_LT, [OP_GT] = &&op_OP_GT,
+		[OP_LOAD_F] = &&op_OP_LOAD_F, [OP_LOAD_V] = &&op_OP_LOAD_V, [OP_LOAD_S] = &&op_OP_LOAD_F,
+		[OP_LOAD_ENT] = &&op_OP_LOAD_F, [OP_LOAD_FLD] = &&op_OP_LOAD_F, [OP_LOAD_FNC] = &&op_OP_LOAD_F,
+		[OP_ADDRESS] = &&op_OP_ADDRESS,
+		[OP_STORE_F] = &&op_OP_STORE_F, [OP_STORE_V] = &&op_OP_STORE_V, [OP_STORE_S] = &&op_OP_STORE_F,
+		[OP_STORE_ENT] = &&op_OP_STORE_F, [OP_STORE_FLD] = &&op_OP_STORE_F, [OP_STORE_FNC] = &&op_OP_STORE_F,
+		[OP_STOREP_F] = &&op_OP_STOREP_F, [OP_STOREP_V] = &&op_OP_STOREP_V, [OP_STOREP_S] = &&op_OP_STOREP_F,
+		[OP_STOREP_ENT] = &&op_OP_STOREP_F, [OP_STOREP_FLD] = &&op_OP_STOREP_F, [OP_STOREP_FNC] = &&op_OP_STOREP_F,
+		[OP_RETURN] = &&op_OP_DONE,
+		[OP_NOT_F] = &&op_OP_NOT_F, [OP_NOT_V] = &&op_OP_NOT_V, [OP_NOT_S] = &&op_OP_NOT_S, [OP_NOT_ENT] = &&op_OP_NOT_ENT, [OP_NOT_FNC] = &&op_OP_NOT_FNC,
+		[OP_IF] = &&op_OP_IF, [OP_IFNOT] = &&op_OP_IFNOT,
+		[OP_CALL0] = &&op_OP_CALL0, [OP_CALL1] = &&op_OP_CALL0, [OP_CALL2] = &&op_OP_CALL0,
+		[OP_CALL3] = &&op_OP_CALL0, [OP_CALL4] = &&op_OP_CALL0, [OP_CALL5] = &&op_OP_CALL0,
+		[OP_CALL6] = &&op_OP_CALL0, [OP_CALL7] = &&op_OP_CALL0, [OP_CALL8] = &&op_OP_CALL0,
+		[OP_STATE] = &&op_OP_STATE, [OP_GOTO] = &&op_OP_GOTO,
+		[OP_AND] = &&op_OP_AND, [OP_OR] = &&op_OP_OR, [OP_BITAND] = &&op_OP_BITAND, [OP_BITOR] = &&op_OP_BITOR,
+		[OP_BADSTATEMENT] = &&op_OP_BADSTATEMENT, [OP_BADOPCODE] = &&op_OP_BADOPCODE, [OP_BLOCK] = &&op_OP_BLOCK
+	};
+#endif
+	prlinked_t *ip;
+	eval_t *a, *b, *c, *ptr;
+	dfunction_t *newf;
+	edict_t *ed;
+	int i, oldbuiltin;
+
+#ifdef PR_COMPUTED_GOTO
+	if (!pr_linked)
+	{
+		pr_labels = labels;
+		return;
+	}
+#endif
+
+	ip = pr_linked + s + 1;
+
+#ifdef PR_COMPUTED_GOTO
+	PR_DISPATCH();
+
+op_OP_BLOCK:
+	if (runaway <= ip->blocklen + 1)
+	{
+		PR_ExecuteStatements (ip - pr_linked - 1, runaway, exitdepth);
+		return;
+	}
+	runaway -= ip->blocklen;
+	pr_xfunction->profile += ip->blocklen;
+	goto *labels[ip->op];
+#else
+	for ( ; ; )
+	{
+		if (ip->blocklen)
+		{
+			if (runaway <= ip->blocklen + 1)
+			{
+				PR_ExecuteStatements (ip - pr_linked - 1, runaway, exitdepth);
+				return;
+			}
+			runaway -= ip->blocklen;
+			pr_xfunction->profile += ip->blocklen;
+		}
+
+		switch (ip->op)
+		{
+#endif
+		PR_CASE(OP_ADD_F)
+			ip->c->_float = ip->a->_float + ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_ADD_V)
+			a = ip->a; b = ip->b; c = ip->c;
+			c->vector[0] = a->vector[0] + b->vector[0];
+			c->vector[1] = a->vector[1] + b->vector[1];
+			c->vector[2] = a->vector[2] + b->vector[2];
+			PR_NEXT();
+
+		PR_CASE(OP_SUB_F)
+			ip->c->_float = ip->a->_float - ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_SUB_V)
+			a = ip->a; b = ip->b; c = ip->c;
+			c->vector[0] = a->vector[0] - b->vector[0];
+			c->vector[1] = a->vector[1] - b->vector[1];
+			c->vector[2] = a->vector[2] - b->vector[2];
+			PR_NEXT();
+
+		PR_CASE(OP_MUL_F)
+			ip->c->_float = ip->a->_float * ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_MUL_V)
+			a = ip->a; b = ip->b;
+			ip->c->_float = a->vector[0]*b->vector[0]
+			            + a->vector[1]*b->vector[1]
+			            + a->vector[2]*b->vector[2];
+			PR_NEXT();
+		PR_CASE(OP_MUL_FV)
+			a = ip->a; b = ip->b; c = ip->c;
+			c->vector[0] = a->_float * b->vector[0];
+			c->vector[1] = a->_float * b->vector[1];
+			c->vector[2] = a->_float * b->vector[2];
+			PR_NEXT();
+		PR_CASE(OP_MUL_VF)
+			a = ip->a; b = ip->b; c = ip->c;
+			c->vector[0] = b->_float * a->vector[0];
+			c->vector[1] = b->_float * a->vector[1];
+			c->vector[2] = b->_float * a->vector[2];
+			PR_NEXT();
+
+		PR_CASE(OP_DIV_F)
+			ip->c->_float = ip->a->_float / ip->b->_float;
+			PR_NEXT();
+
+		PR_CASE(OP_BITAND)
+			ip->c->_float = (int)ip->a->_float & (int)ip->b->_float;
+			PR_NEXT();
+
+		PR_CASE(OP_BITOR)
+			ip->c->_float = (int)ip->a->_float | (int)ip->b->_float;
+			PR_NEXT();
+
+		PR_CASE(OP_GE)
+			ip->c->_float = ip->a->_float >= ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_LE)
+			ip->c->_float = ip->a->_float <= ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_GT)
+			ip->c->_float = ip->a->_float > ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_LT)
+			ip->c->_float = ip->a->_float < ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_AND)
+			ip->c->_float = ip->a->_float && ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_OR)
+			ip->c->_float = ip->a->_float || ip->b->_float;
+			PR_NEXT();
+
+		PR_CASE(OP_NOT_F)
+			ip->c->_float = !ip->a->_float;
+			PR_NEXT();
+		PR_CASE(OP_NOT_V)
+			a = ip->a;
+			ip->c->_float = !a->vector[0] && !a->vector[1] && !a->vector[2];
+			PR_NEXT();
+		PR_CASE(OP_NOT_S)
+			pr_xstatement = ip - pr_linked;
+			ip->c->_float = !ip->a->string || !*PR1_GetString(ip->a->string);
+			PR_NEXT();
+		PR_CASE(OP_NOT_FNC)
+			ip->c->_float = !ip->a->function;
+			PR_NEXT();
+		PR_CASE(OP_NOT_ENT)
+			ip->c->_float = (PROG_TO_EDICT(ip->a->edict) == sv.edicts);
+			PR_NEXT();
+
+		PR_CASE(OP_EQ_F)
+			ip->c->_float = ip->a->_float == ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_EQ_V)
+			a = ip->a; b = ip->b;
+			ip->c->_float = (a->vector[0] == b->vector[0]) &&
+			            (a->vector[1] == b->vector[1]) &&
+			            (a->vector[2] == b->vector[2]);
+			PR_NEXT();
+		PR_CASE(OP_EQ_S)
+			pr_xstatement = ip - pr_linked;
+			ip->c->_float = !strcmp(PR1_GetString(ip->a->string), PR1_GetString(ip->b->string));
+			PR_NEXT();
+		PR_CASE(OP_EQ_E)
+			ip->c->_float = ip->a->_int == ip->b->_int;
+			PR_NEXT();
+		PR_CASE(OP_EQ_FNC)
+			ip->c->_float = ip->a->function == ip->b->function;
+			PR_NEXT();
+
+		PR_CASE(OP_NE_F)
+			ip->c->_float = ip->a->_float != ip->b->_float;
+			PR_NEXT();
+		PR_CASE(OP_NE_V)
+			a = ip->a; b = ip->b;
+			ip->c->_float = (a->vector[0] != b->vector[0]) ||
+			            (a->vector[1] != b->vector[1]) ||
+			            (a->vector[2] != b->vector[2]);
+			PR_NEXT();
+		PR_CASE(OP_NE_S)
+			pr_xstatement = ip - pr_linked;
+			ip->c->_float = strcmp(PR1_GetString(ip->a->string), PR1_GetString(ip->b->string));
+			PR_NEXT();
+		PR_CASE(OP_NE_E)
+			ip->c->_float = ip->a->_int != ip->b->_int;
+			PR_NEXT();
+		PR_CASE(OP_NE_FNC)
+			ip->c->_float = ip->a->function != ip->b->function;
+			PR_NEXT();
+
+			//==================
+#ifndef PR_COMPUTED_GOTO
+		case OP_STORE_ENT:
+		case OP_STORE_FLD:
+		case OP_STORE_S:
+		case OP_STORE_FNC:
+#endif
+		PR_CASE(OP_STORE_F)
+			ip->b->_int = ip->a->_int;
+			PR_NEXT();
+		PR_CASE(OP_STORE_V)
+			a = ip->a; b = ip->b;
+			b->vector[0] = a->vector[0];
+			b->vector[1] = a->vector[1];
+			b->vector[2] = a->vector[2];
+			PR_NEXT();
+
+#ifndef PR_COMPUTED_GOTO
+		case OP_STOREP_ENT:
+		case OP_STOREP_FLD:
+		case OP_STOREP_S:
+		case OP_STOREP_FNC:
+#endif
+		PR_CASE(OP_STOREP_F)
+			ptr = (eval_t *)((byte *)sv.edicts + ip->b->_int);
+			ptr->_int = ip->a->_int;
+			PR_NEXT();
+		PR_CASE(OP_STOREP_V)
+			a = ip->a;
+			ptr = (eval_t *)((byte *)sv.edicts + ip->b->_int);
+			ptr->vector[0] = a->vector[0];
+			ptr->vector[1] = a->vector[1];
+			ptr->vector[2] = a->vector[2];
+			PR_NEXT();
+
+		PR_CASE(OP_ADDRESS)
+			ed = PROG_TO_EDICT(ip->a->edict);
+#ifdef PARANOID
+			NUM_FOR_EDICT(ed);		// make sure it's in range
+#endif
+			if (ed == (edict_t *)sv.edicts && sv.state == ss_active)
+			{
+				pr_xstatement = ip - pr_linked;
+				PR_RunError ("assignment to world entity");
+			}
+			ip->c->_int = (byte *)((int *)&ed->v + PR_FIELDOFS(ip->b->_int)) - (byte *)sv.edicts;
+			PR_NEXT();
+
+#ifndef PR_COMPUTED_GOTO
+		case OP_LOAD_FLD:
+		case OP_LOAD_ENT:
+		case OP_LOAD_S:
+		case OP_LOAD_FNC:
+#endif
+		PR_CASE(OP_LOAD_F)
+			ed = PROG_TO_EDICT(ip->a->edict);
+#ifdef PARANOID
+			NUM_FOR_EDICT(ed);		// make sure it's in range
+#endif
+			//need for checking 'cmd mmode player N', if N >= 0x10000000 =(signed)=> negative
+			if (ip->b->_int >= 0)
+			{
+				a = (eval_t *)((int *)&ed->v + PR_FIELDOFS(ip->b->_int));
+				ip->c->_int = a->_int;
+			}
+			else
+				ip->c->_int = 0;
+			PR_NEXT();
+
+		PR_CASE(OP_LOAD_V)
+			ed = PROG_TO_EDICT(ip->a->edict);
+#ifdef PARANOID
+			NUM_FOR_EDICT(ed);		// make sure it's in range
+#endif
+			a = (eval_t *)((int *)&ed->v + PR_FIELDOFS(ip->b->_int));
+			c = ip->c;
+			c->vector[0] = a->vector[0];
+			c->vector[1] = a->vector[1];
+			c->vector[2] = a->vector[2];
+			PR_NEXT();
+
+			//==================
+
+		PR_CASE(OP_IFNOT)
+			if (!ip->a->_int)
+			{
+				ip += ip->jump;
+				PR_DISPATCH();
+			}
+			PR_NEXT();
+
+		PR_CASE(OP_IF)
+			if (ip->a->_int)
+			{
+				ip += ip->jump;
+				PR_DISPATCH();
+			}
+			PR_NEXT();
+
+		PR_CASE(OP_GOTO)
+			ip += ip->jump;
+			PR_DISPATCH();
+
+#ifndef PR_COMPUTED_GOTO
+		case OP_CALL1:
+		case OP_CALL2:
+		case OP_CALL3:
+		case OP_CALL4:
+		case OP_CALL5:
+		case OP_CALL6:
+		case OP_CALL7:
+		case OP_CALL8:
+#endif
+		PR_CASE(OP_CALL0)
+			pr_xstatement = ip - pr_linked;
+			pr_argc = ip->jump;
+			if (!ip->a->function)
+				PR_RunError ("NULL function");
+
+			newf = &pr_functions[ip->a->function];
+
+			if (newf->first_statement < 0)
+			{	// negative statements are built in functions
+				i = -newf->first_statement;
+				if (i >= pr_numbuiltins)
+					PR_RunError ("Bad builtin call number");
+				oldbuiltin = pr_xbuiltin;
+				pr_xbuiltin = i;
+				pr_builtins[i] ();
+				pr_xbuiltin = oldbuiltin;
+				if (pr_trace)
+				{
+					PR_ExecuteStatements (ip - pr_linked, runaway, exitdepth);
+					return;
+				}
+				PR_NEXT();
+			}
+
+			ip = pr_linked + PR_EnterFunction (newf) + 1;
+			PR_DISPATCH();
+
+#ifndef PR_COMPUTED_GOTO
+		case OP_RETURN:
+#endif
+		PR_CASE(OP_DONE)
+			pr_xstatement = ip - pr_linked;
+			a = ip->a;
+			pr_globals[OFS_RETURN] = ((float *)a)[0];
+			pr_globals[OFS_RETURN+1] = ((float *)a)[1];
+			pr_globals[OFS_RETURN+2] = ((float *)a)[2];
+
+			s = PR_LeaveFunction ();
+			if (pr_depth == exitdepth)
+				return;		// all done
+			ip = pr_linked + s + 1;
+			PR_DISPATCH();
+
+		PR_CASE(OP_STATE)
+			ed = PROG_TO_EDICT(pr_global_struct->self);
+			ed->v.nextthink = pr_global_struct->time + 0.1;
+			if (ip->a->_float != ed->v.frame)
+			{
+				ed->v.frame = ip->a->_float;
+			}
+			ed->v.think = ip->b->function;
+			PR_NEXT();
+
+		PR_CASE(OP_BADSTATEMENT)
+			PR_RunError ("Bad statement %i", (int)(ip - pr_linked));
+
+#ifndef PR_COMPUTED_GOTO
+		default:
+#endif
+		PR_CASE(OP_BADOPCODE)
+			pr_xstatement = ip - pr_linked;
+			PR_RunError ("Bad opcode %i", pr_statements[pr_xstatement].op);
+#ifndef PR_COMPUTED_GOTO
+		}
+	}
+#endif
+}
+
+/*
+====================
+PR_LinkStatements
+
+Called after the progs are loaded and byte swapped
+====================
+*/
+void PR_LinkStatements (void)
+{
+	dstatement_t *st;
+	prlinked_t *l;
+	byte *leader;
+	int i, op, target, len;
+
+	pr_numlinked = progs->numstatements;
+	pr_linked = (prlinked_t *) Hunk_AllocName ((pr_numlinked + 1) * sizeof(prlinked_t), "prlinked");
+	leader = (byte *) Q_malloc (pr_numlinked + 1);
+
+	for (i = 0; i < progs->numfunctions; i++)
+	{
+		if (pr_functions[i].first_statement >= 0 && pr_functions[i].first_statement < pr_numlinked)
+			leader[pr_functions[i].first_statement] = 1;
+	}
+
+	for (i = 0, st = pr_statements, l = pr_linked; i < pr_numlinked; i++, st++, l++)
+	{
+		op = st->op;
+		l->op = op;
+		l->a = (eval_t *)&pr_globals[st->a];
+		l->b = (eval_t *)&pr_globals[st->b];
+		l->c = (eval_t *)&pr_globals[st->c];
+
+		if (op == OP_IF || op == OP_IFNOT || op == OP_GOTO)
+		{
+			target = i + (op == OP_GOTO ? st->a : st->b);
+			if (target < 0 || target >= pr_numlinked)
+				target = pr_numlinked;
+			leader[target] = 1;
+			leader[i + 1] = 1;
+			l->jump = target - i;
+		}
+		else if (op >= OP_CALL0 && op <= OP_CALL8)
+		{
+			leader[i + 1] = 1;
+			l->jump = op - OP_CALL0;
+		}
+		else if (op == OP_DONE || op == OP_RETURN)
+			leader[i + 1] = 1;
+		else if (op > OP_BITOR)
+			l->op = OP_BADOPCODE;
+	}
+	pr_linked[pr_numlinked].op = OP_BADSTATEMENT;
+
+	// block lengths, back to front
+	len = 0;
+	for (i = pr_numlinked - 1; i >= 0; i--)
+	{
+		len = leader[i + 1] ? 1 : len + 1;
+		pr_linked[i].blocklen = leader[i] ? len : 0;
+	}
+
+#ifdef PR_COMPUTED_GOTO
+	{
+		prlinked_t *save = pr_linked;
+
+		pr_linked = NULL;
+		PR_ExecuteLinked (0, 0, 0);
+		pr_linked = save;
+	}
+	for (i = 0; i <= pr_numlinked; i++)
+	{
+		l = &pr_linked[i];
+		l->label = pr_labels[l->blocklen ? OP_BLOCK : l->op];
+	}
+#endif
+
+	Q_free (leader);
+}
+
+/*
+====================
+PR_ExecuteProgram
+====================
+*/
+void PR_ExecuteProgram (func_t fnum)
+{
+	dfunction_t *f;
+	int exitdepth;
+	int s;
+
+	if (!fnum || fnum >= progs->numfunctions)
+	{
+		if (pr_global_struct->self)
+			ED_Print (PROG_TO_EDICT(pr_global_struct->self));
+		SV_Error ("PR_ExecuteProgram: NULL function");
+	}
+
+	f = &pr_functions[fnum];
+
+	pr_trace = false;
+
+	// make a stack frame
+	exitdepth = pr_depth;
+
+	s = PR_EnterFunction (f);
+
+	if (pr_linked)
+		PR_ExecuteLinked (s, 100000, exitdepth);
+	else
+		PR_ExecuteStatements (s, 100000, exitdepth);
+}
+
+/*
+====================
+PR_Compare_f
+
+Developer check for the linked executor.  "pr_compare <function>" runs a
+function once through PR_ExecuteLinked and once through
+PR_ExecuteStatements, both from the same globals, edicts and random seed,
+and reports where the results differ.  Without a function it does the
+same for StartFrame and for every entity with a think pending, which
+makes a map plus "pr_compare" a replay check over that map's entities.
+The server is put back as it was afterwards, but builtins run twice, so
+anything they do outside the progs state (prints, sounds, network
+messages) happens twice as well.
+====================
+*/
+typedef struct
+{
+	float		*globals;
+	byte		*edicts;
+	sv_edict_t	*sv_edicts;
+	int			num_edicts;
+	float		*result_globals;
+	byte		*result_edicts;
+	int			result_num_edicts;
+} prcompare_t;
+
+static prcompare_t pr_compare;
+
+// also called from PR_RunError, the compared function may not come back
+static void PR_CompareFree (void)
+{
+	Q_free (pr_compare.globals);
+	Q_free (pr_compare.edicts);
+	Q_free (pr_compare.sv_edicts);
+	Q_free (pr_compare.result_globals);
+	Q_free (pr_compare.result_edicts);
+}
+
+static void PR_CompareSave (void)
+{
+	memcpy (pr_compare.globals, pr_globals, progs->numglobals * 4);
+	memcpy (pr_compare.edicts, sv.edicts, sv.max_edicts * pr_edict_size);
+	memcpy (pr_compare.sv_edicts, sv.sv_edicts, sv.max_edicts * sizeof (sv_edict_t));
+	pr_compare.num_edicts = sv.num_edicts;
+}
+
+static void PR_CompareRestore (void)
+{
+	edict_t *ent;
+	int i;
+
+	// take everything out of the world first, the saved area links point
+	// into lists that have changed since
+	for (i = 1; i < sv.max_edicts; i++)
+		SV_UnlinkEdict (EDICT_NUM (i));
+
+	memcpy (pr_globals, pr_compare.globals, progs->numglobals * 4);
+	memcpy (sv.edicts, pr_compare.edicts, sv.max_edicts * pr_edict_size);
+	memcpy (sv.sv_edicts, pr_compare.sv_edicts, sv.max_edicts * sizeof (sv_edict_t));
+	sv.num_edicts = pr_compare.num_edicts;
+
+	for (i = 1; i < sv.max_edicts; i++)
+	{
+		ent = EDICT_NUM (i);
+		ent->e->area.prev = ent->e->area.next = NULL;
+		ent->e->areabounds = NULL;
+		if (pr_compare.sv_edicts[i].area.prev)
+			SV_LinkEdict (ent, false);
+	}
+}
+
+static void PR_CompareRun (dfunction_t *f, edict_t *self, unsigned int seed, qbool linked)
+{
+	int exitdepth;
+	int s;
+
+	PR_CompareRestore ();
+	srand (seed);
+
+	// set up the way SV_RunThink does, StartFrame runs with world as self
+	if (self)
+	{
+		if (self != sv.edicts)
+			self->v.nextthink = 0;
+		pr_global_struct->time = sv.time;
+		pr_global_struct->self = EDICT_TO_PROG(self);
+		pr_global_struct->other = EDICT_TO_PROG(sv.edicts);
+	}
+
+	pr_trace = false;
+	exitdepth = pr_depth;
+	s = PR_EnterFunction (f);
+
+	if (linked)
+		PR_ExecuteLinked (s, 100000, exitdepth);
+	else
+		PR_ExecuteStatements (s, 100000, exitdepth);
+}
+
+// returns the number of differences, prints the first few
+static int PR_CompareFunction (dfunction_t *f, edict_t *self)
+{
+	unsigned int seed = rand ();
+	char *name = PR1_GetString (f->s_name);
+	int i, j, diffs;
+	int *a, *b;
+
+	PR_CompareRun (f, self, seed, true);
+
+	memcpy (pr_compare.result_globals, pr_globals, progs->numglobals * 4);
+	memcpy (pr_compare.result_edicts, sv.edicts, sv.max_edicts * pr_edict_size);
+	pr_compare.result_num_edicts = sv.num_edicts;
+
+	PR_CompareRun (f, self, seed, false);
+
+	diffs = 0;
+
+	if (pr_compare.result_num_edicts != sv.num_edicts)
+	{
+		Con_Printf ("%s: num_edicts: linked %i, statements %i\n", name, pr_compare.result_num_edicts, sv.num_edicts);
+		diffs++;
+	}
+
+	a = (int *) pr_compare.result_globals;
+	b = (int *) pr_globals;
+	for (i = 0; i < progs->numglobals; i++)
+	{
+		if (a[i] == b[i])
+			continue;
+		if (diffs++ < 20)
+			Con_Printf ("%s: global %i: linked %08x, statements %08x\n", name, i, a[i], b[i]);
+	}
+
+	for (i = 0; i < max (pr_compare.result_num_edicts, sv.num_edicts); i++)
+	{
+		a = (int *) &((edict_t *)(pr_compare.result_edicts + i * pr_edict_size))->v;
+		b = (int *) &EDICT_NUM (i)->v;
+		for (j = 0; j < progs->entityfields; j++)
+		{
+			if (a[j] == b[j])
+				continue;
+			if (diffs++ < 20)
+				Con_Printf ("%s: edict %i field %i: linked %08x, statements %08x\n", name, i, j, a[j], b[j]);
+		}
+	}
+
+	return diffs;
+}
+
+void PR_Compare_f (void)
+{
+	dfunction_t *f;
+	edict_t *ent;
+	int i, funcs, diffs;
+
+	if (Cmd_Argc () > 2)
+	{
+		Con_Printf ("usage: pr_compare [function]\n");
+		return;
+	}
+
+#ifdef USE_PR2
+	if (sv_vm)
+	{
+		Con_Printf ("pr_compare: not running QC progs\n");
+		return;
+	}
+#endif
+
+	if (sv.state != ss_active || !progs || !pr_linked)
+	{
+		Con_Printf ("pr_compare: progs are not loaded\n");
+		return;
+	}
+
+	f = NULL;
+	if (Cmd_Argc () == 2 && (!(f = ED_FindFunction (Cmd_Argv (1))) || f->first_statement < 0))
+	{
+		Con_Printf ("pr_compare: no QC function %s\n", Cmd_Argv (1));
+		return;
+	}
+
+	PR_CompareFree ();
+	pr_compare.globals = (float *) Q_malloc (progs->numglobals * 4);
+	pr_compare.result_globals = (float *) Q_malloc (progs->numglobals * 4);
+	pr_compare.edicts = (byte *) Q_malloc (sv.max_edicts * pr_edict_size);
+	pr_compare.result_edicts = (byte *) Q_malloc (sv.max_edicts * pr_edict_size);
+	pr_compare.sv_edicts = (sv_edict_t *) Q_malloc (sv.max_edicts * sizeof (sv_edict_t));
+
+	PR_CompareSave ();
+
+	funcs = diffs = 0;
+	if (f)
+	{
+		diffs += PR_CompareFunction (f, NULL);
+		funcs++;
+	}
+	else
+	{
+		i = PR_GLOBAL(StartFrame);
+		if (i > 0 && i < progs->numfunctions && pr_functions[i].first_statement >= 0)
+		{
+			diffs += PR_CompareFunction (&pr_functions[i], sv.edicts);
+			funcs++;
+		}
+
+		for (i = 1; i < pr_compare.num_edicts; i++)
+		{
+			if (pr_compare.sv_edicts[i].free)
+				continue;
+			ent = (edict_t *)(pr_compare.edicts + i * pr_edict_size);
+			if (ent->v.nextthink <= 0 || ent->v.think <= 0 || ent->v.think >= progs->numfunctions
+				|| pr_functions[ent->v.think].first_statement < 0)
+				continue;
+			diffs += PR_CompareFunction (&pr_functions[ent->v.think], EDICT_NUM (i));
+			funcs++;
+		}
+	}
+
+	// leave the server as it was before the command
+	PR_CompareRestore ();
+	PR_CompareFree ();
 
+	Con_Printf ("pr_compare: %i function%s, %i difference%s\n", funcs, funcs == 1 ? "" : "s",
+		diffs, diffs == 1 ? "" : "s");
 }
 
 //=============================================================================
@@ -865,6 +1658,7 @@ void PR1_UnLoadProgs(void)
 		pr_nqprogs = false;
 #endif
 		progs = NULL;
+		pr_linked = NULL;
 	}
 }
 
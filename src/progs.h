@@ -51,6 +51,7 @@ typedef struct sv_edict_s
 {
 	qbool		free;
 	link_t		area;			// linked to a division node or leaf
+	struct areabounds_s	*areabounds;	// bounds array of the list area is linked to
 
 	int         entnum;
 
@@ -119,13 +120,17 @@ void NQP_Reset (void);
 void PR_Init (void);
 
 void PR_ExecuteProgram (func_t fnum);
+void PR_LinkStatements (void);
 void PR_InitPatchTables (void);	// NQ progs support
 
 void PR_Profile_f (void);
+void PR_Compare_f (void);
+int PR_SampleStack (int *funcs, int max);
 
 void ED_ClearEdict (edict_t *e);
 edict_t *ED_Alloc (void);
 void ED_Free (edict_t *ed);
+dfunction_t *ED_FindFunction (char *name);
 
 char *ED_NewString (char *string);
 // returns a copy of the string allocated from the server's string heap
@@ -173,6 +178,7 @@ extern	int		pr_argc;
 extern	qbool	pr_trace;
 extern	dfunction_t	*pr_xfunction;
 extern	int		pr_xstatement;
+extern	volatile int	pr_xbuiltin;
 
 extern func_t mod_ConsoleCmd, mod_UserCmd;
 extern func_t mod_UserInfo_Changed, mod_localinfoChanged;
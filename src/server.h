@@ -335,6 +335,7 @@ typedef struct client_s
 	//===== NETWORK ============
 	qbool           process_pext;             // true if we wait for reply from client on "cmd pext" command.
 	int             chokecount;
+	int             totalchokes;              // chokecount is reset on every send, this is not
 	int             delta_sequence;           // -1 = no compression
 	netchan_t       netchan;
 	netadr_t        realip;                   // client's ip, not latest proxy's
@@ -432,7 +433,7 @@ typedef struct mvddest_s
 	desttype_t desttype;
 
 	int socket;
-	FILE *file;
+	struct demofile_s *file;	// written by the demo writer thread
 
 	char name[MAX_QPATH];
 	char path[MAX_QPATH];
@@ -457,6 +458,12 @@ typedef struct mvddest_s
 
 	char            qtvaddress[128];
 	int             qtvstreamid;
+
+	struct mvdchunk_s *chunk;	// where this stream is in the shared stream ring
+	int				chunkpos;
+
+	qbool			skipping;	// fell behind and left the stream ring, see DestStreamLeave
+	int				skips;		// times it was skipped forward
 // }
 
 	struct mvddest_s *nextdest;
@@ -473,6 +480,7 @@ typedef struct
 	// Something like time of last mvd message, so we can guess delta milliseconds for next message.
 	// you better not relay on this variable...
 	double			prevtime;
+	unsigned int	msecs;			// demo time written so far, sum of the frame msecs
 
 	client_t		recorder;
 
@@ -501,6 +509,36 @@ typedef struct
 //=============================================================================
 
 
+// per-phase frame timings, kept in log-linear (HDR style) histograms of
+// microseconds: values below 2*PHASE_SUBBUCKETS are exact, above that every
+// power of two is split into PHASE_SUBBUCKETS buckets, so any reported
+// percentile is within ~6% of the real value
+typedef enum
+{
+	SVPHASE_FRAME,			// whole SV_Frame
+	SVPHASE_READPACKETS,
+	SVPHASE_PHYSICS,
+	SVPHASE_RUNBOTS,
+	SVPHASE_SENDCLIENTS,
+	SVPHASE_SENDDEMO,
+	SVPHASE_MVDSTREAM,
+	SVPHASE_HEARTBEAT,
+	SVPHASE_NETFLUSH,
+	SVPHASE_MAX
+} svphase_t;
+
+#define	PHASE_SUBBITS		4
+#define	PHASE_SUBBUCKETS	(1 << PHASE_SUBBITS)
+#define	PHASE_MAXBITS		25		// longest recorded phase is ~33 seconds
+#define	PHASE_BUCKETS		((PHASE_MAXBITS - PHASE_SUBBITS + 1) * PHASE_SUBBUCKETS)
+
+typedef struct
+{
+	unsigned int	counts[PHASE_BUCKETS];
+	unsigned int	total;
+	unsigned int	max;			// microseconds
+} phasehist_t;
+
 #define	STATFRAMES	100
 typedef struct
 {
@@ -509,11 +547,35 @@ typedef struct
 	double			demo;
 	int				count;
 	int				packets;
+	int				recv_batches;	// recvmmsg() calls which returned something
+	int				recv_batched;	// packets received by those calls
+	int				send_batches;	// sendmmsg() calls which sent something
+	int				send_batched;	// packets sent by those calls
+	int				delta_hits;		// entity deltas copied from the delta cache
+	int				delta_misses;	// entity deltas encoded
+	int				trace_hits;		// world traces answered from the trace cache
+	int				trace_misses;	// world traces done and cached
 
 	double			latched_active;
 	double			latched_idle;
 	double			latched_demo;
 	int				latched_packets;
+	int				latched_recv_batches;
+	int				latched_recv_batched;
+	int				latched_send_batches;
+	int				latched_send_batched;
+	int				latched_delta_hits;
+	int				latched_delta_misses;
+	int				latched_trace_hits;
+	int				latched_trace_misses;
+
+	phasehist_t		phases[SVPHASE_MAX];	// accumulated until "framestats reset"
+
+	// never reset, for the "metrics" query
+	unsigned int	total_packets;			// everything NET_GetPacket returned
+	unsigned int	connectionless_packets;
+	unsigned int	filtered_packets;		// dropped by the ip filters
+	unsigned int	metrics_limited;		// "metrics" queries over sv_metricslim
 } svstats_t;
 
 // MAX_CHALLENGES is made large to prevent a denial
@@ -745,6 +807,11 @@ void SV_FinalMessage (const char *message);
 void SV_DropClient (client_t *drop);
 
 int SV_CalcPing (client_t *cl);
+
+extern const char *sv_phasenames[SVPHASE_MAX];
+void SV_PhaseRecord (svphase_t phase, double start);
+unsigned int SV_PhasePercentile (svphase_t phase, double p);
+void SV_PhaseReset (void);
 void SV_FullClientUpdate (client_t *client, sizebuf_t *buf);
 void SV_FullClientUpdateToClient (client_t *client, client_t *cl);
 
@@ -876,6 +943,7 @@ void SV_SendServerInfoChange (char *key, char *value);
 //
 void SV_WriteEntitiesToClient (client_t *client, sizebuf_t *msg, qbool recorder);
 void SV_SetVisibleEntitiesForBot (client_t* client);
+void SV_ClearEntityCaches (void);
 
 //
 // sv_nchan.c
@@ -924,11 +992,24 @@ mvddest_t	*DestByName (char *name);
 void		DestClose (mvddest_t *d, qbool destroyfiles);
 
 int DemoWriteDest (void *data, int len, mvddest_t *d);
+void DemoWriteStreams (void *data, int len);
+void DestStreamAttach (mvddest_t *d);
+int DestBacklog (mvddest_t *d);
+double DestLag (mvddest_t *d);
+void DemoWriter_Text (const char *path, const char *text, qbool append);
+void DemoWriter_Remove (const char *path);
+void DemoWriter_Finish (const char *name, const char *path, qbool destroyfiles);
+void DemoWriter_Sync (void);
+int DemoWriter_Queued (unsigned int *stalls);
 
 extern demo_t	demo; // server demo struct
 
 extern cvar_t	sv_demoUseCache;
 extern cvar_t	sv_demoCacheSize;
+extern cvar_t	sv_demoAsyncWrite;
+#ifdef WITH_ZLIB
+extern cvar_t	sv_demoCompress;
+#endif
 extern cvar_t	sv_demoMaxDirSize;
 extern cvar_t	sv_demoClearOld;
 extern cvar_t	sv_demoDir;
@@ -957,6 +1038,8 @@ char *SV_MVDNum(int num);
 
 char	*SV_PrintTeams (void);
 void	Run_sv_demotxt_and_sv_onrecordfinish (const char *dest_name, const char *dest_path, qbool destroyfiles);
+void	Run_sv_onrecordfinish (const char *dest_name, const char *dest_path, qbool destroyfiles);
+void	SV_MVDPath2Txt (char *path, size_t size);
 qbool	SV_DirSizeCheck (void);
 char	*SV_CleanName (unsigned char *name);
 int     Dem_CountPlayers (void);
@@ -982,6 +1065,8 @@ char*   SV_MVDName2Txt (const char *name);
 //
 
 extern cvar_t	qtv_streamtimeout;
+extern cvar_t	qtv_streamlag;
+extern cvar_t	qtv_streambacklog;
 
 
 void SV_MVDStream_Poll(void);
@@ -992,6 +1077,7 @@ void DemoWriteQTV (sizebuf_t *msg);
 void QTVsv_FreeUserList(mvddest_t *d);
 void QTV_Streams_List (void);
 void QTV_Streams_UserList (void);
+int QTV_Streams_Count (int *users);
 const char* SV_MVDDemoName(void);
 
 //
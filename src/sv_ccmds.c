@@ -1157,6 +1157,34 @@ void SV_Nslookup_f (void)
 
 }
 
+/*
+================
+SV_FrameStats_f
+
+framestats [reset]
+================
+*/
+void SV_FrameStats_f (void)
+{
+	int i;
+
+	if (Cmd_Argc() > 1 && !strcmp (Cmd_Argv(1), "reset"))
+	{
+		SV_PhaseReset ();
+		Con_Printf ("Frame statistics reset\n");
+		return;
+	}
+
+	Con_Printf ("phase          samples     p50 ms     p99 ms     max ms\n"
+				"----------- ---------- ---------- ---------- ----------\n");
+	for (i = 0; i < SVPHASE_MAX; i++)
+	{
+		Con_Printf ("%-11s %10u %10.3f %10.3f %10.3f\n", sv_phasenames[i], svs.stats.phases[i].total,
+					SV_PhasePercentile (i, 0.5) / 1000.0, SV_PhasePercentile (i, 0.99) / 1000.0,
+					svs.stats.phases[i].max / 1000.0);
+	}
+}
+
 /*
 ================
 SV_Status_f
@@ -1167,7 +1195,7 @@ void SV_Status_f (void)
 {
 	int i;
 	client_t *cl;
-	float cpu, avg, pak, demo1 = 0.0;
+	float cpu, avg, pak, batch, sbatch, dhits, thits, demo1 = 0.0;
 	char *s;
 
 	cpu = (svs.stats.latched_active + svs.stats.latched_idle);
@@ -1180,17 +1208,28 @@ void SV_Status_f (void)
 
 	avg = 1000 * svs.stats.latched_active  / STATFRAMES;
 	pak = (float)svs.stats.latched_packets / STATFRAMES;
+	batch = svs.stats.latched_recv_batches ? (float)svs.stats.latched_recv_batched / svs.stats.latched_recv_batches : 0;
+	sbatch = svs.stats.latched_send_batches ? (float)svs.stats.latched_send_batched / svs.stats.latched_send_batches : 0;
+	dhits = svs.stats.latched_delta_hits + svs.stats.latched_delta_misses;
+	dhits = dhits ? 100.0 * svs.stats.latched_delta_hits / dhits : 0;
+	thits = svs.stats.latched_trace_hits + svs.stats.latched_trace_misses;
+	thits = thits ? 100.0 * svs.stats.latched_trace_hits / thits : 0;
 
 	Con_Printf ("net address                 : %s\n"
 				"cpu utilization (overall)   : %3i%%\n"
 				"cpu utilization (recording) : %3i%%\n"
 				"avg response time           : %i ms\n"
-				"packets/frame               : %5.2f (%d)\n",
+				"packets/frame               : %5.2f (%d)\n"
+				"packets/recv batch          : %5.2f\n"
+				"packets/send batch          : %5.2f\n"
+				"entity delta cache hits     : %5.1f%%\n"
+				"world trace cache hits      : %5.1f%%\n",
 				NET_AdrToString (net_local_sv_ipadr),
 				(int)cpu,
 				(int)demo1,
 				(int)avg,
-				pak, num_prstr);
+				pak, num_prstr,
+				batch, sbatch, dhits, thits);
 
 	switch (sv_redirected)
 	{
@@ -1829,6 +1868,7 @@ void SV_InitOperatorCommands (void)
 	Cmd_AddCommand ("snapall", SV_SnapAll_f);
 	Cmd_AddCommand ("kick", SV_Kick_f);
 	Cmd_AddCommand ("status", SV_Status_f);
+	Cmd_AddCommand ("framestats", SV_FrameStats_f);
 
 	//bliP: init ->
 	Cmd_AddCommand ("rmdir", SV_RemoveDirectory_f);
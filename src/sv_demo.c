@@ -20,6 +20,9 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 // sv_demo.c - mvd demo related code
 
 #include "qwsvdef.h"
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 
 // minimal cache which can be used for demos, must be few times greater than DEMO_FLUSH_CACHE_IF_LESS_THAN_THIS
 #define DEMO_CACHE_MIN_SIZE 0x1000000
@@ -32,6 +35,10 @@ static void sv_demoDir_OnChange(cvar_t *cvar, char *value, qbool *cancel);
 
 cvar_t  sv_demoUseCache     = {"sv_demoUseCache",   "0"};
 cvar_t  sv_demoCacheSize    = {"sv_demoCacheSize",  "0", CVAR_ROM};
+cvar_t  sv_demoAsyncWrite   = {"sv_demoAsyncWrite", "1"};
+#ifdef WITH_ZLIB
+cvar_t  sv_demoCompress     = {"sv_demoCompress",   "0"};
+#endif
 cvar_t  sv_demoMaxDirSize   = {"sv_demoMaxDirSize", "102400"};
 cvar_t  sv_demoClearOld     = {"sv_demoClearOld",   "0"};
 cvar_t  sv_demoDir          = {"sv_demoDir",        "demos", 0, sv_demoDir_OnChange};
@@ -134,28 +141,801 @@ mvddest_t *DestByName (char *name)
 	return NULL;
 }
 
+//
+// Stream ring
+//
+// Everything broadcast to QTV streams is appended once to a list of chunks,
+// each stream dest keeps its own cursor into it and sends straight from the
+// chunks. A chunk counts the streams whose cursor is in it and chunks are
+// freed from the front once no stream is left in them.
+//
+// DestFlush only runs between whole messages, so it marks where they end
+// in the tail chunk. A stream which falls too far behind copies what it
+// needs to finish its current message and leaves the ring; once it sent
+// that it joins again at the end with a fresh gamestate, as if the map had
+// changed, instead of being dropped.
+//
+
+#define MVD_CHUNK_SIZE		16384
+#define MVD_CHUNK_SPARE		8		// free chunks kept around for reuse
+#define MVD_STREAM_IOV		16		// chunks sent by one writev() at most
+
+typedef struct mvdchunk_s
+{
+	struct mvdchunk_s *next;
+	unsigned int	start;			// stream offset of data[0]
+	int				used;
+	int				refs;			// streams with their cursor in this chunk
+	int				first, last;	// ends of the first and last whole message in it, -1 if none
+	double			time;			// when it was started
+	byte			data[MVD_CHUNK_SIZE];
+} mvdchunk_t;
+
+static struct
+{
+	mvdchunk_t		*head, *tail;
+	mvdchunk_t		*spare;
+	int				numspare;
+	int				streams;		// attached stream dests
+	unsigned int	total;			// bytes ever written to the ring
+} streamring;
+
+static mvdchunk_t *StreamRing_NewChunk (void)
+{
+	mvdchunk_t *c;
+
+	if ((c = streamring.spare))
+	{
+		streamring.spare = c->next;
+		streamring.numspare--;
+	}
+	else
+		c = (mvdchunk_t *) Q_malloc (sizeof(mvdchunk_t));
+
+	c->next = NULL;
+	c->start = streamring.total;
+	c->used = 0;
+	c->refs = 0;
+	c->first = c->last = -1;
+	c->time = realtime;
+
+	if (streamring.tail)
+		streamring.tail->next = c;
+	else
+		streamring.head = c;
+	streamring.tail = c;
+
+	return c;
+}
+
+// free chunks at the front which no stream is reading any more
+static void StreamRing_Trim (void)
+{
+	mvdchunk_t *c;
+
+	while ((c = streamring.head) && !c->refs && (c != streamring.tail || !streamring.streams))
+	{
+		streamring.head = c->next;
+		if (!streamring.head)
+			streamring.tail = NULL;
+
+		if (streamring.numspare < MVD_CHUNK_SPARE)
+		{
+			c->next = streamring.spare;
+			streamring.spare = c;
+			streamring.numspare++;
+		}
+		else
+			Q_free(c);
+	}
+}
+
+static void StreamRing_Write (void *data, int len)
+{
+	mvdchunk_t *c = streamring.tail;
+	int n;
+
+	while (len > 0)
+	{
+		if (!c || c->used == MVD_CHUNK_SIZE)
+			c = StreamRing_NewChunk();
+
+		n = min(len, MVD_CHUNK_SIZE - c->used);
+		memcpy(c->data + c->used, data, n);
+		c->used += n;
+		streamring.total += n;
+		data = (byte *)data + n;
+		len -= n;
+	}
+}
+
+// move the cursor of a stream len bytes on
+static void StreamRing_Advance (mvddest_t *d, int len)
+{
+	mvdchunk_t *c = d->chunk;
+
+	d->chunkpos += len;
+	while (d->chunkpos >= c->used && c->next)
+	{
+		d->chunkpos -= c->used;
+		c->refs--;
+		c = c->next;
+		c->refs++;
+	}
+	d->chunk = c;
+
+	StreamRing_Trim();
+}
+
+// new streams only get what is written to the ring from now on
+void DestStreamAttach (mvddest_t *d)
+{
+	mvdchunk_t *c = streamring.tail;
+
+	if (!c)
+		c = StreamRing_NewChunk();
+
+	d->chunk = c;
+	d->chunkpos = c->used;
+	c->refs++;
+	streamring.streams++;
+}
+
+static void DestStreamDetach (mvddest_t *d)
+{
+	if (!d->chunk)
+		return;
+
+	d->chunk->refs--;
+	d->chunk = NULL;
+	streamring.streams--;
+
+	StreamRing_Trim();
+}
+
+// called between messages only
+static void StreamRing_Mark (void)
+{
+	mvdchunk_t *c = streamring.tail;
+
+	if (!c)
+		return;
+
+	if (c->first < 0)
+		c->first = c->used;
+	c->last = c->used;
+}
+
+// bytes from the cursor of a stream to a message boundary, not always the nearest one
+static int StreamRing_ToMark (mvddest_t *d)
+{
+	mvdchunk_t *c = d->chunk;
+	int len;
+
+	if (c->last >= d->chunkpos)
+		return c->last - d->chunkpos;
+
+	for (len = c->used - d->chunkpos, c = c->next; c; len += c->used, c = c->next)
+	{
+		if (c->first >= 0)
+			return len + c->first;
+	}
+
+	return -1;
+}
+
+// bytes queued for a dest but not written out yet
+int DestBacklog (mvddest_t *d)
+{
+	int len = d->cacheused;
+
+	if (d->chunk)
+		len += streamring.total - (d->chunk->start + d->chunkpos);
+
+	return len;
+}
+
+// roughly how old the data a stream sends next is, in seconds
+double DestLag (mvddest_t *d)
+{
+	if (!d->chunk || !DestBacklog(d))
+		return 0;
+
+	return realtime - d->chunk->time;
+}
+
+// move up to count bytes of the ring into the cache of a stream
+static void DestStreamCopy (mvddest_t *d, int count)
+{
+	int len;
+
+	while (count > 0 && (len = min(d->chunk->used - d->chunkpos, count)) > 0)
+	{
+		memcpy(d->cache + d->cacheused, d->chunk->data + d->chunkpos, len);
+		d->cacheused += len;
+		count -= len;
+		StreamRing_Advance(d, len);
+	}
+}
+
+// data only for this stream has to come after what the ring already holds for it
+static void DestStreamCatchUp (mvddest_t *d)
+{
+	int len;
+
+	if (!d->chunk)
+		return;
+
+	len = DestBacklog(d) - d->cacheused;
+	if (d->cacheused + len > d->maxcachesize)
+	{
+		Sys_Printf("DemoWriteDest: cache overflow %d > %d\n", d->cacheused + len, d->maxcachesize);
+		d->error = true;
+		return;
+	}
+
+	DestStreamCopy(d, len);
+}
+
+// send as much of the ring as the socket takes, returns what send() would
+static int DestStreamSend (mvddest_t *d)
+{
+	mvdchunk_t *c;
+	int pos;
+#ifdef _WIN32
+	c = d->chunk;
+	pos = d->chunkpos;
+	if (pos == c->used && c->next)
+	{
+		c = c->next;
+		pos = 0;
+	}
+	return send(d->socket, (char *)c->data + pos, c->used - pos, 0);
+#else
+	struct iovec iov[MVD_STREAM_IOV];
+	int n;
+
+	for (n = 0, c = d->chunk, pos = d->chunkpos; c && n < MVD_STREAM_IOV; c = c->next, pos = 0)
+	{
+		if (c->used == pos)
+			continue;
+		iov[n].iov_base = c->data + pos;
+		iov[n].iov_len = c->used - pos;
+		n++;
+	}
+
+	return writev(d->socket, iov, n);
+#endif
+}
+
+// a stream which fell behind keeps the rest of its current message and leaves the ring
+static qbool DestStreamLeave (mvddest_t *d)
+{
+	int len = StreamRing_ToMark(d);
+
+	if (len < 0 || d->cacheused + len > d->maxcachesize)
+		return false; // try again later
+
+	Sys_Printf("DestFlush: stream %d skips %d bytes to catch up\n", d->id, DestBacklog(d) - d->cacheused - len);
+
+	DestStreamCopy(d, len);
+	DestStreamDetach(d);
+	d->skipping = true;
+	d->skips++;
+
+	return true;
+}
+
+// and joins it again with a fresh gamestate once it sent that
+static void DestStreamRejoin (mvddest_t *d)
+{
+	if (!d->skipping || d->cacheused || d->error || !sv.mvdrecording)
+		return;
+
+	DestStreamAttach(d);
+	d->skipping = false;
+
+	SV_MVD_SendInitialGamestate(d);
+}
+
+//
+// Demo writer
+//
+// Demo files are written by a thread of their own so a slow disk does not
+// stall server frames.  The main thread passes jobs through a single
+// producer, single consumer queue; a file dest hands its filled cache over
+// and goes on with a second one, so at most two buffers per dest are in
+// use.  Only when both are full, or the queue is, does the main thread
+// wait for the writer.  Things which must run on the main thread after
+// the file is done, like sv_onrecordfinish, come back through a second
+// queue which DestFlush polls.
+//
+
+#define DEMO_FILE_BLOCK			0x40000	// cache of unbuffered file dests
+#define DEMO_WRITER_QUEUE		64
+
+typedef enum
+{
+	DW_WRITE,		// write and flush a buffer
+	DW_CLOSE,		// close the file and free it
+	DW_TEXT,		// write a text file
+	DW_REMOVE,		// remove a file
+	DW_FINISH,		// hand back to the main thread
+	DW_SYNC			// wake up the main thread waiting for the writer
+} demojobtype_t;
+
+#ifdef WITH_ZLIB
+//
+// Compressed demos are written as a series of gzip members, each holding a
+// block of the demo which starts at a frame and can be inflated on its own,
+// so the whole file is still a valid .gz.  After the last block come empty
+// members with extra fields, which gzip skips:
+//
+// "MI" subfields: the block index, for every block the demo time in msecs,
+//      its offset in the demo and its offset in the file (little endian ints)
+// "ML" subfield: offset of the first index member and the number of blocks,
+//      this member is always the last DEMO_GZ_TAILSIZE bytes of the file
+//
+#define DEMO_GZ_BLOCK			0x10000	// blocks are cut at the first frame past this
+#define DEMO_GZ_INDEXBLOCKS		5000	// entries in one index member
+#define DEMO_GZ_TAILSIZE		34
+
+typedef struct
+{
+	unsigned int	time;
+	unsigned int	rawofs;
+	unsigned int	fileofs;
+} demoblock_t;
+#endif
+
+typedef struct demofile_s
+{
+	FILE			*file;
+	volatile int	busy;			// writer owns a buffer of this file
+	volatile int	waiting;		// main thread waits for the buffer back
+	volatile int	error;
+	char			*spare;			// buffer given back by the writer
+	sys_sem_t		*done;
+#ifdef WITH_ZLIB
+	int				level;			// gzip level if the demo is compressed
+	unsigned int	basemsecs;		// demo.msecs when recording started
+	unsigned int	blocktime;		// demo time where the cache starts
+	// used by the writer only
+	z_stream		zs;
+	byte			*zbuf;
+	unsigned int	zbufsize;
+	demoblock_t		*blocks;
+	int				numblocks, maxblocks;
+	unsigned int	rawsize, filesize;
+#endif
+} demofile_t;
+
+typedef struct
+{
+	demojobtype_t	type;
+	demofile_t		*file;
+	char			*data;
+	int				len;			// DW_TEXT: true to append
+	unsigned int	time;			// DW_WRITE: demo time of the block in msecs
+	char			path[MAX_OSPATH];
+	char			name[MAX_QPATH];
+} demojob_t;
+
+typedef struct
+{
+	demojob_t		jobs[DEMO_WRITER_QUEUE];
+	volatile unsigned int head, tail;
+} demoqueue_t;
+
+static struct
+{
+	qbool			running;
+	demoqueue_t		queue;			// main thread -> writer
+	demoqueue_t		finished;		// writer -> main thread
+	sys_sem_t		*jobs, *space, *synced;
+	unsigned int	stalls;			// times the main thread had to wait
+} demowriter;
+
+static qbool DemoQueue_Put (demoqueue_t *q, demojob_t *job)
+{
+	if (q->head - q->tail == DEMO_WRITER_QUEUE)
+		return false;
+
+	q->jobs[q->head % DEMO_WRITER_QUEUE] = *job;
+	Sys_AtomicAdd(&q->head, 1);
+	return true;
+}
+
+static qbool DemoQueue_Get (demoqueue_t *q, demojob_t *job)
+{
+	if (q->head == q->tail)
+		return false;
+
+	*job = q->jobs[q->tail % DEMO_WRITER_QUEUE];
+	Sys_AtomicAdd(&q->tail, 1);
+	return true;
+}
+
+#ifdef WITH_ZLIB
+static void DemoFile_Write (demofile_t *f, const void *data, int len)
+{
+	if (fwrite(data, 1, len, f->file) != (size_t)len)
+		f->error = true;
+	f->filesize += len;
+}
+
+static void DemoFile_WriteBlock (demofile_t *f, byte *data, int len, unsigned int time)
+{
+	unsigned int size = deflateBound(&f->zs, len);
+	demoblock_t *b;
+
+	if (size > f->zbufsize)
+	{
+		Q_free(f->zbuf);
+		f->zbuf = (byte *) Q_malloc (size);
+		f->zbufsize = size;
+	}
+
+	f->zs.next_in = data;
+	f->zs.avail_in = len;
+	f->zs.next_out = f->zbuf;
+	f->zs.avail_out = f->zbufsize;
+	if (deflate(&f->zs, Z_FINISH) != Z_STREAM_END)
+	{
+		f->error = true;
+		deflateReset(&f->zs);
+		return;
+	}
+	deflateReset(&f->zs);
+
+	if (f->numblocks == f->maxblocks)
+	{
+		f->maxblocks = f->maxblocks ? f->maxblocks * 2 : 256;
+		f->blocks = (demoblock_t *) Q_realloc (f->blocks, f->maxblocks * sizeof(demoblock_t));
+	}
+	b = &f->blocks[f->numblocks++];
+	b->time = time;
+	b->rawofs = f->rawsize;
+	b->fileofs = f->filesize;
+
+	f->rawsize += len;
+	DemoFile_Write(f, f->zbuf, f->zbufsize - f->zs.avail_out);
+}
+
+static byte *DemoFile_PutLong (byte *p, unsigned int l)
+{
+	p[0] = l & 0xff;
+	p[1] = (l >> 8) & 0xff;
+	p[2] = (l >> 16) & 0xff;
+	p[3] = l >> 24;
+	return p + 4;
+}
+
+// an empty gzip member with an extra field
+static void DemoFile_WriteExtra (demofile_t *f, char si1, char si2, byte *data, int len)
+{
+	byte head[16] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff};
+	byte tail[10] = {3, 0};
+
+	head[10] = (len + 4) & 0xff;
+	head[11] = (len + 4) >> 8;
+	head[12] = si1;
+	head[13] = si2;
+	head[14] = len & 0xff;
+	head[15] = len >> 8;
+
+	DemoFile_Write(f, head, sizeof(head));
+	DemoFile_Write(f, data, len);
+	DemoFile_Write(f, tail, sizeof(tail));
+}
+
+static void DemoFile_WriteIndex (demofile_t *f)
+{
+	byte index[DEMO_GZ_INDEXBLOCKS * 12], *p;
+	unsigned int indexofs = f->filesize;
+	int i, j;
+
+	for (i = 0; i < f->numblocks; i = j)
+	{
+		for (j = i, p = index; j < f->numblocks && j < i + DEMO_GZ_INDEXBLOCKS; j++)
+		{
+			p = DemoFile_PutLong(p, f->blocks[j].time);
+			p = DemoFile_PutLong(p, f->blocks[j].rawofs);
+			p = DemoFile_PutLong(p, f->blocks[j].fileofs);
+		}
+		DemoFile_WriteExtra(f, 'M', 'I', index, p - index);
+	}
+
+	p = DemoFile_PutLong(index, indexofs);
+	p = DemoFile_PutLong(p, f->numblocks);
+	DemoFile_WriteExtra(f, 'M', 'L', index, p - index);
+}
+#endif
+
+static void DemoWriter_Run (demojob_t *job)
+{
+	demofile_t *f = job->file;
+	FILE *t;
+
+	switch (job->type)
+	{
+	case DW_WRITE:
+#ifdef WITH_ZLIB
+		if (f->level)
+			DemoFile_WriteBlock(f, (byte *)job->data, job->len, job->time);
+		else
+#endif
+		if (fwrite(job->data, 1, job->len, f->file) != (size_t)job->len)
+			f->error = true;
+		fflush(f->file);
+		f->spare = job->data;
+		Sys_AtomicAnd(&f->busy, 0);
+		if (f->waiting)
+			Sys_SemPost(f->done);
+		break;
+
+	case DW_CLOSE:
+#ifdef WITH_ZLIB
+		if (f->level)
+		{
+			DemoFile_WriteIndex(f);
+			deflateEnd(&f->zs);
+			Q_free(f->zbuf);
+			Q_free(f->blocks);
+		}
+#endif
+		fclose(f->file);
+		Sys_SemDestroy(f->done);
+		Q_free(f->spare);
+		Q_free(f);
+		break;
+
+	case DW_TEXT:
+		if ((t = fopen(job->path, job->len ? "a+t" : "w+t")))
+		{
+			if (job->data)
+			{
+				fwrite(job->data, strlen(job->data), 1, t);
+				fflush(t);
+			}
+			fclose(t);
+		}
+		Q_free(job->data);
+		break;
+
+	case DW_REMOVE:
+		Sys_remove(job->path);
+		break;
+
+	case DW_FINISH:
+		while (!DemoQueue_Put(&demowriter.finished, job))
+			Sys_Sleep(1);
+		break;
+
+	case DW_SYNC:
+		Sys_SemPost(demowriter.synced);
+		break;
+	}
+}
+
+static DWORD WINAPI DemoWriter_Thread (void *unused)
+{
+	demojob_t job;
+
+	for (;;)
+	{
+		Sys_SemWait(demowriter.jobs);
+		DemoQueue_Get(&demowriter.queue, &job);
+		Sys_SemPost(demowriter.space);
+		DemoWriter_Run(&job);
+	}
+
+	return 0;
+}
+
+// run what the writer has finished with on the main thread
+static void DemoWriter_Poll (void)
+{
+	demojob_t job;
+
+	while (DemoQueue_Get(&demowriter.finished, &job))
+	{
+		if (job.name[0])
+			Run_sv_onrecordfinish(job.name, job.path, job.len);
+		else
+			FS_FlushFSHash();
+	}
+}
+
+static void DemoWriter_Push (demojob_t *job)
+{
+	if (!demowriter.running)
+	{
+		if (!(int)sv_demoAsyncWrite.value)
+		{
+			DemoWriter_Run(job);
+			DemoWriter_Poll();
+			return;
+		}
+
+		demowriter.jobs = Sys_SemCreate(0);
+		demowriter.space = Sys_SemCreate(DEMO_WRITER_QUEUE);
+		demowriter.synced = Sys_SemCreate(0);
+		Sys_CreateThread(DemoWriter_Thread, NULL);
+		demowriter.running = true;
+	}
+
+	if (demowriter.queue.head - demowriter.queue.tail == DEMO_WRITER_QUEUE)
+		demowriter.stalls++;
+	Sys_SemWait(demowriter.space);
+	DemoQueue_Put(&demowriter.queue, job);
+	Sys_SemPost(demowriter.jobs);
+}
+
+// wait until everything queued so far is on disk
+void DemoWriter_Sync (void)
+{
+	demojob_t job;
+
+	if (demowriter.running)
+	{
+		memset(&job, 0, sizeof(job));
+		job.type = DW_SYNC;
+		DemoWriter_Push(&job);
+		Sys_SemWait(demowriter.synced);
+	}
+
+	DemoWriter_Poll();
+}
+
+int DemoWriter_Queued (unsigned int *stalls)
+{
+	*stalls = demowriter.stalls;
+	return demowriter.queue.head - demowriter.queue.tail;
+}
+
+// write text to a file, or only create it if text is NULL
+void DemoWriter_Text (const char *path, const char *text, qbool append)
+{
+	demojob_t job;
+
+	memset(&job, 0, sizeof(job));
+	job.type = DW_TEXT;
+	job.len = append;
+	strlcpy(job.path, path, sizeof(job.path));
+	if (text)
+	{
+		job.data = (char *) Q_malloc(strlen(text) + 1);
+		strcpy(job.data, text);
+	}
+	DemoWriter_Push(&job);
+}
+
+void DemoWriter_Remove (const char *path)
+{
+	demojob_t job;
+
+	memset(&job, 0, sizeof(job));
+	job.type = DW_REMOVE;
+	strlcpy(job.path, path, sizeof(job.path));
+	DemoWriter_Push(&job);
+}
+
+// once all before is done run sv_onrecordfinish for the demo, or only
+// rebuild the file cache if name is NULL
+void DemoWriter_Finish (const char *name, const char *path, qbool destroyfiles)
+{
+	demojob_t job;
+
+	memset(&job, 0, sizeof(job));
+	job.type = DW_FINISH;
+	job.len = destroyfiles;
+	if (name)
+	{
+		strlcpy(job.name, name, sizeof(job.name));
+		strlcpy(job.path, path, sizeof(job.path));
+	}
+	DemoWriter_Push(&job);
+}
+
+static demofile_t *DestFileOpen (FILE *file, int level)
+{
+	demofile_t *f = (demofile_t *) Q_malloc (sizeof(demofile_t));
+
+	f->file = file;
+	f->done = Sys_SemCreate(0);
+#ifdef WITH_ZLIB
+	// windowBits 15 + 16 makes deflate write gzip members
+	if (level)
+	{
+		if (deflateInit2(&f->zs, bound(1, level, 9), Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			Sys_SemDestroy(f->done);
+			Q_free(f);
+			return NULL;
+		}
+		f->level = level;
+		f->basemsecs = demo.msecs;
+	}
+#endif
+
+	return f;
+}
+
+
+// give the cache of a file dest to the writer and go on with the other one
+static void DestFileHandOver (mvddest_t *d)
+{
+	demofile_t *f = d->file;
+	demojob_t job;
+
+	if (f->busy)
+	{
+		demowriter.stalls++;
+		Sys_AtomicOr(&f->waiting, 1);
+		while (f->busy)
+			Sys_SemWait(f->done);
+		Sys_AtomicAnd(&f->waiting, 0);
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.type = DW_WRITE;
+	job.file = f;
+	job.data = d->cache;
+	job.len = d->cacheused;
+#ifdef WITH_ZLIB
+	job.time = f->blocktime;
+#endif
+
+	d->cache = f->spare ? f->spare : (char *) Q_malloc (d->maxcachesize);
+	d->cacheused = 0;
+	f->spare = NULL;
+	f->busy = true;
+
+	DemoWriter_Push(&job);
+}
+
+static void DestFileClose (mvddest_t *d)
+{
+	demojob_t job;
+
+	if (d->cacheused)
+		DestFileHandOver(d);
+
+	memset(&job, 0, sizeof(job));
+	job.type = DW_CLOSE;
+	job.file = d->file;
+	d->file = NULL;
+
+	DemoWriter_Push(&job);
+}
+
 void DestClose (mvddest_t *d, qbool destroyfiles)
 {
 	char path[MAX_OSPATH];
 
+	if (d->file)
+		DestFileClose(d);
 	if (d->cache)
 		Q_free(d->cache);
-	if (d->file)
-		fclose(d->file);
+	DestStreamDetach(d);
 	if (d->socket)
+	{
+		NET_EventDel(d->socket);
 		closesocket(d->socket);
+	}
 	if (d->qtvuserlist)
 		QTVsv_FreeUserList(d);
 
 	if (destroyfiles)
 	{
 		snprintf(path, MAX_OSPATH, "%s/%s/%s", fs_gamedir, d->path, d->name);
-		Sys_remove(path);
-		strlcpy(path + strlen(path) - 3, "txt", MAX_OSPATH - strlen(path) + 3);
-		Sys_remove(path);
+		DemoWriter_Remove(path);
+		SV_MVDPath2Txt(path, sizeof(path));
+		DemoWriter_Remove(path);
 
 		// force cache rebuild.
-		FS_FlushFSHash();
+		DemoWriter_Finish(NULL, NULL, false);
 	}
 
 	Q_free(d);
@@ -166,9 +946,13 @@ void DestClose (mvddest_t *d, qbool destroyfiles)
 //
 void DestFlush (qbool compleate)
 {
-	int len;
+	int len, limit;
 	mvddest_t *d, *t;
 
+	DemoWriter_Poll();
+
+	StreamRing_Mark();
+
 	if (!demo.dest)
 		return;
 
@@ -191,22 +975,23 @@ void DestFlush (qbool compleate)
 		switch(d->desttype)
 		{
 		case DEST_FILE:
-			fflush (d->file);
+			// written as soon as the writer is done with the last part,
+			// compressed demos are cut into blocks at frames
+#ifdef WITH_ZLIB
+			if (d->file->level)
+			{
+				if (d->cacheused >= DEMO_GZ_BLOCK || (d->cacheused && compleate))
+					DestFileHandOver(d);
+			}
+			else
+#endif
+			if (d->cacheused && (!d->file->busy || compleate))
+				DestFileHandOver(d);
 			break;
 
 		case DEST_BUFFEREDFILE:
-			if (d->cacheused + DEMO_FLUSH_CACHE_IF_LESS_THAN_THIS > d->maxcachesize || compleate)
-			{
-				len = fwrite(d->cache, 1, d->cacheused, d->file);
-				if (len != d->cacheused)
-				{
-					Sys_Printf("DestFlush: fwrite() error\n");
-					d->error = true;
-				}
-				fflush(d->file);
-
-				d->cacheused = 0;
-			}
+			if (d->cacheused && (d->cacheused + DEMO_FLUSH_CACHE_IF_LESS_THAN_THIS > d->maxcachesize || compleate))
+				DestFileHandOver(d);
 			break;
 
 		case DEST_STREAM:
@@ -218,32 +1003,61 @@ void DestFlush (qbool compleate)
 				d->error = true;
 			}
 
-			if (d->cacheused && !d->error)
-			{
+			if (d->error)
+				break;
+
+			// data for this stream alone goes first, then the shared ring
+			if (d->cacheused)
 				len = send(d->socket, d->cache, d->cacheused, 0);
+			else if (DestBacklog(d))
+				len = DestStreamSend(d);
+			else
+				len = 0;
 
-				if (len == 0) //client died
-				{
-//					d->error = true;
-					// man says: The calls return the number of characters sent, or -1 if an error occurred.   
-					// so 0 is legal or what?
-				}
-				else if (len > 0) //we put some data through
+			if (len == 0) //client died
+			{
+//				d->error = true;
+				// man says: The calls return the number of characters sent, or -1 if an error occurred.   
+				// so 0 is legal or what?
+			}
+			else if (len > 0) //we put some data through
+			{
+				if (d->cacheused)
 				{ //move up the buffer
 					d->cacheused -= len;
 					memmove(d->cache, d->cache+len, d->cacheused);
-
-					d->io_time = Sys_DoubleTime(); // update IO activity
 				}
 				else
-				{ //error of some kind. would block or something
-					if (qerrno != EWOULDBLOCK && qerrno != EAGAIN)
-					{
-						Sys_Printf("DestFlush: error on stream\n");
-						d->error = true;
-					}
+					StreamRing_Advance(d, len);
+
+				d->totalsize += len;
+				d->io_time = Sys_DoubleTime(); // update IO activity
+			}
+			else
+			{ //error of some kind. would block or something
+				if (qerrno != EWOULDBLOCK && qerrno != EAGAIN)
+				{
+					Sys_Printf("DestFlush: error on stream\n");
+					d->error = true;
 				}
 			}
+
+			DestStreamRejoin(d);
+
+			// the ring keeps growing for a stream which does not keep up, skip it forward if we may
+			limit = max(1024 * (int)qtv_streambacklog.value, d->maxcachesize);
+			if (d->chunk && DestBacklog(d) > limit && qtv_streamlag.value && sv.mvdrecording && !compleate)
+			{
+				if (DestStreamLeave(d))
+					break;
+				limit *= 2;
+			}
+
+			if (DestBacklog(d) > limit)
+			{
+				Sys_Printf("DestFlush: stream overflow %d > %d\n", DestBacklog(d), limit);
+				d->error = true;
+			}
 			break;
 
 		case DEST_NONE:
@@ -251,6 +1065,12 @@ void DestFlush (qbool compleate)
 			Sys_Error("DestFlush: encountered bad dest.");
 		}
 
+		if (d->file && d->file->error && !d->error)
+		{
+			Sys_Printf("DestFlush: fwrite() error\n");
+			d->error = true;
+		}
+
 		if (d->desttype != DEST_STREAM) // no max size for stream
 		{
 			if ((unsigned int)sv_demoMaxSize.value && d->totalsize > ((unsigned int)sv_demoMaxSize.value * 1024))
@@ -311,27 +1131,37 @@ static int DestCloseAllFlush (qbool destroyfiles, qbool mvdonly)
 
 int DemoWriteDest (void *data, int len, mvddest_t *d)
 {
-	int ret;
-
 	if (d->error)
 		return 0;
 
-	d->totalsize += len;
+	if (d->desttype != DEST_STREAM) // streams count what is sent
+		d->totalsize += len;
 
 	switch(d->desttype)
 	{
 		case DEST_FILE:
-			ret = fwrite(data, 1, len, d->file);
-			if (ret != len)
+			if (d->cacheused + len > d->maxcachesize)
+				DestFileHandOver(d);
+#ifdef WITH_ZLIB
+			if (!d->cacheused)
+				d->file->blocktime = demo.msecs - d->file->basemsecs;
+#endif
+			if (len > d->maxcachesize)
 			{
-				Sys_Printf("DemoWriteDest: fwrite() error\n");
+				Sys_Printf("DemoWriteDest: cache overflow %d > %d\n", len, d->maxcachesize);
 				d->error = true;
 				return 0;
 			}
+			memcpy(d->cache + d->cacheused, data, len);
+			d->cacheused += len;
 
 			break;
-		case DEST_BUFFEREDFILE:	//these write to a cache, which is flushed later
 		case DEST_STREAM:
+			DestStreamCatchUp(d);
+			if (d->error)
+				return 0;
+			// fall through
+		case DEST_BUFFEREDFILE:	//these write to a cache, which is flushed later
 			if (d->cacheused + len > d->maxcachesize)
 			{
 				Sys_Printf("DemoWriteDest: cache overflow %d > %d\n", d->cacheused + len, d->maxcachesize);
@@ -349,13 +1179,26 @@ int DemoWriteDest (void *data, int len, mvddest_t *d)
 	return len;
 }
 
+// broadcast to all streams, written once to the stream ring
+void DemoWriteStreams (void *data, int len)
+{
+	if (streamring.streams)
+		StreamRing_Write(data, len);
+}
+
 static void DemoWrite (void *data, int len) //broadcast to all proxies/mvds
 {
 	mvddest_t *d;
+
+	if (!singledest)
+		DemoWriteStreams(data, len);
+
 	for (d = demo.dest; d; d = d->nextdest)
 	{
 		if (singledest && singledest != d)
 			continue;
+		if (!singledest && d->desttype == DEST_STREAM)
+			continue;
 
 		DemoWriteDest(data, len, d);
 	}
@@ -501,6 +1344,8 @@ static byte MVD_FrameDeltaTime (double time1)
 	if (msec < 2)
 		msec = 0; // uh, why 0 but not 2? 
 
+	demo.msecs += msec;
+
 	return (byte)msec;
 }
 
@@ -773,10 +1618,23 @@ static mvddest_t *SV_InitRecordFile (char *name)
 {
 	char *s;
 	mvddest_t *dst;
+	demofile_t *demofile;
 	FILE *file;
+	int level = 0;
 
 	char path[MAX_OSPATH];
 
+#ifdef WITH_ZLIB
+	char gzname[MAX_OSPATH];
+
+	// compressed demos are written straight to .mvd.gz
+	if ((level = (int)sv_demoCompress.value) > 0)
+	{
+		strlcpy(gzname, va("%s.gz", name), sizeof(gzname));
+		name = gzname;
+	}
+#endif
+
 	Con_DPrintf("SV_InitRecordFile: Demo name: \"%s\"\n", name);
 	file = fopen (name, "wb");
 	if (!file)
@@ -785,21 +1643,29 @@ static mvddest_t *SV_InitRecordFile (char *name)
 		return NULL;
 	}
 
+	// the name already says .gz, so never write plain data to it
+	if (!(demofile = DestFileOpen(file, level)))
+	{
+		Con_Printf ("ERROR: couldn't start compression for \"%s\"\n", name);
+		fclose(file);
+		Sys_remove(name);
+		return NULL;
+	}
+
 	dst = (mvddest_t*) Q_malloc (sizeof(mvddest_t));
 
-	if (!(int)sv_demoUseCache.value)
+	if (!(int)sv_demoUseCache.value || level > 0) // compressed demos have their own blocks
 	{
 		dst->desttype = DEST_FILE;
-		dst->file = file;
-		dst->maxcachesize = 0;
+		dst->maxcachesize = DEMO_FILE_BLOCK;
 	}
 	else
 	{
 		dst->desttype = DEST_BUFFEREDFILE;
-		dst->file = file;
 		dst->maxcachesize = 1024 * (int) sv_demoCacheSize.value;
-		dst->cache = (char *) Q_malloc (dst->maxcachesize);
 	}
+	dst->file = demofile;
+	dst->cache = (char *) Q_malloc (dst->maxcachesize);
 
 	s = name + strlen(name);
 	while (*s != '/') s--;
@@ -812,31 +1678,20 @@ static mvddest_t *SV_InitRecordFile (char *name)
 	Cvar_SetROM(&serverdemo, dst->name);
 
 	strlcpy(path, name, MAX_OSPATH);
-	strlcpy(path + strlen(path) - 3, "txt", MAX_OSPATH - strlen(path) + 3);
+	SV_MVDPath2Txt(path, sizeof(path));
 
 	if ((int)sv_demotxt.value)
 	{
-		FILE *f;
-		char *text;
-
 		if (sv_demotxt.value == 2)
-		{
-			if ((f = fopen (path, "a+t")))
-				fclose(f); // at least made empty file
-		}
-		else if ((f = fopen (path, "w+t")))
-		{
-			text = SV_PrintTeams();
-			fwrite(text, strlen(text), 1, f);
-			fflush(f);
-			fclose(f);
-		}
+			DemoWriter_Text(path, NULL, true); // at least made empty file
+		else
+			DemoWriter_Text(path, SV_PrintTeams(), false);
 	}
 	else
-		Sys_remove(path);
+		DemoWriter_Remove(path);
 
 	// force cache rebuild.
-	FS_FlushFSHash();
+	DemoWriter_Finish(NULL, NULL, false);
 
 	return dst;
 }
@@ -1136,102 +1991,65 @@ qbool SV_MVD_Record (mvddest_t *dest, qbool mapchange)
 	return true;
 }
 
-void SV_MVD_SendInitialGamestate(mvddest_t *dest)
-{
-	sizebuf_t	buf;
-	unsigned char buf_data[MAX_MSGLEN];
-	unsigned int n;
-	char *s, info[MAX_EXT_INFO_STRING];
+/*
+====================
+MVDSignon_Add
 
-	client_t *player;
-	edict_t *ent;
-	char *gamedir;
-	int i;
+The lists, baselines and signon buffers only change with the map, static
+entities only grow when the game makes more of them mid-map. So all that is
+built once and replayed from here to every new dest until one of them changes.
+Messages are kept framed exactly as SV_WriteRecordMVDMessage would write them.
+====================
+*/
+static struct
+{
+	byte		*data;
+	int			size;
+	int			maxsize;
+
+	qbool		valid;
+	int			spawncount;
+	unsigned int	extensions;
+	int			coordsize;
+	int			numstatics;
+	unsigned int	numsignon;
+	int			signonsize;
+} mvdsignon;
+
+static void MVDSignon_Add (sizebuf_t *msg)
+{
+	int len;
 
-	if (!demo.dest)
+	if (!msg->cursize)
 		return;
 
-	sv.mvdrecording = true; // NOTE:  afaik set to false on map change, so restore it here
-	
-	
-	demo.pingtime = demo.time = sv.time;
-
+	if (mvdsignon.size + msg->cursize + 6 > mvdsignon.maxsize)
+	{
+		mvdsignon.maxsize = max(mvdsignon.maxsize * 2, mvdsignon.size + msg->cursize + 6);
+		mvdsignon.data = (byte *) Q_realloc(mvdsignon.data, mvdsignon.maxsize);
+	}
 
-	singledest = dest;
+	mvdsignon.data[mvdsignon.size++] = 0;
+	mvdsignon.data[mvdsignon.size++] = dem_all;
+	len = LittleLong (msg->cursize);
+	memcpy(mvdsignon.data + mvdsignon.size, &len, 4);
+	mvdsignon.size += 4;
+	memcpy(mvdsignon.data + mvdsignon.size, msg->data, msg->cursize);
+	mvdsignon.size += msg->cursize;
+}
 
-	/*-------------------------------------------------*/
+static void MVDSignon_Build (void)
+{
+	sizebuf_t	buf;
+	unsigned char buf_data[MAX_MSGLEN];
+	unsigned int n;
+	char *s;
 
-	// serverdata
-	// send the info about the new client to all connected clients
 	memset(&buf, 0, sizeof(buf));
 	buf.data = buf_data;
 	buf.maxsize = sizeof(buf_data);
 
-	// send the serverdata
-
-	gamedir = Info_ValueForKey (svs.info, "*gamedir");
-	if (!gamedir[0])
-		gamedir = "qw";
-
-	MSG_WriteByte (&buf, svc_serverdata);
-
-#ifdef FTE_PEXT_FLOATCOORDS
-	//fix up extensions to match sv_bigcoords correctly. sorry for old clients not working.
-	if (msg_coordsize == 4)
-		demo.recorder.fteprotocolextensions |= FTE_PEXT_FLOATCOORDS;
-	else
-		demo.recorder.fteprotocolextensions &= ~FTE_PEXT_FLOATCOORDS;
-#endif
-
-#ifdef PROTOCOL_VERSION_FTE
-	if (demo.recorder.fteprotocolextensions)
-	{
-		MSG_WriteLong(&buf, PROTOCOL_VERSION_FTE);
-		MSG_WriteLong(&buf, demo.recorder.fteprotocolextensions);
-	}
-#endif
-
-#ifdef PROTOCOL_VERSION_FTE2
-	if (demo.recorder.fteprotocolextensions2)
-	{
-		MSG_WriteLong(&buf, PROTOCOL_VERSION_FTE2);
-		MSG_WriteLong(&buf, demo.recorder.fteprotocolextensions2);
-	}
-#endif
-
-	MSG_WriteLong (&buf, PROTOCOL_VERSION);
-	MSG_WriteLong (&buf, svs.spawncount);
-	MSG_WriteString (&buf, gamedir);
-
-
-	MSG_WriteFloat (&buf, sv.time);
-
-	// send full levelname
-	MSG_WriteString (&buf, PR_GetEntityString(sv.edicts->v.message));
-
-	// send the movevars
-	MSG_WriteFloat(&buf, movevars.gravity);
-	MSG_WriteFloat(&buf, movevars.stopspeed);
-	MSG_WriteFloat(&buf, movevars.maxspeed);
-	MSG_WriteFloat(&buf, movevars.spectatormaxspeed);
-	MSG_WriteFloat(&buf, movevars.accelerate);
-	MSG_WriteFloat(&buf, movevars.airaccelerate);
-	MSG_WriteFloat(&buf, movevars.wateraccelerate);
-	MSG_WriteFloat(&buf, movevars.friction);
-	MSG_WriteFloat(&buf, movevars.waterfriction);
-	MSG_WriteFloat(&buf, movevars.entgravity);
-
-	// send music
-	MSG_WriteByte (&buf, svc_cdtrack);
-	MSG_WriteByte (&buf, 0); // none in demos
-
-	// send server info string
-	MSG_WriteByte (&buf, svc_stufftext);
-	MSG_WriteString (&buf, va("fullserverinfo \"%s\"\n", svs.info) );
-
-	// flush packet
-	SV_WriteRecordMVDMessage (&buf);
-	SZ_Clear (&buf);
+	mvdsignon.size = 0;
 
 	// soundlist
 	MSG_WriteByte (&buf, svc_soundlist);
@@ -1246,7 +2064,7 @@ void SV_MVD_SendInitialGamestate(mvddest_t *dest)
 		{
 			MSG_WriteByte (&buf, 0);
 			MSG_WriteByte (&buf, n);
-			SV_WriteRecordMVDMessage (&buf);
+			MVDSignon_Add (&buf);
 			SZ_Clear (&buf);
 			MSG_WriteByte (&buf, svc_soundlist);
 			MSG_WriteByte (&buf, n + 1);
@@ -1259,7 +2077,7 @@ void SV_MVD_SendInitialGamestate(mvddest_t *dest)
 	{
 		MSG_WriteByte (&buf, 0);
 		MSG_WriteByte (&buf, 0);
-		SV_WriteRecordMVDMessage (&buf);
+		MVDSignon_Add (&buf);
 		SZ_Clear (&buf);
 	}
 
@@ -1276,7 +2094,7 @@ void SV_MVD_SendInitialGamestate(mvddest_t *dest)
 		{
 			MSG_WriteByte (&buf, 0);
 			MSG_WriteByte (&buf, n);
-			SV_WriteRecordMVDMessage (&buf);
+			MVDSignon_Add (&buf);
 			SZ_Clear (&buf);
 			MSG_WriteByte (&buf, svc_modellist);
 			MSG_WriteByte (&buf, n + 1);
@@ -1289,7 +2107,7 @@ void SV_MVD_SendInitialGamestate(mvddest_t *dest)
 	{
 		MSG_WriteByte (&buf, 0);
 		MSG_WriteByte (&buf, 0);
-		SV_WriteRecordMVDMessage (&buf);
+		MVDSignon_Add (&buf);
 		SZ_Clear (&buf);
 	}
 
@@ -1302,7 +2120,7 @@ void SV_MVD_SendInitialGamestate(mvddest_t *dest)
 			entity_state_t* s = &sv.static_entities[i];
 
 			if (buf.cursize >= MAX_MSGLEN/2) {
-				SV_WriteRecordMVDMessage (&buf);
+				MVDSignon_Add (&buf);
 				SZ_Clear (&buf);
 			}
 
@@ -1334,7 +2152,7 @@ void SV_MVD_SendInitialGamestate(mvddest_t *dest)
 			entity_state_t* s = &svent->e->baseline;
 
 			if (buf.cursize >= MAX_MSGLEN/2) {
-				SV_WriteRecordMVDMessage (&buf);
+				MVDSignon_Add (&buf);
 				SZ_Clear (&buf);
 			}
 
@@ -1366,7 +2184,7 @@ void SV_MVD_SendInitialGamestate(mvddest_t *dest)
 	{
 		if (buf.cursize+sv.signon_buffer_size[n] > MAX_MSGLEN/2)
 		{
-			SV_WriteRecordMVDMessage (&buf);
+			MVDSignon_Add (&buf);
 			SZ_Clear (&buf);
 		}
 		SZ_Write (&buf,
@@ -1376,7 +2194,7 @@ void SV_MVD_SendInitialGamestate(mvddest_t *dest)
 
 	if (buf.cursize > MAX_MSGLEN/2)
 	{
-		SV_WriteRecordMVDMessage (&buf);
+		MVDSignon_Add (&buf);
 		SZ_Clear (&buf);
 	}
 
@@ -1385,9 +2203,149 @@ void SV_MVD_SendInitialGamestate(mvddest_t *dest)
 
 	if (buf.cursize)
 	{
-		SV_WriteRecordMVDMessage (&buf);
+		MVDSignon_Add (&buf);
 		SZ_Clear (&buf);
 	}
+}
+
+/*
+====================
+SV_MVD_WriteSignon
+====================
+*/
+static void SV_MVD_WriteSignon (void)
+{
+	int pos, len;
+
+	if (!sv.mvdrecording)
+		return;
+
+	if (!mvdsignon.valid || mvdsignon.spawncount != svs.spawncount
+		|| mvdsignon.extensions != demo.recorder.fteprotocolextensions
+		|| mvdsignon.coordsize != msg_coordsize
+		|| mvdsignon.numstatics != sv.static_entity_count
+		|| mvdsignon.numsignon != sv.num_signon_buffers
+		|| mvdsignon.signonsize != sv.signon_buffer_size[sv.num_signon_buffers - 1])
+	{
+		MVDSignon_Build();
+
+		// precaches and signon buffers are only final once the map is running
+		mvdsignon.valid = (sv.state == ss_active);
+		mvdsignon.spawncount = svs.spawncount;
+		mvdsignon.extensions = demo.recorder.fteprotocolextensions;
+		mvdsignon.coordsize = msg_coordsize;
+		mvdsignon.numstatics = sv.static_entity_count;
+		mvdsignon.numsignon = sv.num_signon_buffers;
+		mvdsignon.signonsize = sv.signon_buffer_size[sv.num_signon_buffers - 1];
+	}
+
+	// one message at a time, so file dests still cut their blocks on message boundaries
+	for (pos = 0; pos < mvdsignon.size; pos += 6 + len)
+	{
+		memcpy(&len, mvdsignon.data + pos + 2, 4);
+		len = LittleLong(len);
+		DemoWrite (mvdsignon.data + pos, 6 + len);
+	}
+}
+
+void SV_MVD_SendInitialGamestate(mvddest_t *dest)
+{
+	sizebuf_t	buf;
+	unsigned char buf_data[MAX_MSGLEN];
+	char info[MAX_EXT_INFO_STRING];
+
+	client_t *player;
+	edict_t *ent;
+	char *gamedir;
+	int i;
+
+	if (!demo.dest)
+		return;
+
+	sv.mvdrecording = true; // NOTE:  afaik set to false on map change, so restore it here
+	
+	
+	demo.pingtime = demo.time = sv.time;
+
+
+	singledest = dest;
+
+	/*-------------------------------------------------*/
+
+	// serverdata
+	// send the info about the new client to all connected clients
+	memset(&buf, 0, sizeof(buf));
+	buf.data = buf_data;
+	buf.maxsize = sizeof(buf_data);
+
+	// send the serverdata
+
+	gamedir = Info_ValueForKey (svs.info, "*gamedir");
+	if (!gamedir[0])
+		gamedir = "qw";
+
+	MSG_WriteByte (&buf, svc_serverdata);
+
+#ifdef FTE_PEXT_FLOATCOORDS
+	//fix up extensions to match sv_bigcoords correctly. sorry for old clients not working.
+	if (msg_coordsize == 4)
+		demo.recorder.fteprotocolextensions |= FTE_PEXT_FLOATCOORDS;
+	else
+		demo.recorder.fteprotocolextensions &= ~FTE_PEXT_FLOATCOORDS;
+#endif
+
+#ifdef PROTOCOL_VERSION_FTE
+	if (demo.recorder.fteprotocolextensions)
+	{
+		MSG_WriteLong(&buf, PROTOCOL_VERSION_FTE);
+		MSG_WriteLong(&buf, demo.recorder.fteprotocolextensions);
+	}
+#endif
+
+#ifdef PROTOCOL_VERSION_FTE2
+	if (demo.recorder.fteprotocolextensions2)
+	{
+		MSG_WriteLong(&buf, PROTOCOL_VERSION_FTE2);
+		MSG_WriteLong(&buf, demo.recorder.fteprotocolextensions2);
+	}
+#endif
+
+	MSG_WriteLong (&buf, PROTOCOL_VERSION);
+	MSG_WriteLong (&buf, svs.spawncount);
+	MSG_WriteString (&buf, gamedir);
+
+
+	MSG_WriteFloat (&buf, sv.time);
+
+	// send full levelname
+	MSG_WriteString (&buf, PR_GetEntityString(sv.edicts->v.message));
+
+	// send the movevars
+	MSG_WriteFloat(&buf, movevars.gravity);
+	MSG_WriteFloat(&buf, movevars.stopspeed);
+	MSG_WriteFloat(&buf, movevars.maxspeed);
+	MSG_WriteFloat(&buf, movevars.spectatormaxspeed);
+	MSG_WriteFloat(&buf, movevars.accelerate);
+	MSG_WriteFloat(&buf, movevars.airaccelerate);
+	MSG_WriteFloat(&buf, movevars.wateraccelerate);
+	MSG_WriteFloat(&buf, movevars.friction);
+	MSG_WriteFloat(&buf, movevars.waterfriction);
+	MSG_WriteFloat(&buf, movevars.entgravity);
+
+	// send music
+	MSG_WriteByte (&buf, svc_cdtrack);
+	MSG_WriteByte (&buf, 0); // none in demos
+
+	// send server info string
+	MSG_WriteByte (&buf, svc_stufftext);
+	MSG_WriteString (&buf, va("fullserverinfo \"%s\"\n", svs.info) );
+
+	// flush packet
+	SV_WriteRecordMVDMessage (&buf);
+	SZ_Clear (&buf);
+
+	// lists, static entities, baselines and prespawn, cached per map
+	SV_MVD_WriteSignon ();
 
 	// send current status of all other players
 
@@ -1752,6 +2710,10 @@ static void MVD_Init (void)
 	Cvar_Register (&sv_demoPings);
 	Cvar_Register (&sv_demoUseCache);
 	Cvar_Register (&sv_demoCacheSize);
+	Cvar_Register (&sv_demoAsyncWrite);
+#ifdef WITH_ZLIB
+	Cvar_Register (&sv_demoCompress);
+#endif
 	Cvar_Register (&sv_demoMaxSize);
 	Cvar_Register (&sv_demoMaxDirSize);
 	Cvar_Register (&sv_demoClearOld); //bliP: 24/9 clear old demos
@@ -168,54 +168,53 @@ qbool SV_DirSizeCheck (void)
 			{
 				if (list->isdir)
 					continue;
-				Sys_remove(va("%s/%s/%s", fs_gamedir, sv_demoDir.string, list->name));
+				DemoWriter_Remove(va("%s/%s/%s", fs_gamedir, sv_demoDir.string, list->name));
 				//Con_Printf("Remove %d - %s/%s/%s\n", n, fs_gamedir, sv_demoDir.string, list->name);
 				n--;
 			}
 
 			// force cache rebuild.
-			FS_FlushFSHash();
+			DemoWriter_Finish(NULL, NULL, false);
 		}
 	}
 	return true;
 }
 
+// the txt is written and the script run once the demo writer has closed the demo
 void Run_sv_demotxt_and_sv_onrecordfinish (const char *dest_name, const char *dest_path, qbool destroyfiles)
 {
 	char path[MAX_OSPATH];
 
 	snprintf(path, MAX_OSPATH, "%s/%s/%s", fs_gamedir, dest_path, dest_name);
-	strlcpy(path + strlen(path) - 3, "txt", MAX_OSPATH - strlen(path) + 3);
+	SV_MVDPath2Txt(path, sizeof(path));
 
 	if ((int)sv_demotxt.value && !destroyfiles) // dont keep txt's for deleted demos
 	{
-		FILE *f;
-		char *text;
-
 		if (sv_demotxt.value == 2)
-		{
-			if ((f = fopen (path, "a+t")))
-				fclose(f); // at least made empty file, but do not owerwite
-		}
-		else if ((f = fopen (path, "w+t")))
-		{
-			text = SV_PrintTeams();
-			fwrite(text, strlen(text), 1, f);
-			fflush(f);
-			fclose(f);
-		}
+			DemoWriter_Text(path, NULL, true); // at least made empty file, but do not owerwite
+		else
+			DemoWriter_Text(path, SV_PrintTeams(), false);
 	}
 
+	DemoWriter_Finish(dest_name, dest_path, destroyfiles);
+}
+
+void Run_sv_onrecordfinish (const char *dest_name, const char *dest_path, qbool destroyfiles)
+{
+	char path[MAX_OSPATH];
+
 	if (sv_onrecordfinish.string[0] && !destroyfiles) // dont gzip deleted demos
 	{
 		extern redirect_t sv_redirected;
 		redirect_t old = sv_redirected;
-		char *p;
+		char *p, *gz;
 	
 		if ((p = strstr(sv_onrecordfinish.string, " ")) != NULL)
 			*p = 0; // strip parameters
 	
 		strlcpy(path, dest_name, sizeof(path));
+		if ((gz = strstr(path, ".mvd.gz")) && !gz[7])
+			gz[4] = 0; // compressed while recording, the script still gets the plain name
 #ifdef SERVERONLY
 		COM_StripExtension(path);
 #else
@@ -551,6 +550,17 @@ char *SV_MVDName2Txt (const char *name)
 	return va("%s", s);
 }
 
+// path of the txt for the demo being recorded to path, which ends with .mvd or .mvd.gz
+void SV_MVDPath2Txt (char *path, size_t size)
+{
+	size_t len = strlen(path);
+
+	if (len > 3 && !strcmp(path + len - 3, ".gz"))
+		path[len -= 3] = 0;
+	if (len > 3)
+		strlcpy(path + len - 3, "txt", size - len + 3);
+}
+
 static char *SV_MVDTxTNum (int num)
 {
 	return SV_MVDName2Txt (SV_MVDNum(num));
@@ -585,7 +595,10 @@ void SV_MVDRemove_f (void)
 			if (strstr(list->name, ptr))
 			{
 				if (sv.mvdrecording && DestByName(list->name)/*!strcmp(list->name, demo.name)*/)
+				{
 					SV_MVDStop_f(); // FIXME: probably we must stop not all demos, but only partial dest
+					DemoWriter_Sync(); // the demo has to be closed before it is removed
+				}
 
 				// stop recording first;
 				snprintf(path, MAX_OSPATH, "%s/%s/%s", fs_gamedir, sv_demoDir.string, list->name);
@@ -620,7 +633,10 @@ void SV_MVDRemove_f (void)
 	snprintf(path, MAX_OSPATH, "%s/%s/%s", fs_gamedir, sv_demoDir.string, name);
 
 	if (sv.mvdrecording && DestByName(name) /*!strcmp(name, demo.name)*/)
+	{
 		SV_MVDStop_f(); // FIXME: probably we must stop not all demos, but only partial dest
+		DemoWriter_Sync(); // the demo has to be closed before it is removed
+	}
 
 	if (!Sys_remove(path))
 	{
@@ -671,7 +687,10 @@ void SV_MVDRemoveNum_f (void)
 	if (name != NULL)
 	{
 		if (sv.mvdrecording && DestByName(name)/*!strcmp(name, demo.name)*/)
+		{
 			SV_MVDStop_f(); // FIXME: probably we must stop not all demos, but only partial dest
+			DemoWriter_Sync(); // the demo has to be closed before it is removed
+		}
 
 		snprintf(path, MAX_OSPATH, "%s/%s/%s", fs_gamedir, sv_demoDir.string, name);
 		if (!Sys_remove(path))
@@ -27,6 +27,8 @@ static cvar_t qtv_password       = {"qtv_password",         ""};
 static cvar_t qtv_pendingtimeout = {"qtv_pendingtimeout",  "5"}; // 5  seconds must be enough
 static cvar_t qtv_sayenabled     = {"qtv_sayenabled",      "0"}; // allow mod to override GameStarted() logic
 cvar_t qtv_streamtimeout         = {"qtv_streamtimeout",  "45"}; // 45 seconds
+cvar_t qtv_streamlag             = {"qtv_streamlag",       "1"}; // 0 drop a lagging stream, 1 skip it forward to live
+cvar_t qtv_streambacklog         = {"qtv_streambacklog", "256"}; // KB a stream may fall behind
 
 static unsigned short int	listenport		= 0;
 static double				warned_time		= 0;
@@ -66,6 +68,7 @@ static mvddest_t *SV_InitStream (int socket1, netadr_t na, char *userinfo)
 	dst->socket = socket1;
 	dst->maxcachesize = 65536;	//is this too small?
 	dst->cache = (char *) Q_malloc(dst->maxcachesize);
+	DestStreamAttach(dst);
 	dst->io_time = Sys_DoubleTime();
 	dst->id = ++lastdest;
 	dst->na = na;
@@ -91,6 +94,7 @@ static void SV_MVD_InitPendingStream (int socket1, netadr_t na, qbool must_be_qi
 	dst->io_time = Sys_DoubleTime();
 	dst->na = na;
 	dst->must_be_qizmo_tcp_connect = must_be_qizmo_tcp_connect;
+	NET_EventAdd(socket1);
 
 	strlcpy(dst->challenge, NET_AdrToString(dst->na), sizeof(dst->challenge));
 	for (i = strlen(dst->challenge); i < sizeof(dst->challenge)-1; i++)
@@ -243,7 +247,10 @@ void SV_MVD_RunPendingConnections (void)
 		np = demo.pendingdest->nextdest;
 
 		if (demo.pendingdest->socket != -1)
+		{
+			NET_EventDel(demo.pendingdest->socket);
 			closesocket(demo.pendingdest->socket);
+		}
 		Q_free(demo.pendingdest);
 		demo.pendingdest = np;
 	}
@@ -254,7 +261,10 @@ void SV_MVD_RunPendingConnections (void)
 		{
 			np = p->nextdest->nextdest;
 			if (p->nextdest->socket != -1)
+			{
+				NET_EventDel(p->nextdest->socket);
 				closesocket(p->nextdest->socket);
+			}
 			Q_free(p->nextdest);
 			p->nextdest = np;
 		}
@@ -1283,7 +1293,6 @@ void DemoWriteQTVTimePad (int msecs)	//broadcast to all proxies
 //broadcast to all proxies
 void DemoWriteQTV (sizebuf_t *msg)
 {
-	mvddest_t		*d;
 	sizebuf_t		mvdheader;
 	byte			mvdheader_buf[6];
 
@@ -1296,14 +1305,8 @@ void DemoWriteQTV (sizebuf_t *msg)
 	//length
 	MSG_WriteLong (&mvdheader, msg->cursize);
 
-	for (d = demo.dest; d; d = d->nextdest)
-	{
-		if (d->desttype == DEST_STREAM)
-		{
-			DemoWriteDest(mvdheader.data, mvdheader.cursize, d);
-			DemoWriteDest(msg->data, msg->cursize, d);
-		}
-	}
+	DemoWriteStreams(mvdheader.data, mvdheader.cursize);
+	DemoWriteStreams(msg->data, msg->cursize);
 }
 
 void Qtv_List_f(void)
@@ -1345,6 +1348,23 @@ void QTV_Streams_List (void)
 	}
 }
 
+// Returns the number of QTV streams, users are summed up across them.
+int QTV_Streams_Count (int *users)
+{
+	mvddest_t *dst;
+	int streams = 0;
+
+	*users = 0;
+	for (dst = demo.dest; dst; dst = dst->nextdest) {
+		if (dst->desttype == DEST_STREAM) {
+			streams++;
+			*users += QTVsv_UsersCount (dst);
+		}
+	}
+
+	return streams;
+}
+
 // Expose user list to disconnected clients.
 void QTV_Streams_UserList (void)
 {
@@ -1422,6 +1442,18 @@ void Qtv_Status_f(void)
 		cnt++;
 
 	Con_Printf ("Pending streams: %d\n", cnt);
+
+	for (cnt = 0, d = demo.dest; d; d = d->nextdest)
+	{
+		if (d->desttype != DEST_STREAM)
+			continue;
+
+		if (!cnt++)
+			Con_Printf ("%4.4s %8.8s %6.6s %5.5s %10.10s %s\n", "#Id", "Backlog", "Lag", "Skips", "Sent", "Addr");
+
+		Con_Printf ("%4d %8d %5.1fs %5d %10u %s%s\n", d->id, DestBacklog(d), DestLag(d), d->skips, d->totalsize,
+					NET_AdrToString(d->na), d->skipping ? " (skipping)" : "");
+	}
 }
 
 //====================================
@@ -1433,6 +1465,8 @@ void SV_QTV_Init(void)
 	Cvar_Register (&qtv_password);
 	Cvar_Register (&qtv_pendingtimeout);
 	Cvar_Register (&qtv_streamtimeout);
+	Cvar_Register (&qtv_streamlag);
+	Cvar_Register (&qtv_streambacklog);
 	Cvar_Register (&qtv_sayenabled);
 
 	Cmd_AddCommand ("qtv_list", Qtv_List_f);
@@ -27,8 +27,11 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 // because there can be a lot of nails, there is a special
 // network protocol for them
 #define MAX_NAILS 32
-static edict_t *nails[MAX_NAILS];
-static int numnails;
+typedef struct
+{
+	edict_t	*ents[MAX_NAILS];
+	int		num;
+} nails_t;
 static int nailcount = 0;
 
 extern	int sv_nailmodel, sv_supernailmodel, sv_playermodel;
@@ -38,7 +41,7 @@ cvar_t	sv_nailhack	= {"sv_nailhack", "1"};
 // Maximum packet we will send - currently 256 if extension supported
 #define MAX_PACKETENTITIES_POSSIBLE 256
 
-static qbool SV_AddNailUpdate (edict_t *ent)
+static qbool SV_AddNailUpdate (nails_t *nails, edict_t *ent)
 {
 	if ((int)sv_nailhack.value)
 		return false;
@@ -49,22 +52,21 @@ static qbool SV_AddNailUpdate (edict_t *ent)
 	if (msg_coordsize != 2)
 		return false; // Do not allow nailhack in case of sv_bigcoords.
 
-	if (numnails == MAX_NAILS)
+	if (nails->num == MAX_NAILS)
 		return true;
 
-	nails[numnails] = ent;
-	numnails++;
+	nails->ents[nails->num++] = ent;
 	return true;
 }
 
-static void SV_EmitNailUpdate (sizebuf_t *msg, qbool recorder)
+static void SV_EmitNailUpdate (nails_t *nails, sizebuf_t *msg, qbool recorder)
 {
 	int x, y, z, p, yaw, n, i;
 	byte bits[6]; // [48 bits] xyzpy 12 12 12 4 8
 	edict_t *ent;
 
 
-	if (!numnails)
+	if (!nails->num)
 		return;
 
 	if (recorder)
@@ -72,11 +74,11 @@ static void SV_EmitNailUpdate (sizebuf_t *msg, qbool recorder)
 	else
 		MSG_WriteByte (msg, svc_nails);
 
-	MSG_WriteByte (msg, numnails);
+	MSG_WriteByte (msg, nails->num);
 
-	for (n=0 ; n<numnails ; n++)
+	for (n=0 ; n<nails->num ; n++)
 	{
-		ent = nails[n];
+		ent = nails->ents[n];
 		if (recorder)
 		{
 			if (!ent->v.colormap)
@@ -285,6 +287,141 @@ void SV_WriteDelta(client_t* client, entity_state_t *from, entity_state_t *to, s
 	}
 }
 
+/*
+=============================================================================
+
+Delta encoding cache
+
+The bytes SV_WriteDelta produces only depend on the two states, the force
+flag and the client's protocol extensions, and many clients send the same
+deltas in a frame (from the baseline, or from the same acked state).  The
+encoded bytes are kept in a table for the frame and copied on a hit.
+Slots are claimed with a compare-and-swap so several threads may use it.
+
+=============================================================================
+*/
+
+cvar_t	sv_deltacache = {"sv_deltacache", "1"};
+
+#define DELTACACHE_SIZE		8192	// must be a power of two
+#define DELTACACHE_PROBES	8
+#define MAX_DELTA_BYTES		40		// SV_WriteDelta never writes more
+
+#define DC_FILLING			1
+#define DC_READY			2
+
+typedef struct
+{
+	volatile int	state;		// deltacache_frame << 2 | DC_FILLING or DC_READY
+	qbool			force;
+	unsigned int	fte_extensions;
+	unsigned int	mvd_extensions;
+	entity_state_t	from, to;
+	int				len;
+	byte			data[MAX_DELTA_BYTES];
+} deltacache_t;
+
+static deltacache_t	deltacache[DELTACACHE_SIZE];
+static int			deltacache_frame;
+
+static unsigned int SV_DeltaHash (const entity_state_t *from, const entity_state_t *to)
+{
+	const int *f = (const int *)from->origin, *t = (const int *)to->origin;
+	unsigned int h = to->number * 2654435761u;
+
+	h = (h ^ f[0] ^ (f[1] << 7) ^ (f[2] << 13)) * 2246822519u;
+	h = (h ^ t[0] ^ (t[1] << 7) ^ (t[2] << 13)) * 3266489917u;
+	h ^= (from->frame << 3) ^ (to->frame << 11) ^ (to->modelindex << 19);
+	return h ^ (h >> 15);
+}
+
+/*
+==================
+SV_WriteDeltaCached
+
+SV_WriteDelta through the cache, counts hits and misses in *hits / *misses
+==================
+*/
+static void SV_WriteDeltaCached (client_t *client, entity_state_t *from, entity_state_t *to, sizebuf_t *msg, qbool force, int *hits, int *misses)
+{
+	unsigned int hash, fte_extensions = 0;
+	int i, state, filling, ready, start;
+	deltacache_t *dc;
+
+	// the cases where SV_WriteDelta does more than write bytes
+	if (!(int)sv_deltacache.value || msg->cursize + MAX_DELTA_BYTES > msg->maxsize
+		|| to->number <= 0 || to->number >= sv.max_edicts)
+	{
+		SV_WriteDelta (client, from, to, msg, force);
+		return;
+	}
+
+#ifdef PROTOCOL_VERSION_FTE
+	fte_extensions = client->fteprotocolextensions;
+#endif
+	filling = (deltacache_frame << 2) | DC_FILLING;
+	ready = (deltacache_frame << 2) | DC_READY;
+	hash = SV_DeltaHash (from, to);
+
+	for (i = 0; i < DELTACACHE_PROBES; i++)
+	{
+		dc = &deltacache[(hash + i) & (DELTACACHE_SIZE - 1)];
+		state = dc->state;
+
+		if (state == ready)
+		{
+			Sys_MemoryBarrier ();
+			if (dc->force == force && dc->fte_extensions == fte_extensions
+				&& dc->mvd_extensions == client->mvdprotocolextensions1
+				&& !memcmp (&dc->to, to, sizeof(*to)) && !memcmp (&dc->from, from, sizeof(*from)))
+			{
+				SZ_Write (msg, dc->data, dc->len);
+				(*hits)++;
+				return;
+			}
+			continue;
+		}
+
+		if (state == filling || !Sys_AtomicCas (&dc->state, state, filling))
+			continue; // being filled by another thread
+
+		// left from an older frame or empty, encode into it
+		dc->force = force;
+		dc->fte_extensions = fte_extensions;
+		dc->mvd_extensions = client->mvdprotocolextensions1;
+		dc->from = *from;
+		dc->to = *to;
+
+		start = msg->cursize;
+		SV_WriteDelta (client, from, to, msg, force);
+		dc->len = msg->cursize - start;
+		memcpy (dc->data, msg->data + start, dc->len);
+
+		Sys_AtomicCas (&dc->state, filling, ready);
+		(*misses)++;
+		return;
+	}
+
+	SV_WriteDelta (client, from, to, msg, force);
+	(*misses)++;
+}
+
+/*
+==================
+SV_ClearDeltaCache
+
+Called once per frame before any entities are written
+==================
+*/
+static void SV_ClearDeltaCache (void)
+{
+	// entries of older frames count as free, 0 is never used so the
+	// zeroed table starts out empty
+	deltacache_frame = (deltacache_frame + 1) & 0x0fffffff;
+	if (!deltacache_frame)
+		deltacache_frame = 1;
+}
+
 /*
 =============
 SV_EmitPacketEntities
@@ -299,6 +436,7 @@ static void SV_EmitPacketEntities (client_t *client, packet_entities_t *to, size
 	client_frame_t	*fromframe;
 	packet_entities_t *from1;
 	edict_t	*ent;
+	int hits = 0, misses = 0;
 
 	// this is the frame that we are going to delta update from
 	if (client->delta_sequence != -1)
@@ -330,7 +468,7 @@ static void SV_EmitPacketEntities (client_t *client, packet_entities_t *to, size
 		if (newnum == oldnum)
 		{	// delta update from old position
 			//Con_Printf ("delta %i\n", newnum);
-			SV_WriteDelta (client, &from1->entities[oldindex], &to->entities[newindex], msg, false);
+			SV_WriteDeltaCached (client, &from1->entities[oldindex], &to->entities[newindex], msg, false, &hits, &misses);
 			oldindex++;
 			newindex++;
 			continue;
@@ -349,7 +487,7 @@ static void SV_EmitPacketEntities (client_t *client, packet_entities_t *to, size
 			}
 			ent = EDICT_NUM(newnum);
 			//Con_Printf ("baseline %i\n", newnum);
-			SV_WriteDelta (client, &ent->e->baseline, &to->entities[newindex], msg, true);
+			SV_WriteDeltaCached (client, &ent->e->baseline, &to->entities[newindex], msg, true, &hits, &misses);
 			newindex++;
 			continue;
 		}
@@ -383,6 +521,11 @@ static void SV_EmitPacketEntities (client_t *client, packet_entities_t *to, size
 	}
 
 	MSG_WriteShort (msg, 0);	// end of packetentities
+
+	if (hits)
+		Sys_AtomicAdd (&svs.stats.delta_hits, hits);
+	if (misses)
+		Sys_AtomicAdd (&svs.stats.delta_misses, misses);
 }
 
 static int TranslateEffects (edict_t *ent)
@@ -532,7 +675,7 @@ static void SV_WritePlayersToClient (client_t *client, client_frame_t *frame, by
 
 		if (fofs_visibility) {
 			// Presume not visible
-			((eval_t *)((byte *)&(cl->edict)->v + fofs_visibility))->_int &= ~(1 << (client - svs.clients));
+			Sys_AtomicAnd (&((eval_t *)((byte *)&(cl->edict)->v + fofs_visibility))->_int, ~(1 << (client - svs.clients)));
 		}
 
 		if (cl->state != cs_spawned)
@@ -562,7 +705,7 @@ static void SV_WritePlayersToClient (client_t *client, client_frame_t *frame, by
 
 		if (fofs_visibility) {
 			// Update flags so mods can tell what was visible
-			((eval_t *)((byte *)&(ent)->v + fofs_visibility))->_int |= (1 << (client - svs.clients));
+			Sys_AtomicOr (&((eval_t *)((byte *)&(ent)->v + fofs_visibility))->_int, (1 << (client - svs.clients)));
 		}
 
 		if (j == hideent - 1)
@@ -763,6 +906,111 @@ qbool SV_EntityVisibleToClient (client_t* client, int e, byte* pvs)
 	return true;
 }
 
+/*
+=============================================================================
+
+Per-frame visibility cache
+
+Clients whose fat PVS is made of the same leafs (spectators tracking the
+same player, for instance) see exactly the same set of entities, so the PVS
+and the SV_EntityVisibleToClient results are computed once per frame and
+shared.  hideentity and the packet entity limits are still applied per client.
+
+=============================================================================
+*/
+
+cvar_t	sv_viscache = {"sv_viscache", "1"};
+
+#define MAX_VISCACHE		MAX_CLIENTS
+#define MAX_VISCACHE_LEAFS	16
+
+typedef struct
+{
+	volatile qbool	ready;
+	int				numleafs;
+	int				leafs[MAX_VISCACHE_LEAFS];
+	byte			pvs[MAX_MAP_LEAFS/8];
+	byte			visible[MAX_EDICTS/8];
+} viscache_t;
+
+static viscache_t	viscache[MAX_VISCACHE];
+static int			viscache_count;
+static sys_mutex_t	*viscache_lock;
+
+/*
+=============
+SV_ClearEntityCaches
+
+Called before building the client messages of a frame, and again
+whenever game code ran in between, since edicts may have changed
+=============
+*/
+void SV_ClearEntityCaches (void)
+{
+	if (!viscache_lock)
+		viscache_lock = Sys_MutexCreate ();
+
+	viscache_count = 0;
+	SV_ClearDeltaCache ();
+}
+
+/*
+=============
+SV_VisCacheForOrigin
+
+Returns NULL if the cache can't be used, the caller then does it the old way
+=============
+*/
+static viscache_t *SV_VisCacheForOrigin (client_t *client, vec3_t org)
+{
+	int leafs[MAX_VISCACHE_LEAFS], numleafs, i, e;
+	viscache_t *vc = NULL;
+
+	if (!(int)sv_viscache.value || !viscache_lock)
+		return NULL;
+
+	numleafs = CM_FatPVSLeafs (org, leafs, MAX_VISCACHE_LEAFS);
+	if (numleafs < 0)
+		return NULL;
+
+	Sys_MutexLock (viscache_lock);
+	for (i = 0; i < viscache_count; i++)
+	{
+		if (viscache[i].ready && viscache[i].numleafs == numleafs
+			&& !memcmp (viscache[i].leafs, leafs, numleafs * sizeof(leafs[0])))
+		{
+			Sys_MutexUnlock (viscache_lock);
+			return &viscache[i];
+		}
+	}
+	if (viscache_count < MAX_VISCACHE)
+	{
+		vc = &viscache[viscache_count++];
+		vc->ready = false;
+	}
+	Sys_MutexUnlock (viscache_lock);
+
+	if (!vc)
+		return NULL;
+
+	// fill it outside the lock, two threads may build the same entry
+	// at worst, which is harmless
+	vc->numleafs = numleafs;
+	memcpy (vc->leafs, leafs, numleafs * sizeof(leafs[0]));
+	CM_LeafsPVS (leafs, numleafs, vc->pvs);
+
+	memset (vc->visible, 0, sizeof(vc->visible));
+	for (e = pr_nqprogs ? 1 : MAX_CLIENTS + 1; e < sv.num_edicts; e++)
+		if (SV_EntityVisibleToClient (client, e, vc->pvs))
+			vc->visible[e >> 3] |= 1 << (e & 7);
+
+	Sys_MutexLock (viscache_lock);
+	vc->ready = true;
+	Sys_MutexUnlock (viscache_lock);
+
+	return vc;
+}
+
 /*
 =============
 SV_WriteEntitiesToClient
@@ -771,6 +1019,10 @@ Encodes the current state of the world as
 a svc_packetentities messages and possibly
 a svc_nails message and
 svc_playerinfo messages
+
+For normal clients this only writes to the client's own frame and msg
+(plus atomic visibility bits), so SV_SendClientMessages may run it for
+several clients at once.  NQ progs muzzleflashes are the exception.
 =============
 */
 
@@ -783,6 +1035,9 @@ void SV_WriteEntitiesToClient (client_t *client, sizebuf_t *msg, qbool recorder)
 	entity_state_t *state;
 	edict_t *ent;
 	byte *pvs;
+	byte fatpvs[MAX_MAP_LEAFS/8];
+	viscache_t *vc = NULL;
+	nails_t nails;
 	int hideent;
 	unsigned int client_flag = (1 << (client - svs.clients));
 	edict_t	*clent = client->edict;
@@ -836,7 +1091,9 @@ void SV_WriteEntitiesToClient (client_t *client, sizebuf_t *msg, qbool recorder)
 			VectorAdd (client->edict->v.origin, client->edict->v.view_ofs, org);
 		}
 
-		pvs = CM_FatPVS (org); // search some PVS
+		// search some PVS
+		vc = SV_VisCacheForOrigin (client, org);
+		pvs = vc ? vc->pvs : CM_FatPVSToBuffer (org, fatpvs);
 		max_packet_entities = (client->fteprotocolextensions & FTE_PEXT_256PACKETENTITIES) ? MAX_PEXT256_PACKET_ENTITIES : MAX_PACKET_ENTITIES;
 
 		if (client->disable_updates_stop > realtime)
@@ -865,7 +1122,7 @@ void SV_WriteEntitiesToClient (client_t *client, sizebuf_t *msg, qbool recorder)
 	pack = &frame->entities;
 	pack->num_entities = 0;
 
-	numnails = 0;
+	nails.num = 0;
 
 	if (!disable_updates)
 	{// Vladis, server flash
@@ -876,23 +1133,23 @@ void SV_WriteEntitiesToClient (client_t *client, sizebuf_t *msg, qbool recorder)
 
 		for (e = pr_nqprogs ? 1 : MAX_CLIENTS + 1, ent = EDICT_NUM(e); e < sv.num_edicts; e++, ent = NEXT_EDICT(ent))
 		{
-			if (!SV_EntityVisibleToClient(client, e, pvs)) {
+			if (vc ? !(vc->visible[e >> 3] & (1 << (e & 7))) : !SV_EntityVisibleToClient(client, e, pvs)) {
 				if (fofs_visibility) {
-					((eval_t *)((byte *)&(ent)->v + fofs_visibility))->_int &= ~client_flag;
+					Sys_AtomicAnd (&((eval_t *)((byte *)&(ent)->v + fofs_visibility))->_int, ~client_flag);
 				}
 				continue;
 			}
 
 			if (fofs_visibility) {
 				// Don't include other filters in logic for setting this field
-				((eval_t *)((byte *)&(ent)->v + fofs_visibility))->_int |= (1 << (client - svs.clients));
+				Sys_AtomicOr (&((eval_t *)((byte *)&(ent)->v + fofs_visibility))->_int, client_flag);
 			}
 
 			if (e == hideent) {
 				continue;
 			}
 
-			if (SV_AddNailUpdate (ent))
+			if (SV_AddNailUpdate (&nails, ent))
 				continue; // added to the special update list
 
 			if (clent) {
@@ -958,7 +1215,7 @@ void SV_WriteEntitiesToClient (client_t *client, sizebuf_t *msg, qbool recorder)
 	SV_EmitPacketEntities (client, pack, msg);
 
 	// now add the specialized nail update
-	SV_EmitNailUpdate (msg, recorder);
+	SV_EmitNailUpdate (&nails, msg, recorder);
 
 	// Translate NQ progs' EF_MUZZLEFLASH to svc_muzzleflash
 	if (pr_nqprogs)
@@ -997,12 +1254,14 @@ void SV_SetVisibleEntitiesForBot (client_t* client)
 	unsigned int client_flag = 1 << (client - svs.clients);
 	vec3_t org;
 	byte* pvs = NULL;
+	viscache_t *vc;
 
 	if (!fofs_visibility)
 		return;
 
 	VectorAdd (client->edict->v.origin, client->edict->v.view_ofs, org);
-	pvs = CM_FatPVS (org); // search some PVS
+	vc = SV_VisCacheForOrigin (client, org);
+	pvs = vc ? vc->pvs : CM_FatPVS (org); // search some PVS
 
 	// players first
 	for (j = 0; j < MAX_CLIENTS; j++)
@@ -1020,7 +1279,7 @@ void SV_SetVisibleEntitiesForBot (client_t* client)
 	{
 		edict_t* ent = EDICT_NUM (e);
 
-		if (SV_EntityVisibleToClient(client, e, pvs)) {
+		if (vc ? (vc->visible[e >> 3] & (1 << (e & 7))) : SV_EntityVisibleToClient(client, e, pvs)) {
 			((eval_t *)((byte *)&(ent)->v + fofs_visibility))->_int |= client_flag;
 		}
 		else {
@@ -122,6 +122,8 @@ cvar_t	sv_unfake = {"sv_unfake", "1"}; //bliP: 24/9 kickfake to unfake
 cvar_t	sv_kicktop = {"sv_kicktop", "1"};
 
 cvar_t	sv_allowlastscores = {"sv_allowlastscores", "1"};
+cvar_t	sv_allowmetrics = {"sv_allowmetrics", "0"};	// 1 - local addresses only, 2 - anyone
+cvar_t	sv_metricslim = {"sv_metricslim", "20"};	// "metrics" queries per second, 0 - unlimited
 
 cvar_t	sv_maxlogsize = {"sv_maxlogsize", "0"};
 //bliP: 24/9 ->
@@ -178,6 +180,9 @@ cvar_t registered = {"registered", "1", CVAR_ROM};
 
 cvar_t	sv_halflifebsp = {"halflifebsp", "0", CVAR_ROM};
 cvar_t  sv_bspversion = {"sv_bspversion", "1", CVAR_ROM};
+cvar_t	sv_phsthreads = {"sv_phsthreads", "0"};	// extra threads building the PHS at map load
+cvar_t	sv_phscache = {"sv_phscache", "1"};	// keep PHS of big maps in maps/<map>.phs
+cvar_t	sv_mapcache = {"sv_mapcache", "1"};	// keep prepared maps in maps/<map>.cmc
 
 // If set, don't send broadcast messages, entities or player info to ServeMe bot
 cvar_t sv_serveme_fix = { "sv_serveme_fix", "1", CVAR_ROM };
@@ -232,6 +237,7 @@ void SV_Shutdown (char *finalmsg)
 	}
 	if (sv.mvdrecording)
 		SV_MVDStop_f();
+	DemoWriter_Sync ();
 
 #ifndef SERVER_ONLY
 	NET_CloseServer ();
@@ -543,6 +549,130 @@ int SV_GenerateUserID (void)
 /*
 ==============================================================================
 
+CLIENT LOOKUP BY ADDRESS AND QPORT
+
+Open addressing hash of client numbers keyed on base address (without port) and qport,
+so SV_ReadPackets() does not need to scan all clients for every packet.
+Port is not part of the key, so "fixing up a translated port" does not need rehash.
+Entries are added on connect. Zombies must still get their packets,
+so entries are not removed on drop but retired lazily once slot became cs_free,
+lookup validates every candidate against actual client state anyway.
+
+==============================================================================
+*/
+
+#define CLIENTHASH_SIZE		(MAX_CLIENTS * 4) // must be a power of two
+#define CLIENTHASH_EMPTY	0
+#define CLIENTHASH_DELETED	-1
+
+static int	clienthash[CLIENTHASH_SIZE];		// client number + 1, or CLIENTHASH_EMPTY/CLIENTHASH_DELETED
+static int	clienthash_pos[MAX_CLIENTS];		// where client is stored in clienthash + 1, 0 if not stored
+static int	clienthash_deleted;				// count of CLIENTHASH_DELETED slots
+
+static unsigned int SV_ClientHashKey (netadr_t adr, int qport)
+{
+	unsigned int key;
+
+	key = ((unsigned int)adr.ip[0] << 24) | ((unsigned int)adr.ip[1] << 16) | ((unsigned int)adr.ip[2] << 8) | adr.ip[3];
+	key ^= (unsigned int)qport * 0x9E3779B1;
+	key *= 0x85EBCA6B;
+	key ^= key >> 16;
+
+	return key & (CLIENTHASH_SIZE - 1);
+}
+
+static void SV_ClientHashRemove (client_t *cl)
+{
+	int num = cl - svs.clients;
+
+	if (!clienthash_pos[num])
+		return;
+
+	clienthash[clienthash_pos[num] - 1] = CLIENTHASH_DELETED;
+	clienthash_pos[num] = 0;
+	clienthash_deleted++;
+}
+
+static void SV_ClientHashInsert (client_t *cl)
+{
+	int num = cl - svs.clients;
+	unsigned int pos = SV_ClientHashKey(cl->netchan.remote_address, cl->netchan.qport);
+
+	// table never gets full, there is four times more slots than clients and each client has at most one slot
+	while (clienthash[pos] > 0)
+		pos = (pos + 1) & (CLIENTHASH_SIZE - 1);
+
+	if (clienthash[pos] == CLIENTHASH_DELETED)
+		clienthash_deleted--;
+
+	clienthash[pos] = num + 1;
+	clienthash_pos[num] = pos + 1;
+}
+
+static void SV_ClientHashRebuild (void)
+{
+	client_t *cl;
+	int i;
+
+	memset(clienthash, 0, sizeof(clienthash));
+	memset(clienthash_pos, 0, sizeof(clienthash_pos));
+	clienthash_deleted = 0;
+
+	for (i = 0, cl = svs.clients; i < MAX_CLIENTS; i++, cl++)
+	{
+		if (cl->state == cs_free)
+			continue;
+#ifdef USE_PR2
+		if (cl->isBot)
+			continue;
+#endif
+		SV_ClientHashInsert(cl);
+	}
+}
+
+// (re)add client, must be called once netchan is set up
+static void SV_ClientHashAdd (client_t *cl)
+{
+	SV_ClientHashRemove(cl);
+
+	// too many deleted slots makes lookups longer, start from scratch then
+	if (clienthash_deleted > CLIENTHASH_SIZE / 2)
+		SV_ClientHashRebuild();
+
+	if (!clienthash_pos[cl - svs.clients])
+		SV_ClientHashInsert(cl);
+}
+
+// return client which sent packet from adr with given qport, NULL if there is none
+static client_t *SV_ClientHashFind (netadr_t adr, int qport)
+{
+	unsigned int pos = SV_ClientHashKey(adr, qport);
+	client_t *cl;
+	int i;
+
+	for (i = 0; i < CLIENTHASH_SIZE && clienthash[pos] != CLIENTHASH_EMPTY; i++, pos = (pos + 1) & (CLIENTHASH_SIZE - 1))
+	{
+		if (clienthash[pos] == CLIENTHASH_DELETED)
+			continue;
+
+		cl = &svs.clients[clienthash[pos] - 1];
+
+		if (cl->state == cs_free)
+		{
+			SV_ClientHashRemove(cl); // slot was freed since, retire it
+			continue;
+		}
+
+		if (cl->netchan.qport == qport && NET_CompareBaseAdr (adr, cl->netchan.remote_address))
+			return cl;
+	}
+
+	return NULL;
+}
+
+/*
+==============================================================================
+
 CONNECTIONLESS COMMANDS
 
 ==============================================================================
@@ -575,6 +705,7 @@ This message can be up to around 5k with worst case string lengths.
 #define STATUS_SPECTATORS_AS_PLAYERS    8 //for ASE - change only frags: show as "S"
 #define STATUS_SHOWTEAMS                16
 #define STATUS_SHOWQTV                  32
+#define STATUS_SHOWPHASES               64 //frame phase timings: "phase <name> <count> <p50> <p99> <max>" in usec
 
 static void SVC_Status (void)
 {
@@ -630,6 +761,11 @@ static void SVC_Status (void)
 
 	if (opt & STATUS_SHOWQTV)
 		QTV_Streams_List ();
+
+	if (opt & STATUS_SHOWPHASES)
+		for (i = 0; i < SVPHASE_MAX; i++)
+			Con_Printf ("phase %s %u %u %u %u\n", sv_phasenames[i], svs.stats.phases[i].total,
+			            SV_PhasePercentile (i, 0.5), SV_PhasePercentile (i, 0.99), svs.stats.phases[i].max);
 	SV_EndRedirect ();
 }
 
@@ -1341,6 +1477,8 @@ static void SVC_DirectConnect (void)
 
 	newcl->state = cs_preconnected;
 
+	SV_ClientHashAdd (newcl);
+
 	newcl->datagram.allowoverflow = true;
 	newcl->datagram.data = newcl->datagram_buf;
 	newcl->datagram.maxsize = sizeof(newcl->datagram_buf);
@@ -1430,58 +1568,64 @@ static int char2int (int c)
 	return 0;
 }
 /*
- * rcon_bandlim() - check for rcon requests bandwidth limit
+ * SV_BandLim() - check for connectionless requests bandwidth limit
  *
  *      From kernel of the FreeBSD 4.10 release:
  *      sys/netinet/ip_icmp.c(846): int badport_bandlim(int which);
  *
- *	Return false if it is ok to check rcon_password, true if we have
- *	hit our bandwidth limit and it is not ok.
+ *	Return false if it is ok to answer the request, true if we have
+ *	hit our bandwidth limit and it is not ok.  lticks and lpackets keep
+ *	the state of one limiter, each request type passes its own.
  *
- *	If sv_rconlim.value is <= 0, the feature is disabled and false is returned.
+ *	If limit is <= 0, the feature is disabled and false is returned.
  *
  *	Note that the printing of the error message is delayed so we can
- *	properly print the rcon limit error rate that the system was trying to do
+ *	properly print the limit error rate that the system was trying to do
  *	(i.e. 22000/100 rcon pps, etc...).  This can cause long delays in printing
  *	the 'final' error, but it doesn't make sense to solve the printing
  *	delay with more complex code.
  */
-static qbool rcon_bandlim (void)
+static qbool SV_BandLim (double *lticks, int *lpackets, int limit, const char *what)
 {
-	static double lticks = 0;
-	static int lpackets = 0;
-
 	/*
 	 * Return ok status if feature disabled or argument out of
 	 * ranage.
 	 */
 
-	if ((int)sv_rconlim.value <= 0)
+	if (limit <= 0)
 		return false;
 
 	/*
 	 * reset stats when cumulative dt exceeds one second.
 	 */
 
-	if (realtime - lticks > 1.0)
+	if (realtime - *lticks > 1.0)
 	{
-		if (lpackets > (int)sv_rconlim.value)
-			Sys_Printf("WARNING: Limiting rcon response from %d to %d rcon pequests per second from %s\n",
-			           lpackets, (int)sv_rconlim.value, NET_AdrToString(net_from));
-		lticks = realtime;
-		lpackets = 0;
+		if (*lpackets > limit)
+			Sys_Printf("WARNING: Limiting %s response from %d to %d %s requests per second from %s\n",
+			           what, *lpackets, limit, what, NET_AdrToString(net_from));
+		*lticks = realtime;
+		*lpackets = 0;
 	}
 
 	/*
 	 * bump packet count
 	 */
 
-	if (++lpackets > (int)sv_rconlim.value)
+	if (++*lpackets > limit)
 		return true;
 
 	return false;
 }
 
+static qbool rcon_bandlim (void)
+{
+	static double lticks = 0;
+	static int lpackets = 0;
+
+	return SV_BandLim (&lticks, &lpackets, (int)sv_rconlim.value, "rcon");
+}
+
 //bliP: master rcon/logging ->
 int Rcon_Validate (char *client_string, char *password1)
 {
@@ -1814,6 +1958,92 @@ static void SVC_IP(void)
 }
 
 
+/*
+=================
+SVC_Metrics
+
+Responds with server internals for monitoring scripts, one record per
+line, each record is a name followed by key=value pairs:
+
+server uptime=<sec> map=<name> clients=<n> paused=<0|1>
+packets total=<n> connectionless=<n> filtered=<n> game=<n/frame> metricslimited=<n>
+phase name=<phase> count=<n> p50=<usec> p99=<usec> max=<usec>
+demo recording=<0|1> dests=<n>
+dest id=<n> type=<file|bufferedfile|stream> used=<bytes> size=<bytes> total=<bytes>
+tracecache hits=<n> misses=<n> (world traces over the last STATFRAMES frames)
+qtv streams=<n> users=<n>
+client id=<userid> state=<n> spec=<0|1> ping=<ms> loss=<%> choke=<n> rate=<bytes/s> backbuf=<n>
+
+Off by default, sv_allowmetrics 1 answers local addresses only and 2
+answers anyone.
+=================
+*/
+static void SVC_Metrics (void)
+{
+	static double lticks = 0;
+	static int lpackets = 0;
+	static const char *desttypes[] = {"none", "file", "bufferedfile", "stream"};
+	int i, clients, streams, users, queued;
+	unsigned int stalls;
+	mvddest_t *d;
+	client_t *cl;
+
+	if (!(int)sv_allowmetrics.value)
+		return;
+
+	// the reply is much bigger than the query, only answer the box itself
+	// unless told otherwise
+	if ((int)sv_allowmetrics.value == 1 && !NET_IsLocalAddress (net_from))
+		return;
+
+	if (SV_BandLim (&lticks, &lpackets, (int)sv_metricslim.value, "metrics"))
+	{
+		svs.stats.metrics_limited++;
+		return;
+	}
+
+	for (i = clients = 0, cl = svs.clients; i < MAX_CLIENTS; i++, cl++)
+		if (cl->state != cs_free)
+			clients++;
+
+	SV_BeginRedirect (RD_PACKET);
+
+	Con_Printf ("server uptime=%i map=%s clients=%i paused=%i\n",
+	            (int)realtime, sv.mapname, clients, sv.paused ? 1 : 0);
+	Con_Printf ("packets total=%u connectionless=%u filtered=%u game=%.2f metricslimited=%u\n",
+	            svs.stats.total_packets, svs.stats.connectionless_packets, svs.stats.filtered_packets,
+	            (float)svs.stats.latched_packets / STATFRAMES, svs.stats.metrics_limited);
+
+	for (i = 0; i < SVPHASE_MAX; i++)
+		Con_Printf ("phase name=%s count=%u p50=%u p99=%u max=%u\n", sv_phasenames[i], svs.stats.phases[i].total,
+		            SV_PhasePercentile (i, 0.5), SV_PhasePercentile (i, 0.99), svs.stats.phases[i].max);
+
+	for (i = 0, d = demo.dest; d; d = d->nextdest)
+		i++;
+	queued = DemoWriter_Queued (&stalls);
+	Con_Printf ("demo recording=%i dests=%i writerqueue=%i writerstalls=%u\n", sv.mvdrecording ? 1 : 0, i, queued, stalls);
+	for (d = demo.dest; d; d = d->nextdest)
+		Con_Printf ("dest id=%i type=%s used=%i size=%i total=%u skips=%i\n", d->id, desttypes[d->desttype],
+		            DestBacklog (d), d->maxcachesize, d->totalsize, d->skips);
+
+	Con_Printf ("tracecache hits=%i misses=%i\n", svs.stats.latched_trace_hits, svs.stats.latched_trace_misses);
+
+	streams = QTV_Streams_Count (&users);
+	Con_Printf ("qtv streams=%i users=%i\n", streams, users);
+
+	for (i = 0, cl = svs.clients; i < MAX_CLIENTS; i++, cl++)
+	{
+		if (cl->state == cs_free)
+			continue;
+
+		Con_Printf ("client id=%i state=%i spec=%i ping=%i loss=%i choke=%i rate=%i backbuf=%i\n",
+		            cl->userid, (int)cl->state, cl->spectator ? 1 : 0, SV_CalcPing (cl), cl->lossage,
+		            cl->totalchokes, cl->netchan.rate > 0 ? (int)(1.0 / cl->netchan.rate) : 0, cl->num_backbuf);
+	}
+
+	SV_EndRedirect ();
+}
+
 /*
 =================
 SV_ConnectionlessPacket
@@ -1871,6 +2101,8 @@ static void SV_ConnectionlessPacket (void)
 		SVC_DemoListRegex ();
 	else if (!strcmp(c,"qtvusers"))
 		SVC_QTVUsers ();
+	else if (!strcmp(c,"metrics"))
+		SVC_Metrics ();
 	else
 		Con_Printf ("bad connectionless packet from %s:\n%s\n"
 		            , NET_AdrToString (net_from), s);
@@ -1916,11 +2148,27 @@ If 0, then only addresses matching the list will be allowed.  This lets you easi
 } ipfilter_t;
 */
 
-#define	MAX_IPFILTERS	1024
+#define	MAX_IPFILTERS	8192
 
 ipfilter_t	ipfilters[MAX_IPFILTERS];
 int		numipfilters;
 
+// compiled form of the ban filters, consulted by SV_FilterPacket.
+// StringToFilter masks whole octets, so there are at most 16 distinct masks;
+// filters are grouped by mask and each group keeps its compare values sorted,
+// a lookup is one binary search per mask in use instead of a walk of the list.
+typedef struct
+{
+	unsigned	mask;
+	int			first;
+	int			count;
+} ipfiltergroup_t;
+
+static unsigned			ipfilter_compare[MAX_IPFILTERS];
+static ipfiltergroup_t	ipfilter_groups[16];
+static int				ipfilter_numgroups;
+static qbool			ipfilter_dirty = true;
+
 ipfilter_t	ipvip[MAX_IPFILTERS];
 int		numipvips;
 
@@ -2156,6 +2404,7 @@ static void SV_AddIP_f (void)
 	}
 
 	ipfilters[i] = f;
+	ipfilter_dirty = true;
 }
 
 /*
@@ -2181,6 +2430,7 @@ static void SV_RemoveIP_f (void)
 			for (j=i+1 ; j<numipfilters ; j++)
 				ipfilters[j-1] = ipfilters[j];
 			numipfilters--;
+			ipfilter_dirty = true;
 			Con_Printf ("Removed.\n");
 			return;
 		}
@@ -2284,6 +2534,55 @@ void SV_SendBan (void)
 	NET_SendPacket (NS_SERVER, strlen(data), data, net_from);
 }
 
+/*
+=================
+SV_BuildIPFilterIndex
+
+Regroups the ban filters by mask, called lazily after the list changed
+=================
+*/
+static int SV_IPFilterCompare (const void *a, const void *b)
+{
+	const ipfilter_t *fa = *(const ipfilter_t **)a, *fb = *(const ipfilter_t **)b;
+
+	if (fa->mask != fb->mask)
+		return fa->mask < fb->mask ? -1 : 1;
+	if (fa->compare != fb->compare)
+		return fa->compare < fb->compare ? -1 : 1;
+	return 0;
+}
+
+static void SV_BuildIPFilterIndex (void)
+{
+	static ipfilter_t *sorted[MAX_IPFILTERS];
+	ipfiltergroup_t *g = NULL;
+	int i, n;
+
+	for (i = n = 0; i < numipfilters; i++)
+		if (ipfilters[i].type == ipft_ban)
+			sorted[n++] = &ipfilters[i];
+
+	qsort (sorted, n, sizeof(sorted[0]), SV_IPFilterCompare);
+
+	ipfilter_numgroups = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (!g || g->mask != sorted[i]->mask)
+		{
+			if (ipfilter_numgroups == sizeof(ipfilter_groups) / sizeof(ipfilter_groups[0]))
+				Sys_Error ("SV_BuildIPFilterIndex: too many filter masks");
+			g = &ipfilter_groups[ipfilter_numgroups++];
+			g->mask = sorted[i]->mask;
+			g->first = i;
+			g->count = 0;
+		}
+		ipfilter_compare[i] = sorted[i]->compare;
+		g->count++;
+	}
+
+	ipfilter_dirty = false;
+}
+
 /*
 =================
 SV_FilterPacket
@@ -2291,14 +2590,31 @@ SV_FilterPacket
 */
 qbool SV_FilterPacket (void)
 {
-	int		i;
-	unsigned	in;
+	int		i, lo, hi, mid;
+	unsigned	in, key;
+	ipfiltergroup_t *g;
+
+	if (ipfilter_dirty)
+		SV_BuildIPFilterIndex ();
 
 	in = *(unsigned *)net_from.ip;
 
-	for (i=0 ; i<numipfilters ; i++)
-		if ( ipfilters[i].type == ipft_ban && (in & ipfilters[i].mask) == ipfilters[i].compare )
-			return (int)filterban.value;
+	for (i = 0, g = ipfilter_groups; i < ipfilter_numgroups; i++, g++)
+	{
+		key = in & g->mask;
+		lo = g->first;
+		hi = g->first + g->count - 1;
+		while (lo <= hi)
+		{
+			mid = (lo + hi) >> 1;
+			if (ipfilter_compare[mid] == key)
+				return (int)filterban.value;
+			if (ipfilter_compare[mid] < key)
+				lo = mid + 1;
+			else
+				hi = mid - 1;
+		}
+	}
 
 	return !(int)filterban.value;
 }
@@ -2389,6 +2705,7 @@ void SV_RemoveBansIPFilter (int i)
 		ipfilters[i] = ipfilters[i + 1];
 
 	numipfilters--;
+	ipfilter_dirty = true;
 }
 
 void SV_CleanBansIPList (void)
@@ -2838,7 +3155,7 @@ void SV_SavePenaltyFilter (client_t *cl, filtertype_t type, double pentime)
 			return;
 		}
 
-	if (numpenfilters == MAX_IPFILTERS)
+	if (numpenfilters == MAX_PENFILTERS)
 	{
 		return;
 	}
@@ -2904,8 +3221,11 @@ static void SV_ReadPackets (void)
 	// now deal with new packets
 	while (NET_GetPacket(NS_SERVER))
 	{
+		svs.stats.total_packets++;
+
 		if (SV_FilterPacket ())
 		{
+			svs.stats.filtered_packets++;
 			SV_SendBan ();	// tell them we aren't listening...
 			continue;
 		}
@@ -2913,6 +3233,7 @@ static void SV_ReadPackets (void)
 		// check for connectionless packet (0xffffffff) first
 		if (*(int *)net_message.data == -1)
 		{
+			svs.stats.connectionless_packets++;
 			SV_ConnectionlessPacket ();
 			continue;
 		}
@@ -2925,26 +3246,15 @@ static void SV_ReadPackets (void)
 		qport = MSG_ReadShort () & 0xffff;
 
 		// check which client sent this packet
-		for (i=0, cl=svs.clients ; i<MAX_CLIENTS ; i++,cl++)
-		{
-			if (cl->state == cs_free)
-				continue;
-			if (!NET_CompareBaseAdr (net_from, cl->netchan.remote_address))
-				continue;
-			if (cl->netchan.qport != qport)
-				continue;
-			if (cl->netchan.remote_address.port != net_from.port)
-			{
-				Con_DPrintf ("SV_ReadPackets: fixing up a translated port\n");
-				cl->netchan.remote_address.port = net_from.port;
-			}
+		if (!(cl = SV_ClientHashFind (net_from, qport)))
+			continue;
 
-			break;
+		if (cl->netchan.remote_address.port != net_from.port)
+		{
+			Con_DPrintf ("SV_ReadPackets: fixing up a translated port\n");
+			cl->netchan.remote_address.port = net_from.port;
 		}
 
-		if (i == MAX_CLIENTS)
-			continue;
-
 		// ok, we know who sent this packet, but do we need to delay executing it?
 		if (cl->delay > 0)
 		{
@@ -3161,6 +3471,108 @@ static void PausedTic (void)
 	PR_PausedTic(Sys_DoubleTime() - sv.pausedsince);
 }
 
+/*
+==================
+Frame phase histograms
+
+SV_Frame feeds the time spent in each phase into svs.stats.phases,
+"framestats" and the status query read percentiles back out
+==================
+*/
+const char *sv_phasenames[SVPHASE_MAX] =
+{
+	"frame",
+	"readpackets",
+	"physics",
+	"runbots",
+	"sendclients",
+	"senddemo",
+	"mvdstream",
+	"heartbeat",
+	"netflush"
+};
+
+static int SV_PhaseBucket (unsigned int usec)
+{
+	int shift = 0;
+
+	if (usec < 2 * PHASE_SUBBUCKETS)
+		return usec;
+
+	while ((usec >> shift) >= 2 * PHASE_SUBBUCKETS)
+		shift++;
+
+	return (shift + 1) * PHASE_SUBBUCKETS + (usec >> shift) - PHASE_SUBBUCKETS;
+}
+
+// highest value which falls into the bucket
+static unsigned int SV_PhaseBucketValue (int bucket)
+{
+	int shift;
+
+	if (bucket < 2 * PHASE_SUBBUCKETS)
+		return bucket;
+
+	shift = bucket / PHASE_SUBBUCKETS - 1;
+	return (((unsigned int)(bucket % PHASE_SUBBUCKETS + PHASE_SUBBUCKETS + 1)) << shift) - 1;
+}
+
+void SV_PhaseRecord (svphase_t phase, double start)
+{
+	phasehist_t *h = &svs.stats.phases[phase];
+	double t = (Sys_DoubleTime () - start) * 1000000.0;
+	unsigned int usec;
+	int i;
+
+	usec = (unsigned int) bound(0, t, (1 << PHASE_MAXBITS) - 1);
+
+	// halve everything before the counters could wrap, this also makes
+	// very old samples count less
+	if (h->total >= 0x7fffffff)
+	{
+		h->total = 0;
+		for (i = 0; i < PHASE_BUCKETS; i++)
+		{
+			h->counts[i] >>= 1;
+			h->total += h->counts[i];
+		}
+	}
+
+	h->counts[SV_PhaseBucket (usec)]++;
+	h->total++;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+// returns the time in microseconds which p (0..1) of the samples did not exceed
+unsigned int SV_PhasePercentile (svphase_t phase, double p)
+{
+	phasehist_t *h = &svs.stats.phases[phase];
+	unsigned int want, seen = 0;
+	int i;
+
+	if (!h->total)
+		return 0;
+
+	want = (unsigned int) ceil (bound (0, p, 1) * h->total);
+	if (!want)
+		want = 1;
+
+	for (i = 0; i < PHASE_BUCKETS; i++)
+	{
+		seen += h->counts[i];
+		if (seen >= want)
+			return min (SV_PhaseBucketValue (i), h->max);
+	}
+
+	return h->max;
+}
+
+void SV_PhaseReset (void)
+{
+	memset (svs.stats.phases, 0, sizeof (svs.stats.phases));
+}
+
 /*
 ==================
 SV_Frame
@@ -3171,7 +3583,7 @@ void SV_Map (qbool now);
 void SV_Frame (double time1)
 {
 	static double start, end;
-	double demo_start, demo_end;
+	double demo_start, demo_end, phase_start;
 
 	start = Sys_DoubleTime ();
 	svs.stats.idle += start - end;
@@ -3200,7 +3612,9 @@ void SV_Frame (double time1)
 	// toggle the log buffer if full
 	SV_CheckLog ();
 
+	phase_start = Sys_DoubleTime ();
 	SV_MVDStream_Poll();
+	SV_PhaseRecord (SVPHASE_MVDSTREAM, phase_start);
 
 #ifdef SERVERONLY
 	// check for commands typed to the host
@@ -3216,20 +3630,28 @@ void SV_Frame (double time1)
 	SV_CheckVars ();
 
 	// get packets
+	phase_start = Sys_DoubleTime ();
 	SV_ReadPackets ();
+	SV_PhaseRecord (SVPHASE_READPACKETS, phase_start);
 
 	// move autonomous things around if enough time has passed
 	if (!sv.paused) {
+		phase_start = Sys_DoubleTime ();
 		SV_Physics();
+		SV_PhaseRecord (SVPHASE_PHYSICS, phase_start);
 #ifdef USE_PR2
+		phase_start = Sys_DoubleTime ();
 		SV_RunBots();
+		SV_PhaseRecord (SVPHASE_RUNBOTS, phase_start);
 #endif
 	}
 	else
 		PausedTic ();
 
 	// send messages back to the clients that had packets read this frame
+	phase_start = Sys_DoubleTime ();
 	SV_SendClientMessages ();
+	SV_PhaseRecord (SVPHASE_SENDCLIENTS, phase_start);
 
 #if defined(SERVERONLY) && defined(WWW_INTEGRATION)
 	Central_ProcessResponses();
@@ -3239,11 +3661,20 @@ void SV_Frame (double time1)
 	SV_SendDemoMessage();
 	demo_end = Sys_DoubleTime ();
 	svs.stats.demo += demo_end - demo_start;
+	SV_PhaseRecord (SVPHASE_SENDDEMO, demo_start);
 
 	// send a heartbeat to the master if needed
+	phase_start = Sys_DoubleTime ();
 	Master_Heartbeat ();
+	SV_PhaseRecord (SVPHASE_HEARTBEAT, phase_start);
+
+	// send all UDP packets queued during this frame
+	phase_start = Sys_DoubleTime ();
+	NET_SendFlush ();
+	SV_PhaseRecord (SVPHASE_NETFLUSH, phase_start);
 
 	// collect timing statistics
+	SV_PhaseRecord (SVPHASE_FRAME, start);
 	end = Sys_DoubleTime ();
 	svs.stats.active += end-start;
 	if (++svs.stats.count == STATFRAMES)
@@ -3252,9 +3683,25 @@ void SV_Frame (double time1)
 		svs.stats.latched_idle = svs.stats.idle;
 		svs.stats.latched_packets = svs.stats.packets;
 		svs.stats.latched_demo = svs.stats.demo;
+		svs.stats.latched_recv_batches = svs.stats.recv_batches;
+		svs.stats.latched_recv_batched = svs.stats.recv_batched;
+		svs.stats.latched_send_batches = svs.stats.send_batches;
+		svs.stats.latched_send_batched = svs.stats.send_batched;
+		svs.stats.latched_delta_hits = svs.stats.delta_hits;
+		svs.stats.latched_delta_misses = svs.stats.delta_misses;
+		svs.stats.latched_trace_hits = svs.stats.trace_hits;
+		svs.stats.latched_trace_misses = svs.stats.trace_misses;
 		svs.stats.active = 0;
 		svs.stats.idle = 0;
 		svs.stats.packets = 0;
+		svs.stats.recv_batches = 0;
+		svs.stats.recv_batched = 0;
+		svs.stats.send_batches = 0;
+		svs.stats.send_batched = 0;
+		svs.stats.delta_hits = 0;
+		svs.stats.delta_misses = 0;
+		svs.stats.trace_hits = 0;
+		svs.stats.trace_misses = 0;
 		svs.stats.count = 0;
 		svs.stats.demo = 0;
 	}
@@ -3280,6 +3727,7 @@ void SV_InitLocal (void)
 	extern	cvar_t	sv_friction;
 	extern	cvar_t	sv_waterfriction;
 	extern	cvar_t	sv_nailhack;
+	extern	cvar_t	sv_sendthreads, sv_viscache, sv_deltacache, sv_broadphase, sv_tracecache;
 
 	extern cvar_t	sv_maxpitch;
 	extern cvar_t	sv_minpitch;
@@ -3349,6 +3797,11 @@ void SV_InitLocal (void)
 	Cvar_Register (&vip_values);
 
 	Cvar_Register (&sv_nailhack);
+	Cvar_Register (&sv_sendthreads);
+	Cvar_Register (&sv_viscache);
+	Cvar_Register (&sv_deltacache);
+	Cvar_Register (&sv_broadphase);
+	Cvar_Register (&sv_tracecache);
 
 	Cvar_Register (&sv_mintic);
 	Cvar_Register (&sv_maxtic);
@@ -3424,6 +3877,8 @@ void SV_InitLocal (void)
 	Cvar_Register (&sv_kicktop);
 	//<-
 	Cvar_Register (&sv_allowlastscores);
+	Cvar_Register (&sv_allowmetrics);
+	Cvar_Register (&sv_metricslim);
 //	Cvar_Register (&sv_highchars);
 	Cvar_Register (&sv_phs);
 	Cvar_Register (&pausable);
@@ -3438,6 +3893,9 @@ void SV_InitLocal (void)
 
 	Cvar_Register (&sv_halflifebsp);
 	Cvar_Register (&sv_bspversion);
+	Cvar_Register (&sv_phsthreads);
+	Cvar_Register (&sv_phscache);
+	Cvar_Register (&sv_mapcache);
 	Cvar_Register (&sv_serveme_fix);
 
 #ifdef FTE_PEXT_FLOATCOORDS
@@ -3476,6 +3934,9 @@ void SV_InitLocal (void)
 	Cmd_AddCommand ("vip_listip", SV_ListIPVIP_f);
 	Cmd_AddCommand ("vip_writeip", SV_WriteIPVIP_f);
 
+	Cmd_AddCommand ("sv_broadphase_bench", SV_BroadphaseBench_f);
+	Cmd_AddCommand ("sv_hulltrace_bench", CM_HullTraceBench_f);
+
 
 	for (i=0 ; i<MAX_MODELS ; i++)
 		snprintf (localmodels[i], MODEL_NAME_LEN, "*%i", i);
@@ -878,6 +878,42 @@ void SV_UpdateClientStats (client_t *client)
 		}
 }
 
+/*
+=======================
+SV_FinishClientDatagram
+
+Appends everything that follows the entities and transmits
+=======================
+*/
+static void SV_FinishClientDatagram (client_t *client, sizebuf_t *msg)
+{
+#ifdef FTE_PEXT2_VOICECHAT
+	if (!SV_SkipCommsBotMessage(client))
+		SV_VoiceSendPacket(client, msg);
+#endif
+
+	// copy the accumulated multicast datagram
+	// for this client out to the message
+	if (client->datagram.overflowed)
+		Con_Printf ("WARNING: datagram overflowed for %s\n", client->name);
+	else
+		SZ_Write (msg, client->datagram.data, client->datagram.cursize);
+	SZ_Clear (&client->datagram);
+
+	// send deltas over reliable stream
+	if (Netchan_CanReliable (&client->netchan))
+		SV_UpdateClientStats (client);
+
+	if (msg->overflowed)
+	{
+		Con_Printf ("WARNING: msg overflowed for %s\n", client->name);
+		SZ_Clear (msg);
+	}
+
+	// send the datagram
+	Netchan_Transmit (&client->netchan, msg->cursize, msg->data);
+}
+
 /*
 =======================
 SV_SendClientDatagram
@@ -915,32 +951,188 @@ void SV_SendClientDatagram (client_t *client, int client_num)
 		// this will include clients, a packetentities, and
 		// possibly a nails update
 		SV_WriteEntitiesToClient(client, &msg, false);
+	}
 
-#ifdef FTE_PEXT2_VOICECHAT
-		SV_VoiceSendPacket(client, &msg);
-#endif
+	SV_FinishClientDatagram (client, &msg);
+}
+
+/*
+=============================================================================
+
+Parallel datagram building
+
+With sv_sendthreads > 0 SV_SendClientMessages first decides who gets a
+packet this frame, then the entity part of every datagram (the expensive
+SV_WriteEntitiesToClient) is built by a pool of worker threads plus the
+main thread, and finally all packets are finished and transmitted in
+client order, so the output does not depend on thread scheduling.
+
+=============================================================================
+*/
+
+cvar_t	sv_sendthreads = {"sv_sendthreads", "0"};
+
+#define MAX_SEND_THREADS 16
+
+typedef enum {
+	dg_none,		// nothing to send this frame
+	dg_reliable,	// not spawned yet, only the reliable stream
+	dg_full			// full datagram with entities
+} datagramtype_t;
+
+typedef struct
+{
+	datagramtype_t	type;
+	qbool			entities;	// SV_WriteEntitiesToClient pending
+	sizebuf_t		msg;
+	byte			buf[MAX_DATAGRAM];
+} clientdatagram_t;
+
+static clientdatagram_t	sv_datagrams[MAX_CLIENTS];
+static int				sv_buildlist[MAX_CLIENTS];
+static int				sv_numbuild;
+static int				sv_nextbuild;
+
+static int				sv_numsendthreads;
+static volatile qbool	sv_sendthreads_quit;
+static sys_mutex_t		*sv_buildlock;
+static sys_sem_t		*sv_buildstart, *sv_builddone;
+
+static void SV_BuildDatagrams (void)
+{
+	clientdatagram_t *d;
+	int i, n;
+
+	while (1)
+	{
+		Sys_MutexLock (sv_buildlock);
+		n = sv_nextbuild++;
+		Sys_MutexUnlock (sv_buildlock);
+
+		if (n >= sv_numbuild)
+			return;
+
+		i = sv_buildlist[n];
+		d = &sv_datagrams[i];
+		SV_WriteEntitiesToClient (&svs.clients[i], &d->msg, false);
 	}
+}
 
-	// copy the accumulated multicast datagram
-	// for this client out to the message
-	if (client->datagram.overflowed)
-		Con_Printf ("WARNING: datagram overflowed for %s\n", client->name);
-	else
-		SZ_Write (&msg, client->datagram.data, client->datagram.cursize);
-	SZ_Clear (&client->datagram);
+static DWORD WINAPI SV_SendThread (void *unused)
+{
+	while (1)
+	{
+		Sys_SemWait (sv_buildstart);
+		if (sv_sendthreads_quit)
+			break;
+		SV_BuildDatagrams ();
+		Sys_SemPost (sv_builddone);
+	}
 
-	// send deltas over reliable stream
-	if (Netchan_CanReliable (&client->netchan))
-		SV_UpdateClientStats (client);
+	Sys_SemPost (sv_builddone);
+	return 0;
+}
 
-	if (msg.overflowed)
+/*
+=======================
+SV_SetSendThreads
+
+Starts or stops worker threads to match sv_sendthreads
+=======================
+*/
+static void SV_SetSendThreads (void)
+{
+	int i, count = bound (0, (int)sv_sendthreads.value, MAX_SEND_THREADS);
+
+	if (count == sv_numsendthreads)
+		return;
+
+	if (!sv_buildlock)
 	{
-		Con_Printf ("WARNING: msg overflowed for %s\n", client->name);
-		SZ_Clear (&msg);
+		sv_buildlock = Sys_MutexCreate ();
+		sv_buildstart = Sys_SemCreate (0);
+		sv_builddone = Sys_SemCreate (0);
 	}
 
-	// send the datagram
-	Netchan_Transmit (&client->netchan, msg.cursize, buf);
+	// stop the old pool
+	sv_sendthreads_quit = true;
+	for (i = 0; i < sv_numsendthreads; i++)
+		Sys_SemPost (sv_buildstart);
+	for (i = 0; i < sv_numsendthreads; i++)
+		Sys_SemWait (sv_builddone);
+	sv_sendthreads_quit = false;
+
+	for (sv_numsendthreads = 0; sv_numsendthreads < count; sv_numsendthreads++)
+		Sys_CreateThread (SV_SendThread, NULL);
+
+	if (count)
+		Con_DPrintf ("Using %d threads to build client datagrams\n", count);
+}
+
+/*
+=======================
+SV_QueueClientDatagram
+
+Deferred version of SV_SendClientDatagram, writes the parts that touch
+shared state now and leaves the entities for SV_BuildDatagrams
+=======================
+*/
+static void SV_QueueClientDatagram (client_t *client, int client_num)
+{
+	clientdatagram_t *d = &sv_datagrams[client_num];
+
+	d->type = dg_full;
+	d->msg.data = d->buf;
+	d->msg.maxsize = sizeof(d->buf);
+	d->msg.cursize = 0;
+	d->msg.allowoverflow = true;
+	d->msg.overflowed = false;
+	d->entities = !SV_SkipCommsBotMessage(client);
+
+	if (d->entities)
+	{
+		// also writes to the demo and the client's edict
+		SV_WriteClientdataToMessage(client, &d->msg);
+		sv_buildlist[sv_numbuild++] = client_num;
+	}
+}
+
+/*
+=======================
+SV_FlushClientDatagrams
+
+Builds the queued datagrams in parallel and transmits them in client order
+=======================
+*/
+static void SV_FlushClientDatagrams (void)
+{
+	clientdatagram_t *d;
+	client_t *c;
+	int i, threads;
+
+	threads = min (sv_numsendthreads, sv_numbuild - 1);
+	sv_nextbuild = 0;
+	for (i = 0; i < threads; i++)
+		Sys_SemPost (sv_buildstart);
+	SV_BuildDatagrams ();
+	for (i = 0; i < threads; i++)
+		Sys_SemWait (sv_builddone);
+
+	for (i = 0, c = svs.clients, d = sv_datagrams; i < MAX_CLIENTS; i++, c++, d++)
+	{
+		if (d->type == dg_full)
+		{
+			SV_FinishClientDatagram (c, &d->msg);
+		}
+		else if (d->type == dg_reliable)
+		{
+			Netchan_Transmit (&c->netchan, c->datagram.cursize, c->datagram.data);	// just update reliable
+			c->datagram.cursize = 0;
+		}
+		d->type = dg_none;
+	}
+
+	sv_numbuild = 0;
 }
 
 /*
@@ -1073,10 +1265,17 @@ void SV_SendClientMessages (void)
 {
 	int			i, j;
 	client_t	*c;
+	qbool		parallel;
 
 	if (sv.state != ss_active)
 		return;
 
+	SV_SetSendThreads ();
+	SV_ClearEntityCaches ();
+
+	// NQ progs clear muzzleflashes while writing entities, that has to stay serial
+	parallel = sv_numsendthreads > 0 && !pr_nqprogs;
+
 	// update frags, names, etc
 	SV_UpdateToReliableMessages ();
 
@@ -1096,6 +1295,7 @@ void SV_SendClientMessages (void)
 		{
 			SV_DropClient(c);
 			c->drop = false;
+			SV_ClearEntityCaches (); // the game may have freed or spawned edicts
 			continue;
 		}
 
@@ -1154,6 +1354,7 @@ void SV_SendClientMessages (void)
 			SV_BroadcastPrintf (PRINT_HIGH, "%s overflowed\n", c->name);
 			Con_Printf ("WARNING: reliable overflow for %s\n",c->name);
 			SV_DropClient (c);
+			SV_ClearEntityCaches ();
 			c->send_message = true;
 			c->netchan.cleartime = 0;	// don't choke this message
 		}
@@ -1166,16 +1367,27 @@ void SV_SendClientMessages (void)
 		if (!sv.paused && !Netchan_CanPacket (&c->netchan))
 		{
 			c->chokecount++;
+			c->totalchokes++;
 			continue;		// bandwidth choke
 		}
 
-		if (c->state == cs_spawned)
+		if (parallel)
+		{
+			if (c->state == cs_spawned)
+				SV_QueueClientDatagram (c, i);
+			else
+				sv_datagrams[i].type = dg_reliable;
+		}
+		else if (c->state == cs_spawned)
 			SV_SendClientDatagram (c, i);
 		else {
 			Netchan_Transmit (&c->netchan, c->datagram.cursize, c->datagram.data);	// just update reliable
 			c->datagram.cursize = 0;
 		}
 	}
+
+	if (parallel)
+		SV_FlushClientDatagrams ();
 }
 
 void SV_MVDPings (void)
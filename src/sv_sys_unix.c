@@ -585,6 +585,77 @@ int Sys_CreateThread(DWORD (WINAPI *func)(void *), void *param)
     return 1;
 }
 
+struct sys_mutex_s
+{
+	pthread_mutex_t	mutex;
+};
+
+// no unnamed posix semaphores on every platform (OS X), so build one
+struct sys_sem_s
+{
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	int				value;
+};
+
+sys_mutex_t *Sys_MutexCreate (void)
+{
+	sys_mutex_t *m = (sys_mutex_t *) Q_malloc (sizeof(*m));
+
+	pthread_mutex_init (&m->mutex, NULL);
+	return m;
+}
+
+void Sys_MutexDestroy (sys_mutex_t *m)
+{
+	pthread_mutex_destroy (&m->mutex);
+	Q_free (m);
+}
+
+void Sys_MutexLock (sys_mutex_t *m)
+{
+	pthread_mutex_lock (&m->mutex);
+}
+
+void Sys_MutexUnlock (sys_mutex_t *m)
+{
+	pthread_mutex_unlock (&m->mutex);
+}
+
+sys_sem_t *Sys_SemCreate (int value)
+{
+	sys_sem_t *s = (sys_sem_t *) Q_malloc (sizeof(*s));
+
+	pthread_mutex_init (&s->mutex, NULL);
+	pthread_cond_init (&s->cond, NULL);
+	s->value = value;
+	return s;
+}
+
+void Sys_SemDestroy (sys_sem_t *s)
+{
+	pthread_cond_destroy (&s->cond);
+	pthread_mutex_destroy (&s->mutex);
+	Q_free (s);
+}
+
+void Sys_SemWait (sys_sem_t *s)
+{
+	pthread_mutex_lock (&s->mutex);
+	while (s->value <= 0)
+		pthread_cond_wait (&s->cond, &s->mutex);
+	s->value--;
+	pthread_mutex_unlock (&s->mutex);
+}
+
+void Sys_SemPost (sys_sem_t *s)
+{
+	pthread_mutex_lock (&s->mutex);
+	s->value++;
+	pthread_cond_signal (&s->cond);
+	pthread_mutex_unlock (&s->mutex);
+}
+
 // Function only_digits was copied from bind (DNS server) sources.
 static int only_digits(const char *s)
 {
@@ -758,12 +829,12 @@ int main (int argc, char *argv[])
 
 	while (1)
 	{
-		// select on the net socket and stdin
+		// select (epoll on linux) on the net sockets and stdin
 		// the only reason we have a timeout at all is so that if the last
 		// connected client times out, the message would not otherwise
 		// be printed until the next event.
 		if (!sys_simulation.value) {
-			stdin_ready = NET_Sleep((int)sys_select_timeout.value / 1000, do_stdin);
+			stdin_ready = NET_Sleep((int)sys_select_timeout.value, do_stdin);
 		}
 
 		// find time passed since last cycle
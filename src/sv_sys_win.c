@@ -710,6 +710,66 @@ int Sys_CreateThread(DWORD (WINAPI *func)(void *), void *param)
     return 1;
 }
 
+struct sys_mutex_s
+{
+	CRITICAL_SECTION	cs;
+};
+
+struct sys_sem_s
+{
+	HANDLE				handle;
+};
+
+sys_mutex_t *Sys_MutexCreate (void)
+{
+	sys_mutex_t *m = (sys_mutex_t *) Q_malloc (sizeof(*m));
+
+	InitializeCriticalSection (&m->cs);
+	return m;
+}
+
+void Sys_MutexDestroy (sys_mutex_t *m)
+{
+	DeleteCriticalSection (&m->cs);
+	Q_free (m);
+}
+
+void Sys_MutexLock (sys_mutex_t *m)
+{
+	EnterCriticalSection (&m->cs);
+}
+
+void Sys_MutexUnlock (sys_mutex_t *m)
+{
+	LeaveCriticalSection (&m->cs);
+}
+
+sys_sem_t *Sys_SemCreate (int value)
+{
+	sys_sem_t *s = (sys_sem_t *) Q_malloc (sizeof(*s));
+
+	s->handle = CreateSemaphore (NULL, value, 0x7fffffff, NULL);
+	if (!s->handle)
+		Sys_Error ("Sys_SemCreate: CreateSemaphore failed");
+	return s;
+}
+
+void Sys_SemDestroy (sys_sem_t *s)
+{
+	CloseHandle (s->handle);
+	Q_free (s);
+}
+
+void Sys_SemWait (sys_sem_t *s)
+{
+	WaitForSingleObject (s->handle, INFINITE);
+}
+
+void Sys_SemPost (sys_sem_t *s)
+{
+	ReleaseSemaphore (s->handle, 1, NULL);
+}
+
 #ifdef _CONSOLE
 /*
 ==================
@@ -754,7 +814,7 @@ int main(int ac, char *av[])
 		// connected client times out, the message would not otherwise
 		// be printed until the next event.
 		if (!sys_simulation.value) {
-			NET_Sleep((int)sys_select_timeout.value / 1000, false);
+			NET_Sleep((int)sys_select_timeout.value, false);
 		}
 
 		// find time passed since last cycle
@@ -850,7 +910,7 @@ int APIENTRY WinMain(   HINSTANCE   hInstance,
 		// connected client times out, the message would not otherwise
 		// be printed until the next event.
 		if (!sys_simulation.value) {
-			NET_Sleep((int)sys_select_timeout.value / 1000, false);
+			NET_Sleep((int)sys_select_timeout.value, false);
 		}
 
 		// find time passed since last cycle
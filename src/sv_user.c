@@ -3271,6 +3271,51 @@ USER CMD EXECUTION
 ===========================================================================
 */
 
+/*
+====================
+AddEdictToPmove
+
+Returns false once the physent list is full
+====================
+*/
+static qbool AddEdictToPmove (edict_t *check, int pl)
+{
+	physent_t	*pe;
+
+	if (check->v.owner == pl)
+		return true;		// player's own missile
+	if (check->v.solid == SOLID_BSP
+			|| check->v.solid == SOLID_BBOX
+			|| check->v.solid == SOLID_SLIDEBOX)
+	{
+		if (check == sv_player)
+			return true;
+
+		if (pmove.numphysent == MAX_PHYSENTS)
+			return false;
+		pe = &pmove.physents[pmove.numphysent];
+		pmove.numphysent++;
+
+		VectorCopy (check->v.origin, pe->origin);
+		pe->info = NUM_FOR_EDICT(check);
+		if (check->v.solid == SOLID_BSP) {
+			if ((unsigned)check->v.modelindex >= MAX_MODELS)
+				SV_Error ("AddLinksToPmove: check->v.modelindex >= MAX_MODELS");
+			pe->model = sv.models[(int)(check->v.modelindex)];
+			if (!pe->model)
+				SV_Error ("SOLID_BSP with a non-bsp model");
+		}
+		else
+		{
+			pe->model = NULL;
+			VectorCopy (check->v.mins, pe->mins);
+			VectorCopy (check->v.maxs, pe->maxs);
+		}
+	}
+
+	return true;
+}
+
 /*
 ====================
 AddLinksToPmove
@@ -3279,11 +3324,9 @@ AddLinksToPmove
 */
 static void AddLinksToPmove ( areanode_t *node )
 {
-	link_t		*l, *next;
-	edict_t		*check;
+	areabounds_t	*b = &node->bounds[AREA_SOLID];
 	int 		pl;
-	int 		i;
-	physent_t	*pe;
+	int 		i, j, numhits, hits[MAX_EDICTS];
 	vec3_t		pmove_mins, pmove_maxs;
 
 	for (i=0 ; i<3 ; i++)
@@ -3294,48 +3337,12 @@ static void AddLinksToPmove ( areanode_t *node )
 
 	pl = EDICT_TO_PROG(sv_player);
 
-	// touch linked edicts
-	for (l = node->solid_edicts.next ; l != &node->solid_edicts ; l = next)
+	// touch linked edicts which are in range
+	numhits = SV_AreaBoundsCull (b, pmove_mins, pmove_maxs, hits);
+	for (j = 0; j < numhits; j++)
 	{
-		next = l->next;
-		check = EDICT_FROM_AREA(l);
-
-		if (check->v.owner == pl)
-			continue;		// player's own missile
-		if (check->v.solid == SOLID_BSP
-				|| check->v.solid == SOLID_BBOX
-				|| check->v.solid == SOLID_SLIDEBOX)
-		{
-			if (check == sv_player)
-				continue;
-
-			for (i=0 ; i<3 ; i++)
-				if (check->v.absmin[i] > pmove_maxs[i]
-				|| check->v.absmax[i] < pmove_mins[i])
-					break;
-			if (i != 3)
-				continue;
-			if (pmove.numphysent == MAX_PHYSENTS)
-				return;
-			pe = &pmove.physents[pmove.numphysent];
-			pmove.numphysent++;
-
-			VectorCopy (check->v.origin, pe->origin);
-			pe->info = NUM_FOR_EDICT(check);
-			if (check->v.solid == SOLID_BSP) {
-				if ((unsigned)check->v.modelindex >= MAX_MODELS)
-					SV_Error ("AddLinksToPmove: check->v.modelindex >= MAX_MODELS");
-				pe->model = sv.models[(int)(check->v.modelindex)];
-				if (!pe->model)
-					SV_Error ("SOLID_BSP with a non-bsp model");
-			}
-			else
-			{
-				pe->model = NULL;
-				VectorCopy (check->v.mins, pe->mins);
-				VectorCopy (check->v.maxs, pe->maxs);
-			}
-		}
+		if (!AddEdictToPmove (b->edicts[hits[j]], pl))
+			return;
 	}
 
 	// recurse down both sides
@@ -3348,6 +3355,31 @@ static void AddLinksToPmove ( areanode_t *node )
 		AddLinksToPmove ( node->children[1] );
 }
 
+/*
+====================
+AddAreaEdictsToPmove
+
+Same for the other broadphases, through SV_AreaEdicts
+====================
+*/
+static void AddAreaEdictsToPmove (void)
+{
+	edict_t		*list[MAX_EDICTS];
+	vec3_t		pmove_mins, pmove_maxs;
+	int			i, count, pl = EDICT_TO_PROG(sv_player);
+
+	for (i=0 ; i<3 ; i++)
+	{
+		pmove_mins[i] = pmove.origin[i] - 256;
+		pmove_maxs[i] = pmove.origin[i] + 256;
+	}
+
+	count = SV_AreaEdicts (pmove_mins, pmove_maxs, list, sv.max_edicts, AREA_SOLID);
+	for (i = 0; i < count; i++)
+		if (!AddEdictToPmove (list[i], pl))
+			return;
+}
+
 int SV_PMTypeForClient (client_t *cl)
 {
 	if (cl->edict->v.movetype == MOVETYPE_NOCLIP) {
@@ -3548,7 +3580,10 @@ FIXME
 	// build physent list
 	pmove.numphysent = 1;
 	pmove.physents[0].model = sv.worldmodel;
-	AddLinksToPmove ( sv_areanodes );
+	if (SV_WorldUsesAreaNodes ())
+		AddLinksToPmove ( sv_areanodes );
+	else
+		AddAreaEdictsToPmove ();
 
 	// fill in movevars
 	movevars.entgravity = sv_client->entgravity;
@@ -151,4 +151,33 @@ void *Sys_DLProc (DL_t dl, const char *name);
 
 int  Sys_CreateThread(DWORD (WINAPI *func)(void *), void *param);
 
+// thread synchronization, objects are opaque and allocated by the Create calls
+typedef struct sys_mutex_s sys_mutex_t;
+typedef struct sys_sem_s sys_sem_t;
+
+sys_mutex_t *Sys_MutexCreate (void);
+void Sys_MutexDestroy (sys_mutex_t *mutex);
+void Sys_MutexLock (sys_mutex_t *mutex);
+void Sys_MutexUnlock (sys_mutex_t *mutex);
+
+sys_sem_t *Sys_SemCreate (int value);
+void Sys_SemDestroy (sys_sem_t *sem);
+void Sys_SemWait (sys_sem_t *sem);
+void Sys_SemPost (sys_sem_t *sem);
+
+// atomic operations on a 32 bit int shared between threads
+#ifdef _WIN32
+#define Sys_AtomicOr(p, v)			InterlockedOr((volatile LONG *)(p), (LONG)(v))
+#define Sys_AtomicAnd(p, v)			InterlockedAnd((volatile LONG *)(p), (LONG)(v))
+#define Sys_AtomicAdd(p, v)			InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))
+#define Sys_AtomicCas(p, old, new)	(InterlockedCompareExchange((volatile LONG *)(p), (LONG)(new), (LONG)(old)) == (LONG)(old))
+#define Sys_MemoryBarrier()			MemoryBarrier()
+#else
+#define Sys_AtomicOr(p, v)			__sync_fetch_and_or((p), (v))
+#define Sys_AtomicAnd(p, v)			__sync_fetch_and_and((p), (v))
+#define Sys_AtomicAdd(p, v)			__sync_fetch_and_add((p), (v))
+#define Sys_AtomicCas(p, old, new)	__sync_bool_compare_and_swap((p), (old), (new))
+#define Sys_MemoryBarrier()			__sync_synchronize()
+#endif
+
 #endif /* !__SYS_H__ */
@@ -21,6 +21,11 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "qwsvdef.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define WORLD_USE_SSE
+#include <xmmintrin.h>
+#endif
+
 /*
 
 entities never clip against themselves, or their owner
@@ -135,6 +140,22 @@ void InsertLinkAfter (link_t *l, link_t *after)
 
 //============================================================================
 
+// loose octree, the alternative to the area node tree (sv_broadphase 1).
+// An edict goes to the deepest level whose cells are at least as large as
+// its box, in the cell holding the center of the box.  Cells are looked up
+// with their bounds doubled, so the edict is always inside its cell.
+#define OCTREE_LEVELS	5
+
+typedef struct looseoctree_s
+{
+	vec3_t			origin;			// mins of the world
+	float			cellsize[OCTREE_LEVELS];
+	int				firstcell[OCTREE_LEVELS];
+	int				levelcount[OCTREE_LEVELS];	// edicts linked at each level
+	int				numcells;
+	areabounds_t	*cells;			// AREA_SOLID and AREA_TRIGGERS for each cell
+} looseoctree_t;
+
 // well, here should be all things related to world but atm it antilag only
 typedef struct world_s
 {
@@ -143,6 +164,10 @@ typedef struct world_s
 	laggedentinfo_t *lagents;
 	unsigned int maxlagents;
 // }
+
+	int				broadphase;		// sv_broadphase latched by SV_ClearWorld
+	looseoctree_t	octree;
+	link_t			octree_edicts;	// only so ent->e->area tells if an edict is linked
 } world_t;
 
 static world_t w;
@@ -150,19 +175,39 @@ static world_t w;
 areanode_t sv_areanodes[AREA_NODES];
 int sv_numareanodes;
 
+cvar_t	sv_broadphase = {"sv_broadphase", "0"};	// 0 area node tree, 1 loose octree, next map
+cvar_t	sv_tracecache = {"sv_tracecache", "1"};
+
+// results of traces against the world hulls, which never change during a map.
+// Lookups hash the endpoints rounded to 1/8 unit but only an exact match is
+// a hit, so a cached trace is always the one CM_HullTrace would return.
+// Only used from the main thread.
+#define	TRACECACHE_SIZE	4096		// must be a power of two
+
+typedef struct
+{
+	unsigned int	mapgen;			// entry is stale unless this matches tracecache_mapgen
+	hull_t			*hull;
+	vec3_t			start, end;
+	trace_t			trace;
+} tracecache_t;
+
+static tracecache_t	tracecache[TRACECACHE_SIZE];
+static unsigned int	tracecache_mapgen = 1;
+
 /*
 ===============
 SV_CreateAreaNode
 ===============
 */
-areanode_t *SV_CreateAreaNode (int depth, vec3_t mins, vec3_t maxs)
+static areanode_t *SV_CreateAreaNode (areanode_t *nodes, int *numnodes, int depth, vec3_t mins, vec3_t maxs)
 {
 	areanode_t	*anode;
 	vec3_t		size;
 	vec3_t		mins1, maxs1, mins2, maxs2;
 
-	anode = &sv_areanodes[sv_numareanodes];
-	sv_numareanodes++;
+	anode = &nodes[*numnodes];
+	(*numnodes)++;
 
 	ClearLink (&anode->trigger_edicts);
 	ClearLink (&anode->solid_edicts);
@@ -188,12 +233,78 @@ areanode_t *SV_CreateAreaNode (int depth, vec3_t mins, vec3_t maxs)
 
 	maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
 
-	anode->children[0] = SV_CreateAreaNode (depth+1, mins2, maxs2);
-	anode->children[1] = SV_CreateAreaNode (depth+1, mins1, maxs1);
+	anode->children[0] = SV_CreateAreaNode (nodes, numnodes, depth+1, mins2, maxs2);
+	anode->children[1] = SV_CreateAreaNode (nodes, numnodes, depth+1, mins1, maxs1);
 
 	return anode;
 }
 
+static void SV_AreaBoundsFree (areabounds_t *b)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		Q_free (b->mins[i]);
+		Q_free (b->maxs[i]);
+	}
+	Q_free (b->edicts);
+	b->count = b->size = 0;
+}
+
+static void SV_FreeAreaNodes (areanode_t *nodes)
+{
+	int i;
+
+	for (i = 0; i < AREA_NODES; i++)
+	{
+		SV_AreaBoundsFree (&nodes[i].bounds[AREA_SOLID]);
+		SV_AreaBoundsFree (&nodes[i].bounds[AREA_TRIGGERS]);
+	}
+}
+
+static int SV_InitAreaNodes (areanode_t *nodes, vec3_t mins, vec3_t maxs)
+{
+	int numnodes = 0;
+
+	SV_FreeAreaNodes (nodes);
+	memset (nodes, 0, AREA_NODES * sizeof(areanode_t));
+	SV_CreateAreaNode (nodes, &numnodes, 0, mins, maxs);
+	return numnodes;
+}
+
+static void SV_FreeOctree (looseoctree_t *o)
+{
+	int i;
+
+	for (i = 0; i < o->numcells * 2; i++)
+		SV_AreaBoundsFree (&o->cells[i]);
+	Q_free (o->cells);
+	memset (o, 0, sizeof(*o));
+}
+
+static void SV_InitOctree (looseoctree_t *o, vec3_t mins, vec3_t maxs)
+{
+	float size = 0;
+	int i, n;
+
+	SV_FreeOctree (o);
+
+	for (i = 0; i < 3; i++)
+		size = max (size, maxs[i] - mins[i]);
+	VectorCopy (mins, o->origin);
+
+	for (i = 0; i < OCTREE_LEVELS; i++)
+	{
+		n = 1 << i;
+		o->cellsize[i] = max (size, 1) / n;
+		o->firstcell[i] = o->numcells;
+		o->numcells += n * n * n;
+	}
+
+	o->cells = (areabounds_t *) Q_calloc (o->numcells * 2, sizeof(areabounds_t));
+}
+
 /*
 ===============
 SV_ClearWorld
@@ -201,11 +312,239 @@ SV_ClearWorld
 */
 void SV_ClearWorld (void)
 {
-	memset (sv_areanodes, 0, sizeof(sv_areanodes));
-	sv_numareanodes = 0;
-	SV_CreateAreaNode (0, sv.worldmodel->mins, sv.worldmodel->maxs);
+	sv_numareanodes = SV_InitAreaNodes (sv_areanodes, sv.worldmodel->mins, sv.worldmodel->maxs);
+
+	w.broadphase = bound (0, (int)sv_broadphase.value, 1);
+	ClearLink (&w.octree_edicts);
+	tracecache_mapgen++;	// new world hulls
+	if (w.broadphase)
+		SV_InitOctree (&w.octree, sv.worldmodel->mins, sv.worldmodel->maxs);
+	else
+		SV_FreeOctree (&w.octree);
+}
+
+
+/*
+===============
+SV_AreaBoundsAdd
+
+Appends ent to b, so the arrays stay in the same order as the link list
+===============
+*/
+static void SV_AreaBoundsAdd (areabounds_t *b, edict_t *ent)
+{
+	int i, n;
+
+	if (b->count == b->size)
+	{
+		n = b->size ? b->size * 2 : 16;	// multiple of 4 for SV_AreaBoundsCull
+		for (i = 0; i < 3; i++)
+		{
+			b->mins[i] = (float *) Q_realloc (b->mins[i], n * sizeof(float));
+			b->maxs[i] = (float *) Q_realloc (b->maxs[i], n * sizeof(float));
+		}
+		b->edicts = (edict_t **) Q_realloc (b->edicts, n * sizeof(edict_t *));
+		b->size = n;
+	}
+
+	n = b->count++;
+	for (i = 0; i < 3; i++)
+	{
+		b->mins[i][n] = ent->v.absmin[i];
+		b->maxs[i][n] = ent->v.absmax[i];
+	}
+	b->edicts[n] = ent;
+}
+
+static void SV_AreaBoundsRemove (areabounds_t *b, edict_t *ent)
+{
+	int i, n;
+
+	for (n = 0; n < b->count; n++)
+		if (b->edicts[n] == ent)
+			break;
+
+	if (n == b->count)
+		SV_Error ("SV_AreaBoundsRemove: edict %d not found", NUM_FOR_EDICT(ent));
+
+	b->count--;
+	if (n < b->count)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			memmove (b->mins[i] + n, b->mins[i] + n + 1, (b->count - n) * sizeof(float));
+			memmove (b->maxs[i] + n, b->maxs[i] + n + 1, (b->count - n) * sizeof(float));
+		}
+		memmove (b->edicts + n, b->edicts + n + 1, (b->count - n) * sizeof(edict_t *));
+	}
+}
+
+/*
+===============
+SV_OctreeCell
+
+Returns the AREA_SOLID bounds of the cell a box goes to, the trigger ones follow
+===============
+*/
+static areabounds_t *SV_OctreeCell (looseoctree_t *o, const vec3_t absmin, const vec3_t absmax)
+{
+	float extent = 0;
+	int i, level, n, c[3];
+
+	for (i = 0; i < 3; i++)
+		extent = max (extent, absmax[i] - absmin[i]);
+
+	for (level = OCTREE_LEVELS - 1; level > 0; level--)
+		if (extent <= o->cellsize[level])
+			break;
+
+	n = 1 << level;
+	for (i = 0; i < 3; i++)
+	{
+		c[i] = (int) floor ((0.5 * (absmin[i] + absmax[i]) - o->origin[i]) / o->cellsize[level]);
+		c[i] = bound (0, c[i], n - 1);
+	}
+
+	return &o->cells[(o->firstcell[level] + (c[2] * n + c[1]) * n + c[0]) * 2];
+}
+
+static int SV_OctreeLevel (looseoctree_t *o, areabounds_t *b)
+{
+	int level, cell = (b - o->cells) / 2;
+
+	for (level = OCTREE_LEVELS - 1; level > 0; level--)
+		if (cell >= o->firstcell[level])
+			break;
+
+	return level;
+}
+
+static void SV_OctreeAdd (looseoctree_t *o, areabounds_t *b, edict_t *ent)
+{
+	SV_AreaBoundsAdd (b, ent);
+	o->levelcount[SV_OctreeLevel (o, b)]++;
 }
 
+static void SV_OctreeRemove (looseoctree_t *o, areabounds_t *b, edict_t *ent)
+{
+	SV_AreaBoundsRemove (b, ent);
+	o->levelcount[SV_OctreeLevel (o, b)]--;
+}
+
+/*
+===============
+SV_OctreeEdicts
+
+SV_AreaEdicts for the loose octree, results come in cell order
+===============
+*/
+static int SV_OctreeEdicts (looseoctree_t *o, const vec3_t mins, const vec3_t maxs, edict_t **edicts, int max_edicts, int area)
+{
+	int level, n, i, x, y, z, lo[3], hi[3], numhits, hits[MAX_EDICTS], count = 0;
+	float half;
+	areabounds_t *cell, *b;
+	edict_t *touch;
+
+	for (level = 0; level < OCTREE_LEVELS; level++)
+	{
+		if (!o->levelcount[level])
+			continue;
+
+		n = 1 << level;
+		half = 0.5 * o->cellsize[level] + 1;	// touching boxes count, see SV_AreaBoundsCull
+		for (i = 0; i < 3; i++)
+		{
+			lo[i] = (int) floor ((mins[i] - half - o->origin[i]) / o->cellsize[level]);
+			hi[i] = (int) floor ((maxs[i] + half - o->origin[i]) / o->cellsize[level]);
+			lo[i] = bound (0, lo[i], n - 1);
+			hi[i] = bound (0, hi[i], n - 1);
+		}
+
+		for (z = lo[2]; z <= hi[2]; z++)
+		for (y = lo[1]; y <= hi[1]; y++)
+		{
+			cell = &o->cells[(o->firstcell[level] + (z * n + y) * n + lo[0]) * 2];
+			for (x = lo[0]; x <= hi[0]; x++, cell += 2)
+			{
+				b = &cell[area == AREA_SOLID ? AREA_SOLID : AREA_TRIGGERS];
+				if (!b->count)
+					continue;
+
+				numhits = SV_AreaBoundsCull (b, mins, maxs, hits);
+				for (i = 0; i < numhits; i++)
+				{
+					touch = b->edicts[hits[i]];
+					if (touch->v.solid == SOLID_NOT)
+						continue;
+
+					if (count == max_edicts)
+						return count;
+					edicts[count++] = touch;
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+/*
+===============
+SV_AreaBoundsCull
+
+Same test as the old per edict check:
+	mins[0] > absmax[0] || ... || maxs[0] < absmin[0] || ... rejects
+===============
+*/
+int SV_AreaBoundsCull (const areabounds_t *b, const vec3_t mins, const vec3_t maxs, int *hits)
+{
+	int i = 0, numhits = 0;
+
+#ifdef WORLD_USE_SSE
+	__m128 mn0 = _mm_set1_ps (mins[0]), mn1 = _mm_set1_ps (mins[1]), mn2 = _mm_set1_ps (mins[2]);
+	__m128 mx0 = _mm_set1_ps (maxs[0]), mx1 = _mm_set1_ps (maxs[1]), mx2 = _mm_set1_ps (maxs[2]);
+	__m128 out;
+	int mask;
+
+	// cmpgt/cmplt are false for NaN just like the scalar > and <
+
+	for ( ; i + 4 <= b->count; i += 4)
+	{
+		out = _mm_or_ps (_mm_cmpgt_ps (mn0, _mm_loadu_ps (b->maxs[0] + i)),
+			  _mm_or_ps (_mm_cmpgt_ps (mn1, _mm_loadu_ps (b->maxs[1] + i)),
+						 _mm_cmpgt_ps (mn2, _mm_loadu_ps (b->maxs[2] + i))));
+		out = _mm_or_ps (out,
+			  _mm_or_ps (_mm_cmplt_ps (mx0, _mm_loadu_ps (b->mins[0] + i)),
+			  _mm_or_ps (_mm_cmplt_ps (mx1, _mm_loadu_ps (b->mins[1] + i)),
+						 _mm_cmplt_ps (mx2, _mm_loadu_ps (b->mins[2] + i)))));
+
+		mask = ~_mm_movemask_ps (out) & 15;
+		if (mask & 1)
+			hits[numhits++] = i;
+		if (mask & 2)
+			hits[numhits++] = i + 1;
+		if (mask & 4)
+			hits[numhits++] = i + 2;
+		if (mask & 8)
+			hits[numhits++] = i + 3;
+	}
+#endif
+
+	for ( ; i < b->count; i++)
+	{
+		if (mins[0] > b->maxs[0][i]
+			|| mins[1] > b->maxs[1][i]
+			|| mins[2] > b->maxs[2][i]
+			|| maxs[0] < b->mins[0][i]
+			|| maxs[1] < b->mins[1][i]
+			|| maxs[2] < b->mins[2][i])
+			continue;
+
+		hits[numhits++] = i;
+	}
+
+	return numhits;
+}
 
 /*
 ===============
@@ -218,42 +557,42 @@ void SV_UnlinkEdict (edict_t *ent)
 		return;		// not linked in anywhere
 	RemoveLink (&ent->e->area);
 	ent->e->area.prev = ent->e->area.next = NULL;
+
+	if (ent->e->areabounds)
+	{
+		if (w.broadphase)
+			SV_OctreeRemove (&w.octree, ent->e->areabounds, ent);
+		else
+			SV_AreaBoundsRemove (ent->e->areabounds, ent);
+		ent->e->areabounds = NULL;
+	}
 }
 
 /*
 ====================
-SV_AreaEdicts
+SV_AreaNodeEdicts
 ====================
 */
-int SV_AreaEdicts (vec3_t mins, vec3_t maxs, edict_t **edicts, int max_edicts, int area)
+static int SV_AreaNodeEdicts (areanode_t *node, const vec3_t mins, const vec3_t maxs, edict_t **edicts, int max_edicts, int area)
 {
-	link_t		*l, *start;
 	edict_t		*touch;
+	int			i, numhits, hits[MAX_EDICTS];
 	int			stackdepth = 0, count = 0;
-	areanode_t	*localstack[AREA_NODES], *node = sv_areanodes;
+	areanode_t	*localstack[AREA_NODES];
+	areabounds_t *b;
 
 // touch linked edicts
 	while (1)
 	{
-		if (area == AREA_SOLID)
-			start = &node->solid_edicts;
-		else
-			start = &node->trigger_edicts;
+		b = &node->bounds[area == AREA_SOLID ? AREA_SOLID : AREA_TRIGGERS];
+		numhits = SV_AreaBoundsCull (b, mins, maxs, hits);
 
-		for (l = start->next ; l != start ; l = l->next)
+		for (i = 0; i < numhits; i++)
 		{
-			touch = EDICT_FROM_AREA(l);
+			touch = b->edicts[hits[i]];
 			if (touch->v.solid == SOLID_NOT)
 				continue;
 
-			if (mins[0] > touch->v.absmax[0]
-						 || mins[1] > touch->v.absmax[1]
-						 || mins[2] > touch->v.absmax[2]
-						 || maxs[0] < touch->v.absmin[0]
-						 || maxs[1] < touch->v.absmin[1]
-						 || maxs[2] < touch->v.absmin[2])
-				continue;
-
 			if (count == max_edicts)
 				return count;
 			edicts[count++] = touch;
@@ -289,6 +628,69 @@ checkstack:
 	return count;
 }
 
+// the last area queries, replayed by sv_broadphase_bench,
+// only recorded after "sv_broadphase_bench record"
+#define MAX_AREA_QUERIES 4096
+
+typedef struct
+{
+	vec3_t	mins, maxs;
+	int		area;
+} areaquery_t;
+
+static areaquery_t	areaqueries[MAX_AREA_QUERIES];
+static int			numareaqueries;
+static qbool		recordareaqueries;
+
+static void SV_RecordAreaQuery (const vec3_t mins, const vec3_t maxs, int area)
+{
+	areaquery_t *q = &areaqueries[Sys_AtomicAdd (&numareaqueries, 1) & (MAX_AREA_QUERIES - 1)];
+
+	VectorCopy (mins, q->mins);
+	VectorCopy (maxs, q->maxs);
+	q->area = area;
+}
+
+/*
+====================
+SV_AreaEdicts
+====================
+*/
+int SV_AreaEdicts (vec3_t mins, vec3_t maxs, edict_t **edicts, int max_edicts, int area)
+{
+	if (recordareaqueries)
+		SV_RecordAreaQuery (mins, maxs, area);
+
+	if (w.broadphase)
+		return SV_OctreeEdicts (&w.octree, mins, maxs, edicts, max_edicts, area);
+
+	return SV_AreaNodeEdicts (sv_areanodes, mins, maxs, edicts, max_edicts, area);
+}
+
+/*
+====================
+SV_AreaNodeForBox
+
+Finds the first node that the box crosses
+====================
+*/
+static areanode_t *SV_AreaNodeForBox (areanode_t *node, const vec3_t absmin, const vec3_t absmax)
+{
+	while (1)
+	{
+		if (node->axis == -1)
+			break;
+		if (absmin[node->axis] > node->dist)
+			node = node->children[0];
+		else if (absmax[node->axis] < node->dist)
+			node = node->children[1];
+		else
+			break;		// crosses the node
+	}
+
+	return node;
+}
+
 /*
 ====================
 SV_TouchLinks
@@ -396,26 +798,32 @@ void SV_LinkEdict (edict_t *ent, qbool touch_triggers)
 	if (ent->v.solid == SOLID_NOT)
 		return;
 
-// find the first node that the ent's box crosses
-	node = sv_areanodes;
-	while (1)
+	if (w.broadphase)
 	{
-		if (node->axis == -1)
-			break;
-		if (ent->v.absmin[node->axis] > node->dist)
-			node = node->children[0];
-		else if (ent->v.absmax[node->axis] < node->dist)
-			node = node->children[1];
-		else
-			break;		// crosses the node
-	}
-	
-// link it in	
+		areabounds_t *cell = SV_OctreeCell (&w.octree, ent->v.absmin, ent->v.absmax);
 
-	if (ent->v.solid == SOLID_TRIGGER)
-		InsertLinkBefore (&ent->e->area, &node->trigger_edicts);
+		ent->e->areabounds = &cell[ent->v.solid == SOLID_TRIGGER ? AREA_TRIGGERS : AREA_SOLID];
+		InsertLinkBefore (&ent->e->area, &w.octree_edicts);
+		SV_OctreeAdd (&w.octree, ent->e->areabounds, ent);
+	}
 	else
-		InsertLinkBefore (&ent->e->area, &node->solid_edicts);
+	{
+		// find the first node that the ent's box crosses
+		node = SV_AreaNodeForBox (sv_areanodes, ent->v.absmin, ent->v.absmax);
+
+		// link it in
+		if (ent->v.solid == SOLID_TRIGGER)
+		{
+			InsertLinkBefore (&ent->e->area, &node->trigger_edicts);
+			ent->e->areabounds = &node->bounds[AREA_TRIGGERS];
+		}
+		else
+		{
+			InsertLinkBefore (&ent->e->area, &node->solid_edicts);
+			ent->e->areabounds = &node->bounds[AREA_SOLID];
+		}
+		SV_AreaBoundsAdd (ent->e->areabounds, ent);
+	}
 	
 // if touch_triggers, touch all entities at this node and decend for more
 	if (touch_triggers)
@@ -424,6 +832,108 @@ void SV_LinkEdict (edict_t *ent, qbool touch_triggers)
 
 
 
+/*
+====================
+SV_BroadphaseBench_f
+
+"record" starts recording area queries, without it both an area node tree
+and a loose octree are built from the linked edicts, the recorded queries
+replayed against each and checked to agree
+====================
+*/
+static int SV_EdictPtrCompare (const void *a, const void *b)
+{
+	const edict_t *ea = *(const edict_t **)a, *eb = *(const edict_t **)b;
+
+	return ea < eb ? -1 : ea > eb;
+}
+
+void SV_BroadphaseBench_f (void)
+{
+	static areanode_t	nodes[AREA_NODES];
+	static edict_t		*list1[MAX_EDICTS], *list2[MAX_EDICTS];
+	looseoctree_t		octree;
+	areabounds_t		*cell;
+	areaquery_t			*q;
+	edict_t				*ent;
+	int					e, i, j, n1, n2, area, count, loops, linked = 0, mismatches = 0;
+	double				start, t_nodes, t_octree;
+
+	if (sv.state != ss_active)
+	{
+		Con_Printf ("Not running a map\n");
+		return;
+	}
+
+	if (Cmd_Argc () > 1 && !strcmp (Cmd_Argv (1), "record"))
+	{
+		numareaqueries = 0;
+		recordareaqueries = true;
+		Con_Printf ("Recording area queries, run %s again to replay them\n", Cmd_Argv (0));
+		return;
+	}
+
+	recordareaqueries = false;
+
+	count = min (numareaqueries, MAX_AREA_QUERIES);
+	if (!count)
+	{
+		Con_Printf ("No area queries recorded, start with \"%s record\"\n", Cmd_Argv (0));
+		return;
+	}
+
+	loops = Cmd_Argc () > 1 ? bound (1, Q_atoi (Cmd_Argv (1)), 1000) : 10;
+
+	memset (&octree, 0, sizeof(octree));
+	SV_InitOctree (&octree, sv.worldmodel->mins, sv.worldmodel->maxs);
+	SV_InitAreaNodes (nodes, sv.worldmodel->mins, sv.worldmodel->maxs);
+
+	for (e = 1; e < sv.num_edicts; e++)
+	{
+		ent = EDICT_NUM (e);
+		if (ent->e->free || !ent->e->area.prev)
+			continue;
+
+		area = ent->v.solid == SOLID_TRIGGER ? AREA_TRIGGERS : AREA_SOLID;
+		SV_AreaBoundsAdd (&SV_AreaNodeForBox (nodes, ent->v.absmin, ent->v.absmax)->bounds[area], ent);
+		cell = SV_OctreeCell (&octree, ent->v.absmin, ent->v.absmax);
+		SV_OctreeAdd (&octree, &cell[area], ent);
+		linked++;
+	}
+
+	// same answers?
+	for (i = 0, q = areaqueries; i < count; i++, q++)
+	{
+		n1 = SV_AreaNodeEdicts (nodes, q->mins, q->maxs, list1, sv.max_edicts, q->area);
+		n2 = SV_OctreeEdicts (&octree, q->mins, q->maxs, list2, sv.max_edicts, q->area);
+		qsort (list1, n1, sizeof(list1[0]), SV_EdictPtrCompare);
+		qsort (list2, n2, sizeof(list2[0]), SV_EdictPtrCompare);
+		if (n1 != n2 || memcmp (list1, list2, n1 * sizeof(list1[0])))
+			mismatches++;
+	}
+
+	start = Sys_DoubleTime ();
+	for (j = 0; j < loops; j++)
+		for (i = 0, q = areaqueries; i < count; i++, q++)
+			SV_AreaNodeEdicts (nodes, q->mins, q->maxs, list1, sv.max_edicts, q->area);
+	t_nodes = Sys_DoubleTime () - start;
+
+	start = Sys_DoubleTime ();
+	for (j = 0; j < loops; j++)
+		for (i = 0, q = areaqueries; i < count; i++, q++)
+			SV_OctreeEdicts (&octree, q->mins, q->maxs, list2, sv.max_edicts, q->area);
+	t_octree = Sys_DoubleTime () - start;
+
+	Con_Printf ("%d edicts, %d queries x %d\n", linked, count, loops);
+	Con_Printf ("area nodes : %8.3f ms, %6.3f us/query\n", t_nodes * 1000, t_nodes * 1000000 / (count * loops));
+	Con_Printf ("octree     : %8.3f ms, %6.3f us/query\n", t_octree * 1000, t_octree * 1000000 / (count * loops));
+	if (mismatches)
+		Con_Printf ("%d queries gave different edicts\n", mismatches);
+
+	SV_FreeAreaNodes (nodes);
+	SV_FreeOctree (&octree);
+}
+
 /*
 ===============================================================================
  
@@ -469,6 +979,49 @@ edict_t	*SV_TestEntityPosition (edict_t *ent)
 	return NULL;
 }
 
+/*
+==================
+SV_WorldHullTrace
+
+CM_HullTrace against one of the world hulls, answered from tracecache
+when the same trace was done before on this map
+==================
+*/
+static trace_t SV_WorldHullTrace (hull_t *hull, vec3_t start, vec3_t end)
+{
+	unsigned int key;
+	tracecache_t *tc;
+	int i;
+
+	if (!(int)sv_tracecache.value || hull < sv.worldmodel->hulls || hull >= sv.worldmodel->hulls + MAX_MAP_HULLS)
+		return CM_HullTrace (hull, start, end);
+
+	key = (unsigned int)(hull - sv.worldmodel->hulls);
+	for (i = 0; i < 3; i++)
+	{
+		key = key * 0x9E3779B1 + (unsigned int)Q_rint (start[i] * 8);
+		key = key * 0x9E3779B1 + (unsigned int)Q_rint (end[i] * 8);
+	}
+	tc = &tracecache[(key ^ (key >> 16)) & (TRACECACHE_SIZE - 1)];
+
+	if (tc->mapgen == tracecache_mapgen && tc->hull == hull
+		&& tc->start[0] == start[0] && tc->start[1] == start[1] && tc->start[2] == start[2]
+		&& tc->end[0] == end[0] && tc->end[1] == end[1] && tc->end[2] == end[2])
+	{
+		svs.stats.trace_hits++;
+		return tc->trace;
+	}
+
+	svs.stats.trace_misses++;
+	tc->trace = CM_HullTrace (hull, start, end);
+	tc->mapgen = tracecache_mapgen;
+	tc->hull = hull;
+	VectorCopy (start, tc->start);
+	VectorCopy (end, tc->end);
+
+	return tc->trace;
+}
+
 /*
 ==================
 SV_ClipMoveToEntity
@@ -496,7 +1049,10 @@ trace_t SV_ClipMoveToEntity (edict_t *ent, vec3_t *eorg, vec3_t start, vec3_t mi
 	VectorSubtract (end, offset, end_l);
 
 	// trace a line through the apropriate clipping hull
-	trace = CM_HullTrace (hull, start_l, end_l);
+	if (ent == sv.edicts)
+		trace = SV_WorldHullTrace (hull, start_l, end_l);
+	else
+		trace = CM_HullTrace (hull, start_l, end_l);
 
 	// fix trace up by the offset
 	VectorAdd (trace.endpos, offset, trace.endpos);
@@ -615,6 +1171,11 @@ void SV_MoveBounds (vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, vec3_t b
 
 //=============================================
 
+qbool SV_WorldUsesAreaNodes (void)
+{
+	return !w.broadphase;
+}
+
 void SV_AntilagReset (edict_t *ent)
 {
 	if (ent->e->entnum == 0 || ent->e->entnum > MAX_CLIENTS)
@@ -653,15 +1214,23 @@ void SV_AntilagClipSetUp ( areanode_t *node, moveclip_t *clip )
 void SV_AntilagClipCheck ( areanode_t *node, moveclip_t *clip )
 {
 	trace_t trace;
-	edict_t *touch;
-	vec3_t lp;
-	int i;
-
-	for (i = 0; i < w.maxlagents; i++)
+	edict_t *touch, *candidates[MAX_CLIENTS];
+	vec3_t lp, lagged[MAX_CLIENTS];
+	float lmins[3][MAX_CLIENTS], lmaxs[3][MAX_CLIENTS];
+	int i, j, numhits, hits[MAX_CLIENTS];
+	areabounds_t b;
+
+	// gather the boxes of the lagged ents first and reject them in one go
+	memset (&b, 0, sizeof(b));
+	for (j = 0; j < 3; j++)
 	{
-		if (clip->trace.allsolid)
-			return; // return!!!
+		b.mins[j] = lmins[j];
+		b.maxs[j] = lmaxs[j];
+	}
+	b.edicts = candidates;
 
+	for (i = 0; i < w.maxlagents && i < MAX_CLIENTS; i++)
+	{
 		if (!w.lagents[i].present)
 			continue;
 
@@ -676,15 +1245,24 @@ void SV_AntilagClipCheck ( areanode_t *node, moveclip_t *clip )
 		if ((clip->type & MOVE_NOMONSTERS) && touch->v.solid != SOLID_BSP)
 			continue;
 
-		VectorInterpolate(touch->v.origin, w.lagentsfrac, w.lagents[i].laggedpos, lp);
+		VectorInterpolate(touch->v.origin, w.lagentsfrac, w.lagents[i].laggedpos, lagged[b.count]);
+		for (j = 0; j < 3; j++)
+		{
+			lmins[j][b.count] = lagged[b.count][j] + touch->v.mins[j];
+			lmaxs[j][b.count] = lagged[b.count][j] + touch->v.maxs[j];
+		}
+		candidates[b.count++] = touch;
+	}
 
-		if (   clip->boxmins[0] > lp[0]+touch->v.maxs[0]
-			|| clip->boxmins[1] > lp[1]+touch->v.maxs[1]
-			|| clip->boxmins[2] > lp[2]+touch->v.maxs[2]
-			|| clip->boxmaxs[0] < lp[0]+touch->v.mins[0]
-			|| clip->boxmaxs[1] < lp[1]+touch->v.mins[1]
-			|| clip->boxmaxs[2] < lp[2]+touch->v.mins[2] )
-			continue;
+	numhits = SV_AreaBoundsCull (&b, clip->boxmins, clip->boxmaxs, hits);
+
+	for (i = 0; i < numhits; i++)
+	{
+		if (clip->trace.allsolid)
+			return; // return!!!
+
+		touch = candidates[hits[i]];
+		VectorCopy (lagged[hits[i]], lp);
 
 		if (clip->passedict && clip->passedict->v.size[0] && !touch->v.size[0])
 			continue;	// points never interact
@@ -28,6 +28,20 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define MOVE_LAGGED		64	//trace touches current last-known-state, instead of actual ents (just affects players for now)
 // }
 
+// bounds of the edicts linked to one area node list, stored as separate
+// arrays in link order so they can be rejected several at a time
+typedef struct areabounds_s
+{
+	int		count;
+	int		size;
+	float	*mins[3];
+	float	*maxs[3];
+	struct edict_s	**edicts;
+} areabounds_t;
+
+#define AREA_SOLID	0
+#define AREA_TRIGGERS	1
+
 typedef struct areanode_s
 {
 	int		axis;		// -1 = leaf node
@@ -35,11 +49,9 @@ typedef struct areanode_s
 	struct areanode_s	*children[2];
 	link_t	trigger_edicts;
 	link_t	solid_edicts;
+	areabounds_t	bounds[2];	// AREA_SOLID and AREA_TRIGGERS mirrors of the lists
 } areanode_t;
 
-#define AREA_SOLID	0
-#define AREA_TRIGGERS	1
-
 #define	AREA_DEPTH	4
 #define	AREA_NODES	32
 
@@ -80,6 +92,15 @@ trace_t SV_Trace (vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, int type,
 
 int SV_AreaEdicts (vec3_t mins, vec3_t maxs, edict_t **edicts, int max_edicts, int area);
 
+int SV_AreaBoundsCull (const areabounds_t *b, const vec3_t mins, const vec3_t maxs, int *hits);
+// fills hits with the indexes of the boxes in b which touch mins/maxs,
+// in link order, and returns how many
+
 void SV_AntilagReset (edict_t *ent);
 
+qbool SV_WorldUsesAreaNodes (void);
+// false when sv_broadphase put the edicts in the loose octree instead of sv_areanodes
+
+void SV_BroadphaseBench_f (void);
+
 #endif /* !__WORLD_H__ */